@@ -14,12 +14,9 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include "array.h"
-struct array {
-        int     em_size;
-        int     em_cnt;
-        int     buff_size;
-        void    *buff;
-};
+//set on an array from array_init, what is in the caller's memory is never freed
+#define ARRAY_EXTERN_SELF       1
+#define ARRAY_EXTERN_BUFF       2
 
 struct array *array_create(int em_size)
 {
@@ -35,29 +32,70 @@ struct array *array_create(int em_size)
         return p;
 }
 
+//'arr' is embedded in the caller, the first 'buff_cnt' elements go to 'buff' when it is given
+int array_init(struct array *arr, int em_size, void *buff, size_t buff_cnt)
+{
+        assert(arr);
+        assert(em_size > 0);
+
+        memset(arr, 0, sizeof(struct array));
+
+        arr->em_size = em_size;
+        arr->flag = ARRAY_EXTERN_SELF;
+        if (buff) {
+                arr->buff = buff;
+                arr->buff_size = em_size * buff_cnt;
+                arr->flag |= ARRAY_EXTERN_BUFF;
+        }
+
+        return 0;
+}
+
 int array_release(struct array *arr)
 {
         assert(arr);
-        if (arr->buff)
+        if (arr->buff && (arr->flag & ARRAY_EXTERN_BUFF) == 0)
                 free(arr->buff);
         
-        free(arr);
+        if ((arr->flag & ARRAY_EXTERN_SELF) == 0)
+                free(arr);
 
         return 0;
 }
-int array_reserve(struct array *arr, int em_cnt)
+
+static void *array_grow(struct array *arr, size_t size)
+{
+        void *buff;
+
+        if ((arr->flag & ARRAY_EXTERN_BUFF) == 0)
+                return realloc(arr->buff, size);
+
+        buff = malloc(size);
+        if (buff == NULL)
+                return NULL;
+
+        memcpy(buff, arr->buff, arr->em_cnt * arr->em_size);
+        arr->flag &= ~ARRAY_EXTERN_BUFF;
+
+        return buff;
+}
+
+int array_reserve(struct array *arr, size_t em_cnt)
 {
         assert(arr);
 
         if (arr->em_cnt > em_cnt)
                 return 0;
 
+        if ((arr->flag & ARRAY_EXTERN_BUFF) && em_cnt * arr->em_size <= arr->buff_size)
+                return 0;
+
         arr->buff_size = em_cnt * arr->em_size;
-        arr->buff = realloc(arr->buff, arr->buff_size);
+        arr->buff = array_grow(arr, arr->buff_size);
 
         return 0;
 }
-int array_get(struct array *arr, int index, void *em)
+int array_get(struct array *arr, size_t index, void *em)
 {
         assert(arr);
         assert(em);
@@ -68,7 +106,7 @@ int array_get(struct array *arr, int index, void *em)
         return 0;
 }
 
-void *array_ptr(struct array *arr, int em_index)
+void *array_ptr(const struct array *arr, size_t em_index)
 {
         assert(arr);
         assert(em_index < arr->em_cnt);
@@ -78,7 +116,7 @@ void *array_ptr(struct array *arr, int em_index)
 
 int array_push(struct array *arr, const void *em)
 {
-        int new_size;
+        size_t new_size;
 
         assert(arr);
         assert(em);
@@ -86,7 +124,7 @@ int array_push(struct array *arr, const void *em)
         new_size = arr->em_size * (arr->em_cnt + 1);
         if (new_size > arr->buff_size) {
                 arr->buff_size = new_size * 2;
-                arr->buff = realloc(arr->buff, arr->buff_size);
+                arr->buff = array_grow(arr, arr->buff_size);
         }
 
         if (arr->buff == NULL)
@@ -100,18 +138,18 @@ int array_push(struct array *arr, const void *em)
         return 0;
 }
 
-int array_erase(struct array *arr, int em_index)
+int array_erase(struct array *arr, size_t em_index)
 {
         assert(arr);
         assert(em_index < arr->em_cnt);
 
-        memcpy((unsigned char *)arr->buff + em_index * arr->em_size, (unsigned char *)arr->buff + (em_index + 1) * arr->em_size, arr->em_size * (arr->em_cnt - em_index - 1));
+        memmove((unsigned char *)arr->buff + em_index * arr->em_size, (unsigned char *)arr->buff + (em_index + 1) * arr->em_size, arr->em_size * (arr->em_cnt - em_index - 1));
         arr->em_cnt--;
 
         return 0;
 }
 
-int array_size(struct array *arr)
+size_t array_size(const struct array *arr)
 {
 
         if (arr == NULL)
@@ -12,6 +12,8 @@
 #ifndef _ARRAY_H
 #define _ARRAY_H
 
+#include <stddef.h>
+
 #ifdef __cplusplus
 
 extern "C" {
@@ -21,18 +23,28 @@ extern "C" {
 
 #define	array_at(arr, index, type)	(((type *)array_ptr(arr, index))[0])
 
+struct array {
+        int     em_size;
+        int     flag;
+        size_t  em_cnt;
+        size_t  buff_size;
+        void    *buff;
+};
+
 struct array *array_create(int element_size);
-int array_reserve(struct array *arr, int em_cnt);
+int array_reserve(struct array *arr, size_t em_cnt);
 int array_release(struct array *array);
 
-int array_size(struct array *arr);
+int array_init(struct array *arr, int em_size, void *buff, size_t buff_cnt);
+
+size_t array_size(const struct array *arr);
 int array_clear(struct array *arr);
 
-void *array_ptr(struct array *arr, int em_index);
+void *array_ptr(const struct array *arr, size_t em_index);
 
 int array_push(struct array *arr, const void *em);
-int array_get(struct array *arr, int em_index, void *em);
-int array_erase(struct array *arr, int em_index);
+int array_get(struct array *arr, size_t em_index, void *em);
+int array_erase(struct array *arr, size_t em_index);
 
 #ifdef __cplusplus
 }
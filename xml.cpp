@@ -3,17 +3,151 @@
 #include <sys/stat.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <limits.h>
 #include <string.h>
 #include <malloc.h>
+#include <atomic>
+#include <new>
+#include <system_error>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#ifdef XML_WITH_ZLIB
+#include <zlib.h>
+#endif
+#ifdef XML_WITH_ZSTD
+#include <zstd.h>
+#endif
 #include "array.h"
 #include "xml_str.h"
 #include "xml.h"
 
 #define	 XML_SPACE_STR	L"\r\n \t"
+#define	 XML_HASH_MUL	0x100000001b3ULL
+
+//attributes kept inside the node, the rest of them spill to the heap
+#ifndef XML_ATTR_INLINE
+#define	 XML_ATTR_INLINE	2
+#endif
+
+#if defined(__GNUC__)
+#define	xml_prefetch(p)	__builtin_prefetch(p)
+#elif defined(_MSC_VER)
+#include <xmmintrin.h>
+#define	xml_prefetch(p)	_mm_prefetch((const char *)(p), _MM_HINT_T0)
+#else
+#define	xml_prefetch(p)
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define	XML_SSE2
+
+#if defined(__GNUC__)
+#define	xml_ctz(x)	__builtin_ctzll(x)
+#elif defined(_MSC_VER) && defined(_M_X64)
+#include <intrin.h>
+static inline int xml_ctz(unsigned long long x)
+{
+	unsigned long i;
+
+	_BitScanForward64(&i, x);
+
+	return (int)i;
+}
+#else
+static inline int xml_ctz(unsigned long long x)
+{
+	int n;
+
+	for (n = 0; (x & 1) == 0; n++)
+		x >>= 1;
+
+	return n;
+}
+#endif
+
+#endif
+
+//bytes of a stream in another encoding read at once before they are decoded
+#define	XML_DECODE_CHUNK	(64 * 1024)
+
+enum xml_cache_type {
+	XML_CACHE_NONE,
+	XML_CACHE_I64,
+	XML_CACHE_U64,
+	XML_CACHE_DOUBLE,
+	XML_CACHE_BOOL,
+};
+
+union xml_conv_val {
+	long long		i64;
+	unsigned long long	u64;
+	double			d;
+	int			b;
+};
+
+/* the first typed read of an attribute the caller asked to keep, never changed once set */
+struct xml_conv_cache {
+	int			type;
+	int			ret;
+	union xml_conv_val	val;
+};
 
 struct xml_attr {
 	wchar_t *name;
 	wchar_t *value;
+	size_t name_len;
+	size_t value_len;
+	/* out of line and set once with a release, see conv_attr */
+	struct xml_conv_cache	*conv;
+};
+
+typedef std::atomic<struct xml_conv_cache *> xml_conv_slot;
+static_assert(sizeof(xml_conv_slot) == sizeof(struct xml_conv_cache *), "the slot must be a plain pointer");
+
+static struct xml_conv_cache *conv_get(const struct xml_attr *attr)
+{
+	return ((xml_conv_slot *)&attr->conv)->load(std::memory_order_acquire);
+}
+
+/* only the first top level node of a loaded document carry it */
+struct xml_meta {
+	size_t			len;
+	unsigned long long	hash;
+	//of xml_track, a reload keep them
+	int			track;
+	/* a copy of the file with XML_TRACK_SOURCE when it was read at once, 'src_begin/src_end' index it */
+	wchar_t			*src;
+};
+
+/* what changed since the node was parsed, a save copy the rest from 'meta->src' */
+enum xml_dirty {
+	XML_DIRTY_NEW = 1,	//not parsed from this source at all
+	XML_DIRTY_SELF = 2,	//its tag or its list of children
+	XML_DIRTY_VALUE = 4,
+	XML_DIRTY_SUB = 8,	//something below it
+};
+
+/* what a node carry only once a feature need it, a plain parsed node go without: the source
+ * range of a tracked parse, the hash of its subtree, the pool or block it came from
+ */
+struct xml_side {
+	/* source range and the hash of all the source before each end */
+	size_t			src_begin;
+	size_t			src_end;
+	unsigned long long	src_hbegin;
+	unsigned long long	src_hend;
+	struct xml_meta		*meta;
+	int			dirty;
+	/* of the whole subtree, good while 'hashed' is set */
+	int			hashed;
+	unsigned long long	hash;
+	/* set when the node came from a pool, 'pooled' tell which strings are in it too */
+	struct xml_pool		*pool;
+	int			pooled;
+	//allocated on its own, else it follow the node in the same allocation
+	int			apart;
 };
 
 struct xml_element {
@@ -21,11 +155,42 @@ struct xml_element {
 	int			is_closed;
 	const  wchar_t		*name;
 	const  wchar_t		*value;
-	struct array		*attr;
+	size_t			name_len;
+	size_t			value_len;
+	struct array		attr;
 	struct xml_element	*next;
 	struct xml_element	*prev;
 	struct xml_element	*parent;
 	struct xml_element	*child;
+	struct xml_side		*side;
+	struct xml_attr		attr_buff[XML_ATTR_INLINE];
+};
+
+//a node and its side in one allocation
+#define	XML_NODE_SIDE	(sizeof(struct xml_element) + sizeof(struct xml_side))
+
+#define	XML_POOL_CHUNK	(64 * 1024)
+
+enum xml_pooled {
+	XML_POOL_NAME = 1,
+	XML_POOL_VALUE = 2,
+	XML_POOL_ATTR = 4,
+	//in a buffer of the caller, the tree is never written nor freed
+	XML_POOL_EXTERN = 8,
+};
+
+struct xml_chunk {
+	struct xml_chunk	*next;
+	size_t			size;
+	size_t			used;
+};
+
+/* the chunks go when the last node allocated from them is freed */
+struct xml_pool {
+	struct xml_chunk	*head;
+	//emptied chunks taken again before any new one
+	struct xml_chunk	*spare;
+	size_t			ref;
 };
 
 enum xml_state {
@@ -39,939 +204,5236 @@ enum xml_state {
 	XML_STATE_DISPATCH,
 };
 
+enum xml_filter_result {
+	XML_FILTER_SKIP,
+	XML_FILTER_PATH,
+	XML_FILTER_ALL,
+};
+
+struct xml_filter_step {
+	const wchar_t	*name;
+	size_t		len;
+};
+
+struct xml_filter_path {
+	int			step_cnt;
+	struct xml_filter_step	*step;
+	struct xml_filter_step	attr;
+};
+
+struct xml_filter {
+	int			path_cnt;
+	struct xml_filter_path	*path;
+};
+
+/* a sliding window over input that arrive piece by piece */
+struct xml_stream {
+	int	(*read)(void *ud, void *buff, int size);
+	void	*ud;
+	wchar_t	*buff;
+	size_t	size;
+	int	pend;
+	int	eof;
+	int	err;
+	const wchar_t *safe;
+	//input not in our wchar_t is read into 'raw' and decoded from there
+	int	enc;
+	unsigned char *raw;
+	size_t	raw_pos;
+	size_t	raw_len;
+	int	raw_eof;
+};
+
+/* the first stage of xml_load_file_index, where each '<' '>' and '"' the states look for is,
+ * in order. what is inside a quoted value or a comment is left out, the '"' around a value are not
+ */
+struct xml_index {
+	unsigned int	*pos;
+	size_t		cnt;
+	size_t		size;
+	//the children of the document element are cut before each 'split', the last piece end at 'close'
+	size_t		*split;
+	int		split_cnt;
+	size_t		open;
+	size_t		close;
+};
+
 struct xml_state_content {
 	int		   have_err;
+	int		   skel;
+	const struct xml_filter *filter;
+	//how many leading steps of each filter path match the ancestors of 'filter_at' and itself
+	const struct xml_element *filter_at;
+	int		   filter_level;
+	int		   *filter_match;
+	struct xml_stream  *stream;
+	size_t		   data_base;
 	struct xml_element *tree;
 	struct xml_element *curr;
 	struct xml_element *tmp;
 	const wchar_t *data_curr;
 	const wchar_t *data_end;
+	const wchar_t *data_begin;
+	//the source ranges and hashes are taken only when 'track' is set
+	int		   track;
+	const wchar_t *hash_pos;
+	unsigned long long hash;
 	enum xml_state last_state;
 	enum xml_state curr_state;
+	//the nodes from 'pool_depth' down are taken from 'pool' when it is set
+	struct xml_pool	   *pool;
+	int		   pool_depth;
+	//the node closed by the last state, if any
+	struct xml_element *done;
+	//the states find their chars through 'index' when it is set, 'index_at' is the entry they got to
+	const struct xml_index *index;
+	size_t		   index_at;
+	//at the '<' of 'jump' the parse go on from 'land', 'up' is the parent it was in then
+	const wchar_t	   *jump;
+	const wchar_t	   *land;
+	struct xml_element *up;
 };
 
-static struct xml_element *new_elem(enum xml_type type)
+/* depth first over parent links, no stack at all however deep the tree is */
+static void iter_init(struct xml_iter *it, const struct xml_element *tree, int brothers)
 {
-	struct xml_element *elem;
-
-	elem = (struct xml_element *)malloc(sizeof(*elem));
-	
-	if (elem) {
-		memset(elem, 0, sizeof(*elem));
-                elem->type = type;
-        }
-
-	return elem;
+	memset(it, 0, sizeof(*it));
+	it->event = XML_WALK_LEAVE;
+	it->next = (struct xml_element *)tree;
+	it->brothers = brothers;
 }
 
-static void xml_free_element(struct xml_element *elm)
+//what follow 'elm' is read before it is left, so it can be freed on XML_WALK_LEAVE
+static void iter_after(struct xml_iter *it, const struct xml_element *elm)
 {
-	assert(elm);
-
-        if (elm->attr)
-	        array_release(elm->attr);
-	if (elm->name)
-		free((wchar_t *)elm->name);
-	if (elm->value)
-		free((wchar_t *)elm->value);
+	it->next = NULL;
+	it->up = NULL;
+	if (it->depth == 0) {
+		if (it->brothers)
+			it->next = elm->next;
+	} else if (elm->next) {
+		it->next = elm->next;
+	} else {
+		it->up = elm->parent;
+	}
 
-	free(elm);
+	if (it->next)
+		xml_prefetch(it->next);
 }
 
-static int add_brother(struct xml_element **dst, struct xml_element *src)
+static inline int iter_next(struct xml_iter *it)
 {
 	struct xml_element *elm;
 
-	if (*dst == NULL) {
-		*dst = src;
-		return 0;
+	elm = it->node;
+	if (elm && it->event == XML_WALK_ENTER) {
+		if (elm->child && it->skip == 0) {
+			elm = elm->child;
+			xml_prefetch(elm->child);
+			xml_prefetch(elm->next);
+			it->node = elm;
+			it->depth++;
+			return 1;
+		}
+
+		it->skip = 0;
+		it->event = XML_WALK_LEAVE;
+		iter_after(it, elm);
+		return 1;
 	}
 
-	for (elm = *dst ; elm->next; elm = elm->next)
-		;
+	if (it->next) {
+		elm = it->next;
+		xml_prefetch(elm->child);
+		it->node = elm;
+		it->event = XML_WALK_ENTER;
+		return 1;
+	}
 
-	elm->next = src;
-	src->prev = elm;
-        src->parent = elm->parent;       
+	if (it->up) {
+		elm = it->up;
+		it->node = elm;
+		it->depth--;
+		iter_after(it, elm);
+		return 1;
+	}
+
+	it->node = NULL;
 
 	return 0;
 }
 
-static int add_child(struct xml_element **dst, struct xml_element *src)
+static void attr_init(struct xml_element *elm)
+{
+	array_init(&elm->attr, sizeof(struct xml_attr), elm->attr_buff, XML_ATTR_INLINE);
+}
+
+//'block' hold the node then its side, both zeroed
+static struct xml_element *side_init(void *block)
 {
 	struct xml_element *elm;
 
-	if (*dst == NULL) {
-		*dst = src;
-		return 0;
-	}
+	memset(block, 0, XML_NODE_SIDE);
+	elm = (struct xml_element *)block;
+	elm->side = (struct xml_side *)(elm + 1);
+	attr_init(elm);
 
-	elm = *dst;
-	if (elm->child == NULL) {
-		elm->child = src;
-		src->parent = elm;
-		return 0;
-	}
+	return elm;
+}
 
-	add_brother(&elm->child, src);
+//the side of a node that came without one is made on demand, NULL when there is no memory
+static struct xml_side *side_get(struct xml_element *elm)
+{
+	if (elm->side)
+		return elm->side;
 
-	return 0;
+	elm->side = (struct xml_side *)calloc(1, sizeof(*elm->side));
+	if (elm->side)
+		elm->side->apart = 1;
+
+	return elm->side;
 }
 
-static int close_elem(struct xml_state_content *content)
+static struct xml_pool *node_pool(const struct xml_element *elm)
 {
-        int len;
-	assert(content);
+	return elm->side ? elm->side->pool : NULL;
+}
 
-	if (content->tmp) {
-                len = strlen_t(content->data_curr, content->data_end, L">");
-		content->tmp->is_closed = 1;
-                content->data_curr += len + 1;
-        }
+static int node_pooled(const struct xml_element *elm)
+{
+	return elm->side ? elm->side->pooled : 0;
+}
 
-	return 0;
+static struct xml_meta *node_meta(const struct xml_element *elm)
+{
+	return elm->side ? elm->side->meta : NULL;
 }
 
-static int add_elem(struct xml_state_content *content)
+static int node_hashed(const struct xml_element *elm)
 {
-	wchar_t *tag;
-	int len;
-	struct xml_element *src;
+	return elm->side && elm->side->hashed;
+}
 
-	src = content->tmp;
+//a tracked parse give every node a side, a node without one never came from the source
+static int node_dirty(const struct xml_element *elm)
+{
+	return elm->side ? elm->side->dirty : XML_DIRTY_NEW;
+}
 
-	if (src == NULL) {
-		if (content->data_end - content->data_curr < 2 || *content->data_curr != L'<' && *(content->data_curr + 1) != L'/') {
-			content->have_err = 1;
-			content->curr_state = XML_STATE_END;
-			return 0;
+//'side' when the parse track the source
+static struct xml_element *new_elem(enum xml_type type, int side)
+{
+	struct xml_element *elem;
+
+	if (side) {
+		elem = (struct xml_element *)malloc(XML_NODE_SIDE);
+		if (elem) {
+			side_init(elem);
+			elem->type = type;
 		}
 
-		content->data_curr += 2;
+		return elem;
+	}
 
-		len = strlen_t(content->data_curr, content->data_end, L">");
-		if (len == 0) {
-			content->have_err = 1;
-			content->curr_state = XML_STATE_END;
-			return 0;
-		}
+	elem = (struct xml_element *)malloc(sizeof(*elem));
+	
+	if (elem) {
+		memset(elem, 0, sizeof(*elem));
+                elem->type = type;
+		attr_init(elem);
+        }
 
-		tag = (wchar_t *)alloca((len + 1) * sizeof(wchar_t));
-		if (tag == NULL) {
-			content->have_err = 1;
-			content->curr_state = XML_STATE_END;
-			return 0;
-		}
+	return elem;
+}
 
-		strcpy_t(tag, content->data_curr, L">");
+static void *pool_alloc(struct xml_pool *pool, size_t size)
+{
+	size_t n;
+	void *p;
+	struct xml_chunk *c;
+
+	size = (size + 7) & ~(size_t)7;
+	if (pool->head == NULL || pool->head->size - pool->head->used < size) {
+		if (pool->spare && pool->spare->size >= size) {
+			c = pool->spare;
+			pool->spare = c->next;
+		} else {
+			n = size > XML_POOL_CHUNK ? size : XML_POOL_CHUNK;
+			c = (struct xml_chunk *)malloc(sizeof(*c) + n);
+			if (c == NULL)
+				return NULL;
 
-		assert(content->curr);
-		if (wcscmp(tag, content->curr->name) != 0) {
-			content->have_err = 1;
-			content->curr_state = XML_STATE_END;
-			return 0;
+			c->size = n;
 		}
 
-		content->curr->is_closed = 1;
-		if (content->curr->parent)
-			content->curr = content->curr->parent;
-	
-		content->data_curr += len + 1;
-
-		return 0;
+		c->next = pool->head;
+		c->used = 0;
+		pool->head = c;
 	}
 
+	p = (char *)(pool->head + 1) + pool->head->used;
+	pool->head->used += size;
 
-	if (content->curr == NULL || content->tree == NULL) {
-		content->curr = src;
-		content->tree = src;
-
-		return 0;
-	}
+	return p;
+}
 
-        if (content->curr->type == XML_ROOT) {
-                add_child(&content->curr, src);
-        } else if (content->curr->is_closed) {
-		add_brother(&content->curr, src);
-        } else {
-		add_child(&content->curr, src);
-        }
+//'size' is taken in one chunk up front, the rest is allocated on demand
+static struct xml_pool *pool_new(size_t size)
+{
+	struct xml_pool *pool;
 
-	content->curr = content->tmp;
+	pool = (struct xml_pool *)malloc(sizeof(*pool));
+	if (pool == NULL)
+		return NULL;
 
-	if (content->curr->is_closed && content->curr->parent)
-		content->curr = content->curr->parent;
+	pool->head = NULL;
+	pool->spare = NULL;
+	pool->ref = 0;
+	if (size > 0) {
+		pool->head = (struct xml_chunk *)malloc(sizeof(*pool->head) + size);
+		if (pool->head == NULL) {
+			free(pool);
+			return NULL;
+		}
 
-	content->tmp = NULL;
+		pool->head->next = NULL;
+		pool->head->size = size;
+		pool->head->used = 0;
+	}
 
-	return 0;
+	return pool;
 }
 
-
-static int state_open(struct xml_state_content *content)
+static void pool_put(struct xml_pool *pool)
 {
-	const wchar_t *data;
-	content->data_curr = skip_space(content->data_curr, content->data_end);
-	data = content->data_curr;
+	struct xml_chunk *c;
 
-	if (data >= content->data_end) {
-		content->have_err = 1;
-		content->curr_state = XML_STATE_END;
+	if (--pool->ref > 0)
+		return ;
 
-		return 0;
+	while (pool->head) {
+		c = pool->head;
+		pool->head = c->next;
+		free(c);
 	}
-	
-	while (*data != L'<' && data < content->data_end)
-		data++;
 
-        if (data >= content->data_end) {
-                content->curr_state = XML_STATE_END;
-                return 0;
-        }
-	if (*data == L'<')
-		data++;
+	while (pool->spare) {
+		c = pool->spare;
+		pool->spare = c->next;
+		free(c);
+	}
 
-	if (*data == L'?') {
-	        content->tmp = new_elem(XML_ROOT);
-		data++;
-        } else if (*data == L'!' && *(data + 1) == L'-' && *(data + 2) == L'-') {
-                content->tmp = new_elem(XML_COMMENT);
-                data += 3;
-        } else {
-                content->tmp = new_elem(XML_ELEMENT);
-        }
+	free(pool);
+}
 
-	content->data_curr = data;
+//no node is left in it, the chunks are kept for what come next
+static void pool_reset(struct xml_pool *pool)
+{
+	struct xml_chunk *c;
 
+	while (pool->head) {
+		c = pool->head;
+		pool->head = c->next;
+		c->next = pool->spare;
+		pool->spare = c;
+	}
+}
 
-	content->curr_state = XML_STATE_DISPATCH;
+static void xml_free_element(struct xml_element *elm)
+{
+	size_t i;
+	int pooled;
+	struct xml_pool *pool;
+	struct xml_attr *attr;
 
-	return 0;
+	assert(elm);
+
+	pooled = node_pooled(elm);
+	for (i = 0; i < array_size(&elm->attr); i++) {
+		attr = &array_at(&elm->attr, i, struct xml_attr);
+		free(attr->conv);
+		if ((pooled & XML_POOL_ATTR) == 0) {
+			free(attr->name);
+			free(attr->value);
+		}
+	}
+	array_release(&elm->attr);
+	if (elm->name && (pooled & XML_POOL_NAME) == 0)
+		free((wchar_t *)elm->name);
+	if (elm->value && (pooled & XML_POOL_VALUE) == 0)
+		free((wchar_t *)elm->value);
+
+	pool = node_pool(elm);
+	if (elm->side) {
+		if (elm->side->meta) {
+			if (elm->side->meta->src)
+				free(elm->side->meta->src);
+			free(elm->side->meta);
+		}
+		if (elm->side->apart)
+			free(elm->side);
+	}
+
+	if (pool)
+		pool_put(pool);
+	else
+		free(elm);
 }
 
-static int state_name(struct xml_state_content *content)
+//the hashes above 'elm' were all taken after its own, so the first one gone end the walk
+static void hash_drop(struct xml_element *elm)
 {
-	int name_len;
-	wchar_t *name;
+	if (elm->side)
+		elm->side->hashed = 0;
+	for (elm = elm->parent; elm && node_hashed(elm); elm = elm->parent)
+		elm->side->hashed = 0;
+}
 
-	name_len = strlen_t(content->data_curr, content->data_end, L">"XML_SPACE_STR);
-	
-	name = (wchar_t *)malloc(name_len * sizeof(wchar_t) + sizeof(wchar_t));
-	if (name == NULL) {
-		content->have_err = 1;
-		content->curr_state = XML_STATE_END;
-		return 0;
+//a node without a side is new to the source anyway, the ones above it are marked still
+static void mark_dirty(struct xml_element *elm, int flag)
+{
+	hash_drop(elm);
+	if (elm->side)
+		elm->side->dirty |= flag;
+	for (elm = elm->parent; elm && (node_dirty(elm) & XML_DIRTY_SUB) == 0; elm = elm->parent) {
+		if (elm->side)
+			elm->side->dirty |= XML_DIRTY_SUB;
 	}
+}
 
-	strcpy_t(name, content->data_curr, L">"XML_SPACE_STR);
+//a subtree moved in from anywhere else, none of its ranges index our source
+static void mark_new(struct xml_element *elm)
+{
+	struct xml_iter it;
 
-	content->tmp->name = name;
+	iter_init(&it, elm, 0);
+	while (iter_next(&it)) {
+		if (it.event == XML_WALK_ENTER && it.node->side)
+			it.node->side->dirty |= XML_DIRTY_NEW;
+	}
+}
 
-	if (name[name_len - 1] == L'/' || name[name_len - 1] == L'?') {
-		name[name_len - 1] = 0;
-		content->curr_state = XML_STATE_OPEN;
+//'elm' join another tree, what it kept of its own document is dropped
+static void adopt(struct xml_element *elm)
+{
+	struct xml_meta *meta;
+
+	meta = node_meta(elm);
+	if (meta) {
+		if (meta->src)
+			free(meta->src);
+		free(meta);
+		elm->side->meta = NULL;
+	}
 
-                if (content->tmp->type == XML_ELEMENT)
-                        content->tmp->type = XML_ELEMENT_SELF;
+	mark_new(elm);
+}
 
-		close_elem(content);
-		add_elem(content);
-	} else {
-		content->curr_state = XML_STATE_DISPATCH;
-	        content->data_curr += name_len;
+static unsigned long long hash_pow(size_t n)
+{
+	unsigned long long b;
+	unsigned long long r;
+
+	r = 1;
+	b = XML_HASH_MUL;
+	while (n) {
+		if (n & 1)
+			r *= b;
+		b *= b;
+		n >>= 1;
 	}
 
+	return r;
+}
 
-	return 0;
+static unsigned long long hash_step(unsigned long long hash, const wchar_t *p, const wchar_t *end)
+{
+	while (p < end)
+		hash = hash * XML_HASH_MUL + (unsigned long long)*p++;
 
+	return hash;
 }
 
-static int state_comment(struct xml_state_content *content)
+static unsigned long long hash_mark(struct xml_state_content *content, const wchar_t *p)
 {
- 	int name_len;
-	wchar_t *name;
+	if (content->track == 0)
+		return 0;
 
-	name_len = strlen_t(content->data_curr, content->data_end, L"-");
-	name = (wchar_t *)malloc(name_len * sizeof(wchar_t) + sizeof(wchar_t));
-	if (name == NULL) {
-		content->have_err = 1;
-		content->curr_state = XML_STATE_END;
+	assert(p >= content->hash_pos);
+
+	content->hash = hash_step(content->hash, content->hash_pos, p);
+	content->hash_pos = p;
+
+	return content->hash;
+}
+
+static void mark_begin(struct xml_state_content *content, struct xml_element *elm, const wchar_t *p)
+{
+	//the stand-in of a region reparse has none
+	if (content->track == 0 || elm->side == NULL)
+		return ;
+
+	elm->side->src_begin = content->data_base + (p - content->data_begin);
+	elm->side->src_hbegin = hash_mark(content, p);
+}
+
+static void mark_end(struct xml_state_content *content, struct xml_element *elm, const wchar_t *p)
+{
+	if (content->track == 0 || elm->side == NULL)
+		return ;
+
+	elm->side->src_end = content->data_base + (p - content->data_begin);
+	elm->side->src_hend = hash_mark(content, p);
+}
+
+enum xml_enc {
+	XML_ENC_NATIVE,
+	XML_ENC_UTF16LE,
+	XML_ENC_UTF16BE,
+	XML_ENC_UTF32LE,
+	XML_ENC_UTF32BE,
+};
+
+static int host_le(void)
+{
+	const unsigned short one = 1;
+
+	return *(const unsigned char *)&one;
+}
+
+/* by the BOM, or by a first '<' as the XML spec guess it. what is already in
+ * our wchar_t, or can't be told, is XML_ENC_NATIVE and is taken as it is.
+ */
+static int text_enc(const unsigned char *p, size_t n)
+{
+	int enc;
+	size_t width;
+
+	if (n >= 4 && p[0] == 0xff && p[1] == 0xfe && p[2] == 0 && p[3] == 0)
+		enc = XML_ENC_UTF32LE;
+	else if (n >= 4 && p[0] == 0 && p[1] == 0 && p[2] == 0xfe && p[3] == 0xff)
+		enc = XML_ENC_UTF32BE;
+	else if (n >= 2 && p[0] == 0xff && p[1] == 0xfe)
+		enc = XML_ENC_UTF16LE;
+	else if (n >= 2 && p[0] == 0xfe && p[1] == 0xff)
+		enc = XML_ENC_UTF16BE;
+	else if (n >= 4 && p[0] == '<' && p[1] == 0 && p[2] == 0 && p[3] == 0)
+		enc = XML_ENC_UTF32LE;
+	else if (n >= 4 && p[0] == 0 && p[1] == 0 && p[2] == 0 && p[3] == '<')
+		enc = XML_ENC_UTF32BE;
+	else if (n >= 2 && p[0] == '<' && p[1] == 0)
+		enc = XML_ENC_UTF16LE;
+	else if (n >= 2 && p[0] == 0 && p[1] == '<')
+		enc = XML_ENC_UTF16BE;
+	else
+		return XML_ENC_NATIVE;
+
+	width = enc == XML_ENC_UTF16LE || enc == XML_ENC_UTF16BE ? 2 : 4;
+	if (width == sizeof(wchar_t) && (enc == XML_ENC_UTF16LE || enc == XML_ENC_UTF32LE) == host_le())
+		return XML_ENC_NATIVE;
+
+	return enc;
+}
+
+//no more wchar_t than 'cnt' out of 'len' bytes for each of them
+static size_t decode_cnt(int enc, size_t len)
+{
+	if (enc == XML_ENC_UTF16LE || enc == XML_ENC_UTF16BE)
+		return len / 2;
+
+	//a pair of surrogates for each char when wchar_t is 16 bits
+	return len / 4 * (sizeof(wchar_t) == 2 ? 2 : 1);
+}
+
+#ifdef XML_SSE2
+/* 8 chars of UTF-16 at once while none of them is a surrogate, only on x86 so the
+ * loads are little endian
+ */
+static size_t decode_block(int enc, const unsigned char *in, size_t len, wchar_t *out, size_t cnt)
+{
+	size_t i;
+	__m128i v;
+	__m128i zero;
+
+	zero = _mm_setzero_si128();
+	for (i = 0; len - i * 2 >= 16 && cnt - i >= 8; i += 8) {
+		v = _mm_loadu_si128((const __m128i *)(in + i * 2));
+		if (enc == XML_ENC_UTF16BE)
+			v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+
+		if (sizeof(wchar_t) == 2) {
+			_mm_storeu_si128((__m128i *)(out + i), v);
+			continue;
+		}
+
+		if (_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(v, _mm_set1_epi16((short)0xf800)), _mm_set1_epi16((short)0xd800))))
+			break;
+
+		_mm_storeu_si128((__m128i *)(out + i), _mm_unpacklo_epi16(v, zero));
+		_mm_storeu_si128((__m128i *)(out + i + 4), _mm_unpackhi_epi16(v, zero));
+	}
+
+	return i;
+}
+#endif
+
+/* as many whole chars of 'in' as fit in 'cnt' into our wchar_t, '*used' tell how many
+ * bytes are taken. a high surrogate at the end wait for the next piece unless it is the 'last'.
+ * the surrogates that make no pair are kept as they are. when the widths are the same
+ * 'in' may be 'out' itself.
+ */
+static size_t decode_text(int enc, const unsigned char *in, size_t len, wchar_t *out, size_t cnt, size_t *used, int last)
+{
+	size_t i;
+	size_t n;
+	unsigned int c;
+	unsigned int c2;
+#ifdef XML_SSE2
+	size_t k;
+#endif
+
+	i = 0;
+	n = 0;
+	while (n < cnt) {
+		if (enc == XML_ENC_UTF16LE || enc == XML_ENC_UTF16BE) {
+#ifdef XML_SSE2
+			if (len - i >= 16 && cnt - n >= 8) {
+				k = decode_block(enc, in + i, len - i, out + n, cnt - n);
+				i += k * 2;
+				n += k;
+				if (n == cnt)
+					break;
+			}
+#endif
+			if (len - i < 2)
+				break;
+
+			c = enc == XML_ENC_UTF16LE ? in[i] | in[i + 1] << 8 : in[i] << 8 | in[i + 1];
+			if (sizeof(wchar_t) == 4 && c >= 0xd800 && c < 0xdc00) {
+				if (len - i < 4 && !last)
+					break;
+
+				c2 = 0;
+				if (len - i >= 4)
+					c2 = enc == XML_ENC_UTF16LE ? in[i + 2] | in[i + 3] << 8 : in[i + 2] << 8 | in[i + 3];
+				if (c2 >= 0xdc00 && c2 < 0xe000) {
+					c = 0x10000 + ((c - 0xd800) << 10) + (c2 - 0xdc00);
+					i += 2;
+				}
+			}
+
+			out[n++] = (wchar_t)c;
+			i += 2;
+		} else {
+			if (len - i < 4)
+				break;
+
+			c = enc == XML_ENC_UTF32LE ? in[i] | in[i + 1] << 8 | in[i + 2] << 16 | (unsigned int)in[i + 3] << 24 :
+				(unsigned int)in[i] << 24 | in[i + 1] << 16 | in[i + 2] << 8 | in[i + 3];
+			if (sizeof(wchar_t) == 2 && c > 0x10ffff) {
+				c = 0xfffd;
+			} else if (sizeof(wchar_t) == 2 && c >= 0x10000) {
+				if (cnt - n < 2)
+					break;
+
+				out[n++] = (wchar_t)(0xd800 + ((c - 0x10000) >> 10));
+				c = 0xdc00 + ((c - 0x10000) & 0x3ff);
+			}
+
+			out[n++] = (wchar_t)c;
+			i += 4;
+		}
+	}
+
+	*used = i;
+
+	return n;
+}
+
+/* the whole of '*buff' into our wchar_t. only a file in the other byte order of the
+ * same width is decoded where it is, the others need a new buffer
+ */
+static int decode_buff(wchar_t **buff, size_t *buff_size, size_t *size)
+{
+	int enc;
+	size_t n;
+	size_t cnt;
+	size_t len;
+	size_t used;
+	wchar_t *data;
+
+	enc = text_enc((const unsigned char *)*buff, *size);
+	if (enc == XML_ENC_NATIVE)
 		return 0;
+
+	len = *size;
+	cnt = decode_cnt(enc, len);
+	if (decode_cnt(enc, sizeof(wchar_t)) == 1) {
+		n = decode_text(enc, (const unsigned char *)*buff, len, *buff, cnt, &used, 1);
+	} else {
+		data = (wchar_t *)malloc(cnt ? cnt * sizeof(wchar_t) : 1);
+		if (data == NULL)
+			return -1;
+
+		n = decode_text(enc, (const unsigned char *)*buff, len, data, cnt, &used, 1);
+		free(*buff);
+		*buff = data;
+		*buff_size = cnt * sizeof(wchar_t);
 	}
 
-	strcpy_t(name, content->data_curr, L"-");
+	*size = n * sizeof(wchar_t);
 
-	content->tmp->name = name;
-	close_elem(content);
-        add_elem(content);
+	//a char cut short at the end
+	return used == len ? 0 : -1;
+}
 
-        content->curr_state = XML_STATE_DISPATCH;
+/* 'read' through the decoding, always whole wchar_t, 0 only at the end */
+static int stream_read(struct xml_stream *stream, void *buff, int size)
+{
+	int n;
+	size_t cnt;
+	size_t used;
 
-	return 0;
+	if (stream->enc == XML_ENC_NATIVE)
+		return stream->read(stream->ud, buff, size);
 
-       
+	for (;;) {
+		cnt = decode_text(stream->enc, stream->raw + stream->raw_pos, stream->raw_len - stream->raw_pos,
+			(wchar_t *)buff, size / sizeof(wchar_t), &used, stream->raw_eof);
+		stream->raw_pos += used;
+		if (cnt)
+			return (int)(cnt * sizeof(wchar_t));
+
+		if (stream->raw_eof)
+			return stream->raw_pos == stream->raw_len ? 0 : -1;
+
+		stream->raw_len -= stream->raw_pos;
+		memmove(stream->raw, stream->raw + stream->raw_pos, stream->raw_len);
+		stream->raw_pos = 0;
+
+		n = stream->read(stream->ud, stream->raw + stream->raw_len, (int)(XML_DECODE_CHUNK - stream->raw_len));
+		if (n < 0)
+			return -1;
+
+		stream->raw_eof = n == 0;
+		stream->raw_len += n;
+	}
 }
 
-static int state_attr(struct xml_state_content *content)
+/* drop what has been parsed, then read more behind it, return 0 at the end of input */
+static int stream_more(struct xml_state_content *content)
 {
-	int len, len2;
-	int attr_cnt;
-        const wchar_t *tmp;
-	struct xml_attr	attr;
-	attr_cnt = str_count(content->data_curr, content->data_end, L'\"', L'>', 0);
-        attr_cnt /= 2;
-	if (attr_cnt == 0) {
-		content->have_err = 1;
-		content->curr_state = XML_STATE_END;
+	int n;
+	size_t keep;
+	size_t avail;
+	wchar_t *buff;
+	struct xml_stream *stream;
+
+	stream = content->stream;
+	if (stream->eof)
 		return 0;
+
+	hash_mark(content, content->data_curr);
+	keep = content->data_end - content->data_curr;
+
+	content->data_base += content->data_curr - content->data_begin;
+	stream->safe = NULL;
+	memmove(stream->buff, content->data_curr, keep * sizeof(wchar_t) + stream->pend);
+
+	//a pair of surrogates is decoded at once
+	if (stream->size - keep < 2) {
+		buff = (wchar_t *)realloc(stream->buff, stream->size * 2 * sizeof(wchar_t));
+		if (buff == NULL) {
+			stream->eof = 1;
+			stream->err = 1;
+			return -1;
+		}
+
+		stream->buff = buff;
+		stream->size *= 2;
 	}
-	
-	assert(content->tmp);
-	content->tmp->attr = array_create(sizeof(struct xml_attr));
-	if (content->tmp->attr == NULL) {
-		content->have_err = 1;
-		content->curr_state = XML_STATE_END;
-		return 0;
+
+	content->data_begin = stream->buff;
+	content->data_curr = stream->buff;
+	content->data_end = stream->buff + keep;
+	content->hash_pos = stream->buff;
+
+	//a read callback move no more than INT_MAX bytes at once
+	avail = (stream->size - keep) * sizeof(wchar_t) - stream->pend;
+	if (avail > INT_MAX)
+		avail = INT_MAX;
+
+	n = stream_read(stream, (char *)content->data_end + stream->pend, (int)avail);
+	if (n <= 0) {
+		stream->eof = 1;
+		stream->err = n < 0;
+		return n;
 	}
 
-	array_reserve(content->tmp->attr, attr_cnt);
+	stream->pend += n;
+	content->data_end += stream->pend / sizeof(wchar_t);
+	stream->pend %= sizeof(wchar_t);
 
-	while (attr_cnt--) {
-		content->data_curr = skip_space(content->data_curr, content->data_end);
-		if (content->data_curr >= content->data_end) {
-			content->have_err = 1;
-			content->curr_state = XML_STATE_END;
-			return 0;
+	return 1;
+}
+
+/* every state read no further than the next '>', then the next '<' and 3 chars behind it */
+static void stream_need(struct xml_state_content *content)
+{
+	size_t gt;
+	size_t off;
+	int stage;
+	const wchar_t *p;
+
+	//the '>' found last time still do if not passed yet
+	if (content->stream->safe && content->data_curr <= content->stream->safe)
+		return ;
+
+	gt = 0;
+	off = 0;
+	stage = 0;
+	for (;;) {
+		for (p = content->data_curr + off; p < content->data_end && stage < 2; p++) {
+			if (stage == 0 && *p == L'>') {
+				stage = 1;
+				gt = p - content->data_curr;
+			} else if (stage == 1 && *p == L'<') {
+				stage = 2;
+			}
 		}
 
-                //attr
-		len = strlen_t(content->data_curr, content->data_end, L"="XML_SPACE_STR);
-                //name
-                tmp = str_forward(content->data_curr + len, content->data_end,'\"');
-                if (tmp >= content->data_end) {
-                        content->have_err = 1;
-			content->curr_state = XML_STATE_END;
-                        return 0;
-                }
+		if (stage == 2 && content->data_end - p >= 3) {
+			content->stream->safe = content->data_curr + gt;
+			return ;
+		}
 
-		len2 = strlen_t(tmp + 1, content->data_end, L"\">");
+		off = p - content->data_curr;
+		if (stream_more(content) <= 0)
+			return ;
+	}
+}
 
-		if (*(content->data_curr + len) != L'=' ||
-			*(content->data_curr + len +1) != L'\"' ||
-			(*(content->data_curr + len + len2 + 2)!= L'\"' && *(content->data_curr + len + len2 + 2) != L'?')
-			) {
-			content->have_err = 1;
-			content->curr_state = XML_STATE_END;
-			return 0;
-		}
+enum xml_index_state {
+	XML_INDEX_TEXT,
+	XML_INDEX_TAG,
+	XML_INDEX_QUOTE,
+	XML_INDEX_COMMENT,
+};
 
-		if (content->data_curr + len + len2 >= content->data_end) {
-			content->have_err = 1;
-			content->curr_state = XML_STATE_END;
+/* where the first stage is in the text. 'depth' count the elements open, the children of the
+ * document element are at 1 and a piece is cut at one of them once 'target' is passed
+ */
+struct xml_index_walk {
+	int		state;
+	int		depth;
+	//the tag under way open an element
+	int		open;
+	//the document element is closed, nothing after it is cut
+	int		done;
+	size_t		len;
+	//where the text of the comment under way begin
+	size_t		comment;
+	int		split_max;
+	//the pieces whose end is passed
+	int		piece;
+	size_t		target;
+};
+
+static int index_push(struct xml_index *index, size_t i)
+{
+	size_t size;
+	unsigned int *pos;
+
+	if (index->cnt == index->size) {
+		size = index->size ? index->size * 2 : 1024;
+		pos = (unsigned int *)realloc(index->pos, size * sizeof(*pos));
+		if (pos == NULL)
+			return -1;
+
+		index->pos = pos;
+		index->size = size;
+	}
+
+	index->pos[index->cnt++] = (unsigned int)i;
+
+	return 0;
+}
+
+//'len' cut in 'split_max' + 1 even pieces, the end of the piece 'k'
+static size_t index_target(const struct xml_index_walk *w, int k)
+{
+	return (size_t)((unsigned long long)w->len * (k + 1) / (w->split_max + 1));
+}
+
+//the '<' at 'i' begin a tag
+static void index_tag(struct xml_index *index, struct xml_index_walk *w, const wchar_t *data, size_t i)
+{
+	wchar_t ch;
+
+	ch = w->len - i > 1 ? data[i + 1] : 0;
+	w->open = 0;
+	if (ch == L'/') {
+		w->depth--;
+		if (w->depth == 0 && w->done == 0) {
+			w->done = 1;
+			index->close = i;
 		}
+		return ;
+	}
 
-		attr.name = (wchar_t *)malloc(len *sizeof(wchar_t) + sizeof(wchar_t));
-		if (attr.name == NULL) {
-			content->have_err = 1;
-			content->curr_state = XML_STATE_END;
+	if (ch == L'?' || ch == L'!')
+		return ;
+
+	w->open = 1;
+	if (w->depth == 0 && w->done == 0)
+		index->open = i;
+	if (w->depth == 1 && w->done == 0 && w->piece < w->split_max && i >= w->target) {
+		index->split[index->split_cnt++] = i;
+		//a child longer than a piece cover the targets in it
+		do {
+			w->piece++;
+		} while (w->piece < w->split_max && index_target(w, w->piece) <= i);
+		w->target = index_target(w, w->piece);
+	}
+
+	w->depth++;
+}
+
+/* one '<' '>' or '"' at 'i', kept or not as the text around it say. '"' only count in a tag,
+ * a comment end at the first "-->"
+ */
+static int index_char(struct xml_index *index, struct xml_index_walk *w, const wchar_t *data, size_t i)
+{
+	switch (w->state) {
+	case XML_INDEX_TEXT:
+		if (data[i] == L'"')
 			return 0;
+		if (data[i] == L'>')
+			return index_push(index, i);
+
+		if (w->len - i > 3 && data[i + 1] == L'!' && data[i + 2] == L'-' && data[i + 3] == L'-') {
+			w->state = XML_INDEX_COMMENT;
+			w->comment = i + 4;
+		} else {
+			w->state = XML_INDEX_TAG;
+			index_tag(index, w, data, i);
 		}
+		break;
+	case XML_INDEX_TAG:
+		if (data[i] == L'"') {
+			w->state = XML_INDEX_QUOTE;
+		} else if (data[i] == L'>') {
+			w->state = XML_INDEX_TEXT;
+			if (w->open && data[i - 1] == L'/' && --w->depth == 0)
+				w->done = 1;
+		}
+		break;
+	case XML_INDEX_QUOTE:
+		if (data[i] != L'"')
+			return 0;
 
-		strcpy_t(attr.name, content->data_curr, L"="XML_SPACE_STR);
+		w->state = XML_INDEX_TAG;
+		break;
+	default:
+		if (data[i] != L'>' || i < w->comment + 2 || data[i - 1] != L'-' || data[i - 2] != L'-')
+			return 0;
 
-		content->data_curr += len;
-		content->data_curr += 2;
+		w->state = XML_INDEX_TEXT;
+		break;
+	}
 
-		attr.value = (wchar_t *)malloc(len2 * sizeof(wchar_t) + sizeof(wchar_t));
-		if (attr.value == NULL) {
-			free(attr.name);
-			content->have_err = 1;
-			content->curr_state = XML_STATE_END;
-			return 0;
+	return index_push(index, i);
+}
+
+#ifdef XML_SSE2
+
+#define	XML_INDEX_BLOCK	64
+
+#define	index_load(p)	_mm_loadu_si128((const __m128i *)(p))
+
+//16 chars down to a byte each, what is above 255 saturate and match none of ours
+static __m128i index_pack(const wchar_t *p)
+{
+#if WCHAR_MAX > 0xffff
+	return _mm_packus_epi16(_mm_packs_epi32(index_load(p), index_load(p + 4)), _mm_packs_epi32(index_load(p + 8), index_load(p + 12)));
+#else
+	return _mm_packus_epi16(index_load(p), index_load(p + 8));
+#endif
+}
+
+//a bit for each of the 64 chars from 'p' that is '<' '>' or '"'
+static unsigned long long index_mask(const wchar_t *p)
+{
+	int i;
+	__m128i v;
+	unsigned long long m;
+
+	m = 0;
+	for (i = 0; i < 4; i++) {
+		v = index_pack(p + i * 16);
+		v = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('<')), _mm_cmpeq_epi8(v, _mm_set1_epi8('>'))),
+			_mm_cmpeq_epi8(v, _mm_set1_epi8('"')));
+		m |= (unsigned long long)(unsigned int)_mm_movemask_epi8(v) << (i * 16);
+	}
+
+	return m;
+}
+
+#endif
+
+static void index_free(struct xml_index *index)
+{
+	if (index->pos)
+		free(index->pos);
+}
+
+/* the 'len' chars of 'data' indexed at once before the states run, the candidates are found 64
+ * at a time and only they go through the walk. up to 'split_max' cuts go to 'split'.
+ * an entry is 32 bits, so a longer text is never indexed
+ */
+static int index_build(struct xml_index *index, const wchar_t *data, size_t len, size_t *split, int split_max)
+{
+	size_t i;
+	struct xml_index_walk w;
+#ifdef XML_SSE2
+	unsigned long long m;
+#endif
+
+	memset(index, 0, sizeof(*index));
+	if (len > UINT_MAX)
+		return -1;
+
+	memset(&w, 0, sizeof(w));
+	w.len = len;
+	w.split_max = split_max;
+	w.target = index_target(&w, 0);
+	index->split = split;
+
+	i = 0;
+#ifdef XML_SSE2
+	for (; len - i >= XML_INDEX_BLOCK; i += XML_INDEX_BLOCK) {
+		for (m = index_mask(data + i); m; m &= m - 1) {
+			if (index_char(index, &w, data, i + xml_ctz(m)))
+				goto err;
 		}
-		strcpy_t(attr.value, content->data_curr, L"\">");
-		content->data_curr += len2 + 1;
+	}
+#endif
+
+	for (; i < len; i++) {
+		if ((data[i] == L'<' || data[i] == L'>' || data[i] == L'"') && index_char(index, &w, data, i))
+			goto err;
+	}
+
+	//the document element is never closed, no piece of it can be parsed alone
+	if (w.done == 0)
+		index->split_cnt = 0;
+
+	return 0;
+err:
+	index_free(index);
+	memset(index, 0, sizeof(*index));
+
+	return -1;
+}
+
+//the first entry at 'off' or after it
+static size_t index_seek(const struct xml_index *index, size_t off)
+{
+	size_t lo, hi, mid;
+
+	lo = 0;
+	hi = index->cnt;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (index->pos[mid] < off)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+//the entry of 'p' or the one after it, the parse mostly go forward so it start where it got to
+static size_t index_near(struct xml_state_content *content, const wchar_t *p)
+{
+	size_t i;
+	size_t off;
+	const struct xml_index *index;
+
+	index = content->index;
+	off = p - content->data_begin;
+	i = content->index_at;
+	while (i > 0 && index->pos[i - 1] >= off)
+		i--;
+	while (i < index->cnt && index->pos[i] < off)
+		i++;
+
+	content->index_at = i;
+
+	return i;
+}
+
+//the first 'c1' or 'c2' the index have from 'p' on, 'data_end' when there is none before it
+static const wchar_t *index_find(struct xml_state_content *content, const wchar_t *p, wchar_t c1, wchar_t c2)
+{
+	size_t i;
+	size_t end;
+	const wchar_t *at;
+	const struct xml_index *index;
+
+	index = content->index;
+	end = content->data_end - content->data_begin;
+	for (i = index_near(content, p); i < index->cnt && index->pos[i] < end; i++) {
+		at = content->data_begin + index->pos[i];
+		if (*at == c1 || *at == c2)
+			return at;
+	}
+
+	return content->data_end;
+}
+
+static size_t index_len(struct xml_state_content *content, const wchar_t *p, wchar_t c1, wchar_t c2)
+{
+	return index_find(content, p, c1, c2) - p;
+}
+
+//how many 'ch' the index have from 'p' on before the first 'term'
+static size_t index_count(struct xml_state_content *content, const wchar_t *p, wchar_t ch, wchar_t term)
+{
+	size_t i;
+	size_t end;
+	size_t cnt;
+	wchar_t c;
+	const struct xml_index *index;
+
+	cnt = 0;
+	index = content->index;
+	end = content->data_end - content->data_begin;
+	for (i = index_near(content, p); i < index->cnt && index->pos[i] < end; i++) {
+		c = content->data_begin[index->pos[i]];
+		if (c == term)
+			break;
+		if (c == ch)
+			cnt++;
+	}
+
+	return cnt;
+}
+
+static int add_brother(struct xml_element **dst, struct xml_element *src)
+{
+	struct xml_element *elm;
+
+	if (*dst == NULL) {
+		*dst = src;
+		return 0;
+	}
+
+	for (elm = *dst ; elm->next; elm = elm->next)
+		;
+
+	elm->next = src;
+	src->prev = elm;
+        src->parent = elm->parent;       
+
+	return 0;
+}
+
+static int add_child(struct xml_element **dst, struct xml_element *src)
+{
+	struct xml_element *elm;
+
+	if (*dst == NULL) {
+		*dst = src;
+		return 0;
+	}
+
+	elm = *dst;
+	if (elm->child == NULL) {
+		elm->child = src;
+		src->parent = elm;
+		return 0;
+	}
+
+	add_brother(&elm->child, src);
+
+	return 0;
+}
+
+static int close_elem(struct xml_state_content *content)
+{
+        size_t len;
+	assert(content);
+
+	if (content->tmp) {
+		if (content->index)
+			len = index_len(content, content->data_curr, L'>', L'>');
+		else
+			len = strlen_t(content->data_curr, content->data_end, L">");
+		content->tmp->is_closed = 1;
+                content->data_curr += len + 1;
+		mark_end(content, content->tmp, content->data_curr);
+        }
+
+	return 0;
+}
+
+static int add_elem(struct xml_state_content *content)
+{
+	size_t len;
+	struct xml_element *src;
+
+	src = content->tmp;
+
+	if (src == NULL) {
+		if (content->data_end - content->data_curr < 2 || *content->data_curr != L'<' && *(content->data_curr + 1) != L'/') {
+			content->have_err = 1;
+			content->curr_state = XML_STATE_END;
+			return 0;
+		}
+
+		content->data_curr += 2;
+
+		if (content->index)
+			len = index_len(content, content->data_curr, L'>', L'>');
+		else
+			len = strlen_t(content->data_curr, content->data_end, L">");
+		if (len == 0) {
+			content->have_err = 1;
+			content->curr_state = XML_STATE_END;
+			return 0;
+		}
+
+		assert(content->curr);
+		if (len != content->curr->name_len || wmemcmp(content->data_curr, content->curr->name, len) != 0) {
+			content->have_err = 1;
+			content->curr_state = XML_STATE_END;
+			return 0;
+		}
+
+		content->curr->is_closed = 1;
+		content->done = content->curr;
+		mark_end(content, content->curr, content->data_curr + len + 1);
+		if (content->curr->parent)
+			content->curr = content->curr->parent;
+	
+		content->data_curr += len + 1;
+
+		return 0;
+	}
+
+
+	if (content->curr == NULL || content->tree == NULL) {
+		content->curr = src;
+		content->tree = src;
+		content->tmp = NULL;
+		if (src->is_closed)
+			content->done = src;
+
+		return 0;
+	}
+
+        if (content->curr->type == XML_ROOT) {
+                add_child(&content->curr, src);
+        } else if (content->curr->is_closed) {
+		add_brother(&content->curr, src);
+        } else {
+		add_child(&content->curr, src);
+        }
+
+	content->curr = content->tmp;
+
+	if (content->curr->is_closed) {
+		content->done = content->curr;
+		if (content->curr->parent)
+			content->curr = content->curr->parent;
+	}
+
+	content->tmp = NULL;
+
+	return 0;
+}
+
+static struct xml_element *next_parent(const struct xml_state_content *content)
+{
+	struct xml_element *curr;
+
+	curr = content->curr;
+	if (curr == NULL)
+		return NULL;
+
+	if (curr->type == XML_ROOT || curr->is_closed == 0)
+		return curr;
+
+	return curr->parent;
+}
+
+//the levels from 'elm' up, '<?xml ?>' don't count, no more than 'limit'
+static int node_depth(const struct xml_element *elm, int limit)
+{
+	int n;
+
+	for (n = 0; elm && n < limit; elm = elm->parent) {
+		if (elm->type != XML_ROOT)
+			n++;
+	}
+
+	return n;
+}
+
+static struct xml_element *parse_node(struct xml_state_content *content, enum xml_type type)
+{
+	struct xml_element *elm;
+
+	if (content->pool == NULL || type == XML_ROOT ||
+		node_depth(next_parent(content), content->pool_depth) < content->pool_depth)
+		return new_elem(type, content->track != 0);
+
+	//the side tell the pool the node go back to
+	elm = (struct xml_element *)pool_alloc(content->pool, XML_NODE_SIDE);
+	if (elm == NULL)
+		return NULL;
+
+	side_init(elm);
+	elm->type = type;
+	elm->side->pool = content->pool;
+	content->pool->ref++;
+
+	return elm;
+}
+
+//a string of the node under parse, 'flag' tell which one
+static wchar_t *parse_str(struct xml_state_content *content, size_t len, int flag)
+{
+	struct xml_element *elm;
+
+	elm = content->tmp;
+	if (node_pool(elm) == NULL)
+		return (wchar_t *)malloc((len + 1) * sizeof(wchar_t));
+
+	elm->side->pooled |= flag;
+
+	return (wchar_t *)pool_alloc(elm->side->pool, (len + 1) * sizeof(wchar_t));
+}
+
+static void parse_free(struct xml_state_content *content, wchar_t *str)
+{
+	if (node_pool(content->tmp) == NULL)
+		free(str);
+}
+
+static int filter_init(struct xml_filter *filter, const wchar_t **path, int path_cnt)
+{
+	int i;
+	size_t cnt;
+	const wchar_t *p;
+	const wchar_t *end;
+	struct xml_filter_path *fp;
+
+	filter->path_cnt = 0;
+	filter->path = (struct xml_filter_path *)malloc(path_cnt * sizeof(*filter->path));
+	if (filter->path == NULL)
+		return -1;
+
+	for (i = 0; i < path_cnt; i++) {
+		fp = &filter->path[i];
+		memset(fp, 0, sizeof(*fp));
+
+		p = path[i];
+		end = p + wcslen(p);
+		if (*p == L'/')
+			p++;
+
+		cnt = str_count(p, end, L'/', 0, 0) + 1;
+		fp->step = (struct xml_filter_step *)malloc(cnt * sizeof(*fp->step));
+		if (fp->step == NULL)
+			return -1;
+
+		filter->path_cnt++;
+
+		while (p < end) {
+			cnt = str_forward(p, end, L'/') - p;
+			if (*p == L'@') {
+				fp->attr.name = p + 1;
+				fp->attr.len = cnt - 1;
+				if (fp->attr.len == 0)
+					return -1;
+				break;
+			}
+
+			//'a//b' name nothing
+			if (cnt == 0)
+				return -1;
+
+			fp->step[fp->step_cnt].name = p;
+			fp->step[fp->step_cnt].len = cnt;
+			fp->step_cnt++;
+			p += cnt + 1;
+		}
+
+		//'@id' alone has no element to hang on
+		if (fp->step_cnt == 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+static void filter_exit(struct xml_filter *filter)
+{
+	int i;
+
+	for (i = 0; i < filter->path_cnt; i++)
+		free(filter->path[i].step);
+
+	if (filter->path)
+		free(filter->path);
+}
+
+static int step_match(const struct xml_filter_step *step, const wchar_t *name, size_t len)
+{
+	if (step->len == 1 && *step->name == L'*')
+		return 1;
+
+	return step->len == len && wcsncmp(step->name, name, len) == 0;
+}
+
+static int filter_start(struct xml_state_content *content, const struct xml_filter *filter)
+{
+	content->filter = filter;
+	if (filter == NULL)
+		return 0;
+
+	content->filter_match = (int *)calloc(filter->path_cnt + 1, sizeof(int));
+	if (content->filter_match == NULL)
+		return -1;
+
+	return 0;
+}
+
+static void filter_end(struct xml_state_content *content)
+{
+	if (content->filter_match)
+		free(content->filter_match);
+}
+
+//'<?xml ?>' is not a step of any path
+static const struct xml_element *filter_elem(const struct xml_element *elm)
+{
+	return elm && elm->type != XML_ROOT ? elm : NULL;
+}
+
+/* 'elm' is a child of 'filter_at', a path whose steps all matched so far may match one more */
+static void filter_down(struct xml_state_content *content, const struct xml_element *elm)
+{
+	int i;
+	int level;
+	const struct xml_filter_path *path;
+
+	level = content->filter_level;
+	for (i = 0; i < content->filter->path_cnt; i++) {
+		path = &content->filter->path[i];
+		if (content->filter_match[i] == level && level < path->step_cnt &&
+			step_match(&path->step[level], elm->name, elm->name_len))
+			content->filter_match[i]++;
+	}
+
+	content->filter_at = elm;
+	content->filter_level++;
+}
+
+static void filter_up(struct xml_state_content *content)
+{
+	int i;
+
+	content->filter_level--;
+	for (i = 0; i < content->filter->path_cnt; i++) {
+		if (content->filter_match[i] > content->filter_level)
+			content->filter_match[i] = content->filter_level;
+	}
+
+	content->filter_at = filter_elem(content->filter_at->parent);
+}
+
+/* bring the match to 'parent'. the parse only go down to a child of the last one or back up,
+ * so each element is matched once. anything else is matched again from the top
+ */
+static void filter_move(struct xml_state_content *content, const struct xml_element *parent)
+{
+	int i;
+	int n;
+	const struct xml_element *up;
+	const struct xml_element *elm;
+
+	parent = filter_elem(parent);
+	up = parent ? filter_elem(parent->parent) : NULL;
+	while (content->filter_at && content->filter_at != parent && content->filter_at != up)
+		filter_up(content);
+
+	if (content->filter_at == parent)
+		return;
+
+	if (content->filter_at == up) {
+		filter_down(content, parent);
+		return;
+	}
+
+	n = 0;
+	for (elm = parent; elm; elm = filter_elem(elm->parent))
+		n++;
+
+	for (; n > 0; n--) {
+		elm = parent;
+		for (i = 1; i < n; i++)
+			elm = filter_elem(elm->parent);
+		filter_down(content, elm);
+	}
+}
+
+static int filter_test(struct xml_state_content *content, const struct xml_element *parent, const wchar_t *name, size_t len)
+{
+	int i;
+	int ret;
+	int level;
+	const struct xml_filter_path *path;
+
+	filter_move(content, parent);
+	level = content->filter_level;
+
+	ret = XML_FILTER_SKIP;
+	for (i = 0; i < content->filter->path_cnt; i++) {
+		path = &content->filter->path[i];
+		if (content->filter_match[i] < (path->step_cnt < level ? path->step_cnt : level))
+			continue;
+		if (level < path->step_cnt && !step_match(&path->step[level], name, len))
+			continue;
+
+		if (path->step_cnt <= level + 1 && path->attr.name == NULL)
+			return XML_FILTER_ALL;
+		if (path->step_cnt >= level + 1)
+			ret = XML_FILTER_PATH;
+	}
+
+	return ret;
+}
+
+static int filter_attr(struct xml_state_content *content, const struct xml_element *parent, const wchar_t *name, size_t name_len, const wchar_t *attr, size_t attr_len)
+{
+	int i;
+	int level;
+	const struct xml_filter_path *path;
+
+	filter_move(content, parent);
+	level = content->filter_level;
+
+	for (i = 0; i < content->filter->path_cnt; i++) {
+		path = &content->filter->path[i];
+		if (path->attr.name == NULL || !step_match(&path->attr, attr, attr_len))
+			continue;
+
+		if (path->step_cnt == level + 1 && content->filter_match[i] == level &&
+			step_match(&path->step[level], name, name_len))
+			return 1;
+	}
+
+	return 0;
+}
+
+/* comment is kept only when it lives inside a subtree kept as a whole */
+static int filter_comment(struct xml_state_content *content, const struct xml_element *parent)
+{
+	int i;
+	const struct xml_filter_path *path;
+
+	filter_move(content, parent);
+	if (content->filter_at == NULL)
+		return 0;
+
+	for (i = 0; i < content->filter->path_cnt; i++) {
+		path = &content->filter->path[i];
+		if (path->attr.name == NULL && path->step_cnt <= content->filter_level &&
+			content->filter_match[i] >= path->step_cnt)
+			return 1;
+	}
+
+	return 0;
+}
+
+/* where the scan of a skipped element stopped, so it can go on after a refill */
+struct xml_skip {
+	int	depth;
+	int	in_tag;
+	int	in_close;
+	int	in_comment;
+	wchar_t	last;
+	wchar_t	quote;
+};
+
+static int skip_done(const struct xml_skip *skip)
+{
+	return skip->depth == 0 && skip->in_tag == 0 && skip->in_close == 0 && skip->in_comment == 0;
+}
+
+/* stop 3 chars before 'data_end' when 'more' input follow, so the lookahead never cross it */
+static const wchar_t *skip_scan(struct xml_skip *skip, const wchar_t *data, const wchar_t *data_end, int more)
+{
+	wchar_t ch;
+	const wchar_t *end;
+
+	end = more ? data_end - 3 : data_end;
+	while (data < end && !skip_done(skip)) {
+		ch = *data++;
+		if (skip->in_comment) {
+			if (ch == L'-' && data_end - data >= 2 && data[0] == L'-' && data[1] == L'>') {
+				data += 2;
+				skip->in_comment = 0;
+			}
+		} else if (skip->in_close) {
+			if (ch == L'>')
+				skip->in_close = 0;
+		} else if (skip->in_tag) {
+			if (skip->quote) {
+				if (ch == skip->quote)
+					skip->quote = 0;
+			} else if (ch == L'\"' || ch == L'\'') {
+				skip->quote = ch;
+			} else if (ch == L'>') {
+				skip->in_tag = 0;
+				if (skip->last == L'/')
+					skip->depth--;
+			}
+			skip->last = ch;
+		} else if (ch == L'<') {
+			if (data_end - data >= 3 && data[0] == L'!' && data[1] == L'-' && data[2] == L'-') {
+				data += 3;
+				skip->in_comment = 1;
+			} else if (data < data_end && (*data == L'/' || *data == L'?')) {
+				if (*data == L'/')
+					skip->depth--;
+				skip->in_close = 1;
+			} else {
+				skip->depth++;
+				skip->in_tag = 1;
+				skip->last = 0;
+			}
+		}
+	}
+
+	return data;
+}
+
+static int state_next(struct xml_state_content *content)
+{
+	content->data_curr = skip_space(content->data_curr, content->data_end);
+	if (content->data_end - content->data_curr > 2 && *content->data_curr == L'<' && *(content->data_curr + 1) == L'/')
+		content->curr_state = XML_STATE_CLOSE;
+	else if (content->data_curr < content->data_end)
+		content->curr_state = XML_STATE_OPEN;
+	else
+		content->curr_state = XML_STATE_END;
+
+	return 0;
+}
+
+/* 'data' point just past the '<' of an element, or past the "<!--" of a comment */
+static int state_skip(struct xml_state_content *content, const wchar_t *data, int comment)
+{
+	struct xml_skip skip;
+
+	memset(&skip, 0, sizeof(skip));
+	if (comment) {
+		skip.in_comment = 1;
+	} else {
+		skip.depth = 1;
+		skip.in_tag = 1;
+	}
+
+	for (;;) {
+		data = skip_scan(&skip, data, content->data_end, content->stream && !content->stream->eof);
+		if (skip_done(&skip))
+			break;
+
+		content->data_curr = data;
+		if (content->stream == NULL || content->stream->eof || stream_more(content) < 0) {
+			content->have_err = 1;
+			content->curr_state = XML_STATE_END;
+			return 0;
+		}
+
+		data = content->data_curr;
+	}
+
+	content->tmp = NULL;
+	content->data_curr = data;
+
+	if (content->stream)
+		stream_need(content);
+
+	return state_next(content);
+}
+
+static int state_open(struct xml_state_content *content)
+{
+	size_t len;
+	int keep;
+	const wchar_t *lt;
+	const wchar_t *data;
+	content->data_curr = skip_space(content->data_curr, content->data_end);
+	data = content->data_curr;
+
+	if (data >= content->data_end) {
+		content->have_err = 1;
+		content->curr_state = XML_STATE_END;
+
+		return 0;
+	}
+	
+	if (content->index) {
+		data = index_find(content, data, L'<', L'<');
+	} else {
+		while (data < content->data_end && *data != L'<')
+			data++;
+	}
+
+        if (data >= content->data_end) {
+                content->curr_state = XML_STATE_END;
+                return 0;
+        }
+
+	//the children from here on are parsed apart, the parse go on at the close of their parent
+	if (data == content->jump) {
+		content->jump = NULL;
+		content->up = next_parent(content);
+		content->data_curr = content->land;
+		content->index_at = index_seek(content->index, content->land - content->data_begin);
+		return state_next(content);
+	}
+
+	lt = data;
+	if (*data == L'<')
+		data++;
+
+	content->skel = 0;
+	if (*data == L'?') {
+	        content->tmp = parse_node(content, XML_ROOT);
+		data++;
+        } else if (*data == L'!' && *(data + 1) == L'-' && *(data + 2) == L'-') {
+		if (content->filter && !filter_comment(content, next_parent(content)))
+			return state_skip(content, data + 3, 1);
+
+                content->tmp = parse_node(content, XML_COMMENT);
+                data += 3;
+        } else {
+		if (content->filter) {
+			len = strlen_t(data, content->data_end, L"/>"XML_SPACE_STR);
+			keep = filter_test(content, next_parent(content), data, len);
+			if (keep == XML_FILTER_SKIP)
+				return state_skip(content, data, 0);
+
+			content->skel = keep == XML_FILTER_PATH;
+		}
+
+                content->tmp = parse_node(content, XML_ELEMENT);
+        }
+
+	if (content->tmp)
+		mark_begin(content, content->tmp, lt);
+
+	content->data_curr = data;
+
+
+	content->curr_state = XML_STATE_DISPATCH;
+
+	return 0;
+}
+
+static int state_name(struct xml_state_content *content)
+{
+	size_t name_len;
+	wchar_t *name;
+
+	name_len = strlen_t(content->data_curr, content->data_end, L">"XML_SPACE_STR);
+	
+	name = parse_str(content, name_len, XML_POOL_NAME);
+	if (name == NULL) {
+		content->have_err = 1;
+		content->curr_state = XML_STATE_END;
+		return 0;
+	}
+
+	strcpy_t(name, content->data_curr, L">"XML_SPACE_STR);
+
+	content->tmp->name = name;
+	content->tmp->name_len = name_len;
+
+	if (name_len > 0 && (name[name_len - 1] == L'/' || name[name_len - 1] == L'?')) {
+		name[name_len - 1] = 0;
+		content->tmp->name_len = name_len - 1;
+
+                if (content->tmp->type == XML_ELEMENT)
+                        content->tmp->type = XML_ELEMENT_SELF;
+
+		close_elem(content);
+		add_elem(content);
+		//it may be the last child, right before the parent close
+		state_next(content);
+	} else {
+		content->curr_state = XML_STATE_DISPATCH;
+	        content->data_curr += name_len;
+	}
+
+
+	return 0;
+
+}
+
+static int state_comment(struct xml_state_content *content)
+{
+ 	size_t name_len;
+	wchar_t *name;
+
+	name_len = strlen_t(content->data_curr, content->data_end, L"-");
+	name = parse_str(content, name_len, XML_POOL_NAME);
+	if (name == NULL) {
+		content->have_err = 1;
+		content->curr_state = XML_STATE_END;
+		return 0;
+	}
+
+	strcpy_t(name, content->data_curr, L"-");
+
+	content->tmp->name = name;
+	content->tmp->name_len = name_len;
+	close_elem(content);
+        add_elem(content);
+
+        content->curr_state = XML_STATE_DISPATCH;
+
+	return 0;
+
+       
+}
+
+static int state_attr(struct xml_state_content *content)
+{
+	size_t len, len2;
+	size_t attr_cnt;
+        const wchar_t *tmp;
+	void *buff;
+	struct xml_attr	attr;
+	if (content->index)
+		attr_cnt = index_count(content, content->data_curr, L'\"', L'>');
+	else
+		attr_cnt = str_count(content->data_curr, content->data_end, L'\"', L'>', 0);
+        attr_cnt /= 2;
+	if (attr_cnt == 0) {
+		content->have_err = 1;
+		content->curr_state = XML_STATE_END;
+		return 0;
+	}
+	
+	assert(content->tmp);
+	if (content->skel == 0 && node_pool(content->tmp) && attr_cnt > XML_ATTR_INLINE) {
+		//kept in the pool along with the node, a later push still fall back to the heap
+		buff = pool_alloc(node_pool(content->tmp), attr_cnt * sizeof(attr));
+		if (buff)
+			array_init(&content->tmp->attr, sizeof(attr), buff, attr_cnt);
+	} else if (content->skel == 0) {
+		array_reserve(&content->tmp->attr, attr_cnt);
+	}
+
+	while (attr_cnt--) {
+		content->data_curr = skip_space(content->data_curr, content->data_end);
+		if (content->data_curr >= content->data_end) {
+			content->have_err = 1;
+			content->curr_state = XML_STATE_END;
+			return 0;
+		}
+
+                //attr
+		len = strlen_t(content->data_curr, content->data_end, L"="XML_SPACE_STR);
+                //name
+		if (content->index)
+			tmp = index_find(content, content->data_curr + len, L'\"', L'\"');
+		else
+			tmp = str_forward(content->data_curr + len, content->data_end,'\"');
+                if (tmp >= content->data_end) {
+                        content->have_err = 1;
+			content->curr_state = XML_STATE_END;
+                        return 0;
+                }
+
+		//a quoted '>' is not in the index, the value run to its closing '"'
+		if (content->index)
+			len2 = index_len(content, tmp + 1, L'\"', L'>');
+		else
+			len2 = strlen_t(tmp + 1, content->data_end, L"\">");
+
+		if (*(content->data_curr + len) != L'=' ||
+			*(content->data_curr + len +1) != L'\"' ||
+			(*(content->data_curr + len + len2 + 2)!= L'\"' && *(content->data_curr + len + len2 + 2) != L'?')
+			) {
+			content->have_err = 1;
+			content->curr_state = XML_STATE_END;
+			return 0;
+		}
+
+		if (content->data_curr + len + len2 >= content->data_end) {
+			content->have_err = 1;
+			content->curr_state = XML_STATE_END;
+		}
+
+		if (content->skel && !filter_attr(content, next_parent(content), content->tmp->name, content->tmp->name_len, content->data_curr, len)) {
+			content->data_curr += len + 2 + len2 + 1;
+			continue;
+		}
+
+		attr.name = parse_str(content, len, XML_POOL_ATTR);
+		if (attr.name == NULL) {
+			content->have_err = 1;
+			content->curr_state = XML_STATE_END;
+			return 0;
+		}
+
+		strcpy_t(attr.name, content->data_curr, L"="XML_SPACE_STR);
+
+		content->data_curr += len;
+		content->data_curr += 2;
+
+		attr.value = parse_str(content, len2, XML_POOL_ATTR);
+		if (attr.value == NULL) {
+			parse_free(content, attr.name);
+			content->have_err = 1;
+			content->curr_state = XML_STATE_END;
+			return 0;
+		}
+		wmemcpy(attr.value, content->data_curr, len2);
+		attr.value[len2] = 0;
+		content->data_curr += len2 + 1;
+		attr.name_len = len;
+		attr.value_len = len2;
+		attr.conv = NULL;
+
+		if (array_push(&content->tmp->attr, &attr)) {
+			parse_free(content, attr.name);
+			parse_free(content, attr.value);
+			content->have_err = 1;
+			content->curr_state = XML_STATE_END;
+			return 0;
+		}
+	}
+
+	content->curr_state = XML_STATE_DISPATCH;
+
+	return 0;
+}
+static int state_value(struct xml_state_content *content)
+{
+	size_t len;
+	wchar_t *value;
+	content->data_curr = skip_space(content->data_curr, content->data_end);
+
+        if (content->data_end - content->data_curr >= 2 &&
+                *content->data_curr == L'<' &&
+                *(content->data_curr + 1) == L'/') {
+                content->curr_state = XML_STATE_DISPATCH;
+                return 0;
+        } else if (content->data_curr < content->data_end && *content->data_curr == L'<') {
+		add_elem(content);
+		content->curr_state = XML_STATE_OPEN;
+		return 0;
+	} else if (content->data_curr >= content->data_end) {
+		//nothing left, the element is never closed
+		content->curr_state = XML_STATE_DISPATCH;
+		return 0;
+	}
+
+	if (content->index)
+		len = index_len(content, content->data_curr, L'<', L'<');
+	else
+		len = strlen_t(content->data_curr, content->data_end, L"<");
+
+	assert(content->tmp);
+	if (content->skel) {
+		content->data_curr += len;
+		content->curr_state = XML_STATE_DISPATCH;
+		return 0;
+	}
+
+	value = parse_str(content, len, XML_POOL_VALUE);
+	if (value == NULL) {
+		content->curr_state = XML_STATE_END;
+		return 0;
+	}
+
+	wmemcpy(value, content->data_curr, len);
+	value[len] = 0;
+
+	content->tmp->value = value;
+	content->tmp->value_len = len;
+	content->data_curr += len;
+
+	
+	content->curr_state = XML_STATE_DISPATCH;
+
+	return 0;
+}
+static int state_close(struct xml_state_content *content)
+{
+
+	close_elem(content);
+	add_elem(content);
+	
+	content->curr_state = XML_STATE_DISPATCH;
+
+	return 0;
+}
+/* free 'tree' along with the top level nodes follow it */
+static void free_forest(struct xml_element *tree)
+{
+	struct xml_element *tmp;
+
+	while (tree) {
+		tmp = tree->next;
+		if (tmp)
+			tmp->prev = NULL;
+		xml_free(tree);
+		tree = tmp;
+	}
+}
+
+static int state_end(struct xml_state_content *content)
+{
+        if (content->have_err == 0)
+                return 0;
+ 
+        if (content->tmp)
+                xml_free_element(content->tmp);
+        if (content->tree)
+                free_forest(content->tree);
+
+        content->tree = NULL;
+
+	return 0;
+}
+static int state_dispatch(struct xml_state_content *content)
+{
+	if (content->last_state != XML_STATE_CLOSE && content->last_state != XML_STATE_COMMENT &&
+		content->data_curr >= content->data_end) {
+		content->have_err = 1;
+		content->curr_state = XML_STATE_END;
+		return 0;
+	}
+
+	switch (content->last_state) {
+        case XML_STATE_OPEN:
+                if (str_issapce(*content->data_curr) ||
+                        (content->data_curr + 2 >= content->data_end)) {
+                        content->have_err = 1;
+                        content->curr_state = XML_STATE_END;
+                }
+                
+                if (content->tmp == NULL) {
+                        content->have_err = 1;
+                        content->curr_state = XML_STATE_END;
+
+                        return 0;
+                }
+
+                if (content->tmp->type == XML_COMMENT)
+                        content->curr_state = XML_STATE_COMMENT;
+                else
+                        content->curr_state = XML_STATE_NAME;
+                break;
+	case XML_STATE_NAME:
+		if (str_issapce(*content->data_curr)) {
+			content->curr_state = XML_STATE_ATTR;
+		} else if (content->data_end - content->data_curr > 1 && *content->data_curr == L'>') {
+			content->data_curr += 1;
+			content->curr_state = XML_STATE_VALUE;
+		} else {
+			content->have_err = 1;
+			content->curr_state = XML_STATE_END;
+		}
+		break;
+        case XML_STATE_COMMENT:
+		content->data_curr = skip_space(content->data_curr, content->data_end);
+                if (content->data_curr == content->data_end)
+                        content->curr_state = XML_STATE_END;
+                else if (content->data_end - content->data_curr > 2 && *content->data_curr == L'<' && *(content->data_curr + 1) == L'/')
+			content->curr_state = XML_STATE_CLOSE;
+                else
+                        content->curr_state = XML_STATE_OPEN;
+                break;
+	case XML_STATE_ATTR:
+		content->data_curr = skip_space(content->data_curr, content->data_end);
+		if (content->data_curr >= content->data_end) {
+			content->have_err = 1;
+			content->curr_state = XML_STATE_END;
+		} else if (*content->data_curr == L'>') {
+			content->data_curr += 1;
+			content->curr_state = XML_STATE_VALUE;
+		} else if ((content->data_end - content->data_curr >= 2 && *content->data_curr == L'/' && *(content->data_curr + 1) == L'>') ||
+			(content->data_end - content->data_curr >= 2 && *content->data_curr == L'?' && *(content->data_curr + 1) == L'>')) {
+			content->curr_state = XML_STATE_CLOSE;
+			content->data_curr += 1;
+		} else {
+			content->have_err = 1;
+			content->curr_state = XML_STATE_END;
+		}
+		break;
+	case XML_STATE_VALUE:
+		content->data_curr = skip_space(content->data_curr, content->data_end);
+		if (content->data_end - content->data_curr >= 2 && *content->data_curr == L'<' && *(content->data_curr + 1) == L'/') {
+			content->curr_state = XML_STATE_CLOSE;
+		} else {
+			content->have_err = 1;
+			content->curr_state = XML_STATE_END;
+		}
+		break;
+	case XML_STATE_CLOSE:
+		state_next(content);
+		break;
+
+	}
+	return 0;
+}
+
+typedef int (state_func_t)(struct xml_state_content *content);
+state_func_t *state_func_tbl[] = {
+	state_open,
+	state_name,
+        state_comment,
+	state_attr,
+	state_value,
+	state_close,
+	state_end,
+	state_dispatch,
+};
+
+static void parse_step(struct xml_state_content *content)
+{
+	enum xml_state last_state;
+
+	last_state = content->curr_state;
+	if (content->stream)
+		stream_need(content);
+	state_func_tbl[content->curr_state](content);
+	content->last_state = last_state;
+}
+
+/* the nodes go below 'content->tree' when it is already set */
+static void parse_run(struct xml_state_content *content)
+{
+	content->last_state = content->curr_state = XML_STATE_OPEN;
+
+	while (content->last_state != XML_STATE_END)
+		parse_step(content);
+
+	hash_mark(content, content->data_end);
+
+	//the children of '<?xml ?>' follow it, so let it cover them
+	if (content->tree && content->tree->type == XML_ROOT)
+		mark_end(content, content->tree, content->data_end);
+}
+
+static void parse_meta(struct xml_state_content *content)
+{
+	struct xml_meta *meta;
+
+	//an untracked tree can't be patched by xml_reload_file
+	if (content->tree == NULL || content->track == 0)
+		return ;
+
+	if (side_get(content->tree) == NULL)
+		return ;
+
+	meta = (struct xml_meta *)malloc(sizeof(*meta));
+	if (meta) {
+		meta->len = content->data_base + (content->data_end - content->data_begin);
+		meta->hash = content->hash;
+		meta->track = content->track;
+		meta->src = NULL;
+		content->tree->side->meta = meta;
+	}
+}
+
+//'data' is parsed from its begin, the BOM left out
+static void parse_start(struct xml_state_content *content, const wchar_t *data, size_t size)
+{
+	content->data_curr = data;
+	content->data_end = data + size / sizeof(wchar_t);
+
+	if (*content->data_curr == 0xfeff)
+		content->data_curr += 1;
+
+	content->data_begin = content->data_curr;
+	content->hash_pos = content->data_curr;
+}
+
+//the states walk 'index' when it is given, it was built over 'data' past the BOM
+static xml_element *parse_data(const wchar_t *data, size_t size, const struct xml_filter *filter, int track, const struct xml_index *index)
+{
+	struct xml_state_content state_content;
+
+	assert(size % 2 == 0);
+	assert(data);
+
+	if (size < 2)
+		return NULL;
+
+	memset(&state_content, 0, sizeof(state_content));
+
+	if (filter_start(&state_content, filter))
+		return NULL;
+
+	parse_start(&state_content, data, size);
+	state_content.track = track;
+	state_content.index = index;
+
+	parse_run(&state_content);
+	//a malformed document give NULL, whatever was built is freed
+	if (state_content.have_err) {
+		free_forest(state_content.tree);
+		state_content.tree = NULL;
+	} else
+		parse_meta(&state_content);
+	filter_end(&state_content);
+
+	return state_content.tree;
+}
+
+/* the 'size' bytes of 'data' are copied along with the tree when it asked for XML_TRACK_SOURCE,
+ * so a save can copy what did not change. 'data' is left to the caller
+ */
+static int keep_source(struct xml_element *tree, const wchar_t *data, size_t size)
+{
+	wchar_t *src;
+	struct xml_meta *meta;
+
+	meta = tree ? node_meta(tree) : NULL;
+	if (meta == NULL || (meta->track & XML_TRACK_SOURCE) == 0)
+		return -1;
+
+	src = (wchar_t *)malloc(size + sizeof(wchar_t));
+	if (src == NULL)
+		return -1;
+
+	memcpy(src, data, size);
+	src[size / sizeof(wchar_t)] = 0;
+
+	if (meta->src)
+		free(meta->src);
+
+	meta->src = src;
+
+	return 0;
+}
+
+static void stream_free(struct xml_stream *stream)
+{
+	if (stream->buff)
+		free(stream->buff);
+	if (stream->raw)
+		free(stream->raw);
+
+	stream->buff = NULL;
+	stream->raw = NULL;
+}
+
+/* the first bytes tell the encoding, what they don't decode later is parsed as read */
+static int stream_enc(struct xml_stream *stream)
+{
+	int n;
+	unsigned char head[4];
+
+	stream->enc = XML_ENC_NATIVE;
+	stream->raw_len = 0;
+	stream->raw_eof = 0;
+	while (stream->raw_len < sizeof(head)) {
+		n = stream->read(stream->ud, head + stream->raw_len, (int)(sizeof(head) - stream->raw_len));
+		if (n < 0)
+			return -1;
+		if (n == 0) {
+			stream->raw_eof = 1;
+			break;
+		}
+
+		stream->raw_len += n;
+	}
+
+	stream->enc = text_enc(head, stream->raw_len);
+	if (stream->enc == XML_ENC_NATIVE) {
+		memcpy(stream->buff, head, stream->raw_len);
+		stream->pend = (int)stream->raw_len;
+		stream->raw_len = 0;
+		return 0;
+	}
+
+	stream->raw = (unsigned char *)malloc(XML_DECODE_CHUNK);
+	if (stream->raw == NULL)
+		return -1;
+
+	memcpy(stream->raw, head, stream->raw_len);
+	stream->raw_pos = 0;
+
+	return 0;
+}
+
+/* the window of 'stream' is set up with its first piece read, past the BOM */
+static int stream_start(struct xml_state_content *content, struct xml_stream *stream, size_t size)
+{
+	//the first bytes and a pair of surrogates fit in any window
+	if (size < 4)
+		size = 4;
+
+	stream->buff = (wchar_t *)malloc(size * sizeof(wchar_t));
+	if (stream->buff == NULL)
+		return -1;
+
+	stream->size = size;
+	stream->pend = 0;
+	stream->eof = 0;
+	stream->err = 0;
+	stream->raw = NULL;
+
+	if (stream_enc(stream)) {
+		stream_free(stream);
+		return -1;
+	}
+
+	content->stream = stream;
+	content->data_curr = stream->buff;
+	content->data_end = stream->buff + stream->pend / sizeof(wchar_t);
+	content->data_begin = stream->buff;
+	content->hash_pos = stream->buff;
+	stream->pend %= sizeof(wchar_t);
+
+	while (content->data_end - content->data_curr < 2 && stream_more(content) > 0)
+		;
+
+	if (content->data_curr < content->data_end && *content->data_curr == 0xfeff)
+		content->data_curr += 1;
+
+	content->data_begin = content->data_curr;
+	content->hash_pos = content->data_curr;
+
+	return 0;
+}
+
+/* only a window of 'stream' is in memory at any time, it grow only when a single token don't fit */
+static xml_element *parse_stream(struct xml_stream *stream, size_t size, const struct xml_filter *filter, int track)
+{
+	struct xml_state_content state_content;
+
+	memset(&state_content, 0, sizeof(state_content));
+	state_content.track = track;
+
+	if (filter_start(&state_content, filter))
+		return NULL;
+
+	if (stream_start(&state_content, stream, size)) {
+		filter_end(&state_content);
+		return NULL;
+	}
+
+	if (state_content.data_curr < state_content.data_end) {
+		parse_run(&state_content);
+		if (state_content.have_err) {
+			free_forest(state_content.tree);
+			state_content.tree = NULL;
+		} else
+			parse_meta(&state_content);
+	}
+
+	filter_end(&state_content);
+
+	//the input may break behind a complete document
+	if (stream->err && state_content.tree) {
+		free_forest(state_content.tree);
+		state_content.tree = NULL;
+	}
+
+	stream_free(stream);
+
+	return state_content.tree;
+}
+
+#define	XML_UNZIP_CHUNK		(64 * 1024)
+
+enum xml_codec {
+	XML_CODEC_NONE,
+	XML_CODEC_GZIP,
+	XML_CODEC_ZSTD,
+};
+
+/* decompress what 'read' return, 'end' is set between two frames */
+struct xml_unzip {
+	int		codec;
+	int		(*read)(void *ud, void *buff, int size);
+	void		*ud;
+	unsigned char	*in;
+	int		in_pos;
+	int		in_len;
+	int		in_eof;
+	int		end;
+#ifdef XML_WITH_ZLIB
+	z_stream	zs;
+#endif
+#ifdef XML_WITH_ZSTD
+	ZSTD_DStream	*zd;
+#endif
+};
+
+/* tell the codec by the magic bytes, the file position is left at the beginning */
+static int file_codec(FILE *fp)
+{
+	int n;
+	unsigned char magic[4];
+
+	n = fread(magic, 1, sizeof(magic), fp);
+	rewind(fp);
+
+	if (n >= 2 && magic[0] == 0x1f && magic[1] == 0x8b)
+		return XML_CODEC_GZIP;
+	if (n == 4 && magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd)
+		return XML_CODEC_ZSTD;
+
+	return XML_CODEC_NONE;
+}
+
+static int file_read(void *ud, void *buff, int size)
+{
+	int n;
+
+	n = fread(buff, 1, size, (FILE *)ud);
+	if (n == 0 && ferror((FILE *)ud))
+		return -1;
+
+	return n;
+}
+
+static int unzip_init(struct xml_unzip *z, int codec, int (*read)(void *ud, void *buff, int size), void *ud)
+{
+	memset(z, 0, sizeof(*z));
+
+	z->codec = codec;
+	z->read = read;
+	z->ud = ud;
+
+	switch (codec) {
+#ifdef XML_WITH_ZLIB
+	case XML_CODEC_GZIP:
+		//16 more window bits let zlib take the gzip header
+		if (inflateInit2(&z->zs, MAX_WBITS + 16) != Z_OK)
+			return -1;
+		break;
+#endif
+#ifdef XML_WITH_ZSTD
+	case XML_CODEC_ZSTD:
+		z->zd = ZSTD_createDStream();
+		if (z->zd == NULL)
+			return -1;
+		break;
+#endif
+	default:
+		//not built in
+		z->codec = XML_CODEC_NONE;
+		return -1;
+	}
+
+	z->in = (unsigned char *)malloc(XML_UNZIP_CHUNK);
+
+	return z->in ? 0 : -1;
+}
+
+static void unzip_exit(struct xml_unzip *z)
+{
+#ifdef XML_WITH_ZLIB
+	if (z->codec == XML_CODEC_GZIP)
+		inflateEnd(&z->zs);
+#endif
+#ifdef XML_WITH_ZSTD
+	if (z->zd)
+		ZSTD_freeDStream(z->zd);
+#endif
+	if (z->in)
+		free(z->in);
+}
+
+/* return -1 if the input is broken or cut short */
+static int unzip_read(void *ud, void *buff, int size)
+{
+	int n;
+	int ret;
+	struct xml_unzip *z;
+
+	z = (struct xml_unzip *)ud;
+	n = 0;
+	while (n == 0) {
+		if (z->in_pos == z->in_len && !z->in_eof) {
+			ret = z->read(z->ud, z->in, XML_UNZIP_CHUNK);
+			if (ret < 0)
+				return -1;
+
+			z->in_pos = 0;
+			z->in_len = ret;
+			z->in_eof = ret == 0;
+		}
+
+		switch (z->codec) {
+#ifdef XML_WITH_ZLIB
+		case XML_CODEC_GZIP:
+			z->zs.next_in = z->in + z->in_pos;
+			z->zs.avail_in = z->in_len - z->in_pos;
+			z->zs.next_out = (Bytef *)buff;
+			z->zs.avail_out = size;
+			ret = inflate(&z->zs, Z_NO_FLUSH);
+			z->in_pos = z->in_len - z->zs.avail_in;
+			n = size - z->zs.avail_out;
+			//members of a gzip file may simply be concatenated
+			if (ret == Z_STREAM_END) {
+				z->end = 1;
+				inflateReset(&z->zs);
+			} else if (ret == Z_OK) {
+				z->end = 0;
+			} else if (ret != Z_BUF_ERROR) {
+				return -1;
+			}
+			break;
+#endif
+#ifdef XML_WITH_ZSTD
+		case XML_CODEC_ZSTD: {
+			size_t r;
+			ZSTD_inBuffer in = {z->in, (size_t)z->in_len, (size_t)z->in_pos};
+			ZSTD_outBuffer out = {buff, (size_t)size, 0};
+
+			r = ZSTD_decompressStream(z->zd, &out, &in);
+			if (ZSTD_isError(r))
+				return -1;
+
+			if (in.pos != (size_t)z->in_pos || out.pos)
+				z->end = r == 0;
+			z->in_pos = in.pos;
+			n = out.pos;
+			break;
+		}
+#endif
+		default:
+			return -1;
+		}
+
+		//the decoder may still hold some output when all the input is taken
+		if (n == 0 && z->in_eof && z->in_pos == z->in_len)
+			return z->end ? 0 : -1;
+	}
+
+	return n;
+}
+
+/* decompress the whole file into *buff */
+static int unzip_file(FILE *fp, int codec, wchar_t **buff, size_t *buff_size, size_t *size)
+{
+	int n;
+	int err;
+	wchar_t	*data;
+	size_t grow;
+	struct xml_unzip z;
+
+	*size = 0;
+	err = unzip_init(&z, codec, file_read, fp);
+	while (err == 0) {
+		if (*size == *buff_size) {
+			grow = *buff_size ? *buff_size * 2 : XML_UNZIP_CHUNK;
+			data = (wchar_t *)realloc(*buff, grow);
+			if (data == NULL) {
+				err = -1;
+				break;
+			}
+
+			*buff = data;
+			*buff_size = grow;
+		}
+
+		n = unzip_read(&z, (char *)*buff + *size, *buff_size - *size > XML_UNZIP_CHUNK ? XML_UNZIP_CHUNK : (int)(*buff_size - *size));
+		if (n < 0)
+			err = -1;
+		else if (n == 0)
+			break;
+
+		*size += n;
+	}
+
+	unzip_exit(&z);
+
+	return err;
+}
+
+/* read the open 'fp' of 'codec' into *buff, which is grown when it can't hold the file.
+ * the size is taken from the open file, so it is the same file all along
+ */
+static int read_fp_into(FILE *fp, int codec, wchar_t **buff, size_t *buff_size, size_t *size)
+{
+	int err;
+	wchar_t	*data;
+	struct _stat64	st;
+
+	if (codec != XML_CODEC_NONE) {
+		err = unzip_file(fp, codec, buff, buff_size, size);
+		return err ? err : decode_buff(buff, buff_size, size);
+	}
+
+	if (_fstat64(_fileno(fp), &st) == -1)
+		return -1;
+
+	if ((size_t)st.st_size > *buff_size) {
+		data = (wchar_t *)realloc(*buff, st.st_size);
+		if (data == NULL)
+			return -1;
+
+		*buff = data;
+		*buff_size = st.st_size;
+	}
+
+	err = fread(*buff, 1, st.st_size, fp) != (size_t)st.st_size ? -1 : 0;
+
+	*size = st.st_size;
+
+	return err ? err : decode_buff(buff, buff_size, size);
+}
+
+static int read_file_into(const wchar_t *path, wchar_t **buff, size_t *buff_size, size_t *size)
+{
+	int err;
+	FILE *fp;
+
+	fp = _wfopen(path, L"rb");
+	if (fp == NULL)
+		return -1;
+
+	err = read_fp_into(fp, file_codec(fp), buff, buff_size, size);
+	fclose(fp);
+
+	return err;
+}
+
+static wchar_t *read_file(const wchar_t *path, size_t *size)
+{
+	wchar_t *data;
+	size_t buff_size;
+
+	data = NULL;
+	buff_size = 0;
+	if (read_file_into(path, &data, &buff_size, size)) {
+		if (data)
+			free(data);
+		return NULL;
+	}
+
+	return data;
+}
+
+/* a compressed file is parsed as it is decompressed, never as a whole */
+static struct xml_element *load_zip(FILE *fp, int codec, const struct xml_filter *filter, int track)
+{
+	struct xml_unzip z;
+	struct xml_stream stream;
+	struct xml_element *tree;
+
+	tree = NULL;
+	if (unzip_init(&z, codec, file_read, fp) == 0) {
+		memset(&stream, 0, sizeof(stream));
+		stream.read = unzip_read;
+		stream.ud = &z;
+		tree = parse_stream(&stream, XML_UNZIP_CHUNK / sizeof(wchar_t), filter, track);
+	}
+
+	unzip_exit(&z);
+
+	return tree;
+}
+
+/* the file is opened once, its magic bytes tell how it is read */
+static struct xml_element *load_file(const wchar_t *path, const struct xml_filter *filter, int track)
+{
+	int err;
+	int codec;
+	FILE *fp;
+	wchar_t	*data;
+	size_t size;
+	size_t buff_size;
+	struct xml_element	*tree;
+
+	fp = _wfopen(path, L"rb");
+	if (fp == NULL)
+		return NULL;
+
+	codec = file_codec(fp);
+	if (codec != XML_CODEC_NONE) {
+		tree = load_zip(fp, codec, filter, track);
+		fclose(fp);
+		return tree;
+	}
+
+	data = NULL;
+	buff_size = 0;
+	err = read_fp_into(fp, codec, &data, &buff_size, &size);
+	fclose(fp);
+	if (err) {
+		if (data)
+			free(data);
+		return NULL;
+	}
+
+	tree = parse_data(data, size, filter, track, NULL);
+	keep_source(tree, data, size);
+	free(data);
+
+	return tree;
+}
+
+struct xml_element *xml_load_file(const wchar_t *path)
+{
+	return load_file(path, NULL, 0);
+}
+
+/* the ranges and hashes of each node are kept too, so xml_reload_file can patch the tree.
+ * XML_TRACK_SOURCE keep a copy of the file as well, a save copy from it what was not edited
+ */
+struct xml_element *xml_load_file_track(const wchar_t *path, int track)
+{
+	return load_file(path, NULL, track);
+}
+
+/* the pieces of the document element, the threads take them one by one */
+struct xml_split_batch {
+	const wchar_t			*begin;
+	const struct xml_index		*index;
+	//of the document element, its stand-in take it
+	const wchar_t			*name;
+	size_t				name_len;
+	struct xml_element		**forest;
+	std::atomic<int>		next;
+	std::atomic<int>		fail;
+};
+
+//the children from the cut 'i' to the next one, or to the close of their parent for the last
+static struct xml_element *split_piece(struct xml_split_batch *batch, int i)
+{
+	struct xml_element *elm;
+	struct xml_element *hold;
+	struct xml_element *forest;
+	const struct xml_index *index;
+	struct xml_state_content content;
+
+	index = batch->index;
+	memset(&content, 0, sizeof(content));
+	content.data_begin = batch->begin;
+	content.data_curr = batch->begin + index->split[i];
+	content.data_end = batch->begin + (i + 1 < index->split_cnt ? index->split[i + 1] : index->close);
+	content.hash_pos = content.data_curr;
+	content.index = index;
+	content.index_at = index_seek(index, index->split[i]);
+
+	//as for a region of xml_reload_file, a close tag or an open one left behind fail the piece
+	hold = xml_new_len(batch->name, batch->name_len, NULL, 0, XML_ELEMENT);
+	if (hold == NULL)
+		return NULL;
+
+	hold->is_closed = 0;
+	content.tree = hold;
+	content.curr = hold;
+	parse_run(&content);
+	if (content.tree == NULL)
+		return NULL;
+
+	//text left behind the last child is never taken by the whole parse either
+	if (hold->is_closed || hold->next || next_parent(&content) != hold || content.data_curr != content.data_end) {
+		free_forest(hold);
+		return NULL;
+	}
+
+	forest = hold->child;
+	hold->child = NULL;
+	xml_free(hold);
+	for (elm = forest; elm; elm = elm->next)
+		elm->parent = NULL;
+
+	return forest;
+}
+
+static void split_worker(struct xml_split_batch *batch)
+{
+	int i;
+
+	while ((i = batch->next.fetch_add(1)) < batch->index->split_cnt) {
+		batch->forest[i] = split_piece(batch, i);
+		if (batch->forest[i] == NULL)
+			batch->fail++;
+	}
+}
+
+/* the head of the document is parsed here up to the first cut, then its tail from the close of
+ * the document element, while the threads parse the pieces between. when any of it fail the
+ * whole is parsed again on one thread, so a bad document give what it give there
+ */
+static struct xml_element *parse_split(const wchar_t *data, size_t size, const struct xml_index *index, int thread_cnt)
+{
+	int i;
+	int n;
+	std::thread *thread;
+	struct xml_element *tree;
+	struct xml_element *elm;
+	struct xml_element *last;
+	struct xml_element *next;
+	struct xml_split_batch batch;
+	struct xml_state_content content;
+
+	memset(&content, 0, sizeof(content));
+	parse_start(&content, data, size);
+	content.index = index;
+	content.jump = content.data_begin + index->split[0];
+	content.land = content.data_begin + index->close;
+
+	batch.begin = content.data_begin;
+	batch.index = index;
+	batch.name = batch.begin + index->open + 1;
+	for (n = 0; batch.name + n < content.land && wcschr(L"/>" XML_SPACE_STR, batch.name[n]) == NULL; n++)
+		;
+	batch.name_len = n;
+	batch.forest = new (std::nothrow) struct xml_element *[index->split_cnt];
+	if (batch.forest == NULL)
+		return parse_data(data, size, NULL, 0, index);
+
+	batch.next.store(0);
+	batch.fail.store(0);
+
+	//the pieces are taken one by one, so what a thread that can't start leave is done here
+	n = 0;
+	thread = new (std::nothrow) std::thread[thread_cnt - 1];
+	for (i = 1; thread && i < thread_cnt; i++, n++) {
+		try {
+			thread[i - 1] = std::thread(split_worker, &batch);
+		} catch (const std::system_error &) {
+			break;
+		}
+	}
+
+	parse_run(&content);
+	split_worker(&batch);
+
+	for (i = 0; i < n; i++)
+		thread[i].join();
+
+	delete[] thread;
+
+	tree = content.tree;
+	if (tree == NULL || content.up == NULL || batch.fail.load()) {
+		for (i = 0; i < index->split_cnt; i++)
+			free_forest(batch.forest[i]);
+		free_forest(tree);
+		delete[] batch.forest;
+
+		return parse_data(data, size, NULL, 0, index);
+	}
+
+	//nothing was added to the document element after the first cut, the pieces follow its children
+	for (last = content.up->child; last && last->next; last = last->next)
+		;
+
+	for (i = 0; i < index->split_cnt; i++) {
+		for (elm = batch.forest[i]; elm; elm = next) {
+			next = elm->next;
+			elm->parent = content.up;
+			elm->prev = last;
+			if (last)
+				last->next = elm;
+			else
+				content.up->child = elm;
+			last = elm;
+		}
+	}
+
+	delete[] batch.forest;
+
+	return tree;
+}
+
+/* the two stage parse, where the markup is in the file is indexed first and the states walk
+ * the index. a '<' or '>' in a quoted value or in a comment is taken as text. 'thread_cnt' > 1
+ * parse the children of the document element in pieces, <= 0 for one thread per core
+ */
+struct xml_element *xml_load_file_index(const wchar_t *path, int thread_cnt)
+{
+	int split_max;
+	size_t len;
+	size_t size;
+	size_t *split;
+	wchar_t	*data;
+	const wchar_t *begin;
+	struct xml_index index;
+	struct xml_element *tree;
+
+	data = read_file(path, &size);
+	if (data == NULL)
+		return NULL;
+
+	if (size < 2) {
+		free(data);
+		return NULL;
+	}
+
+	if (thread_cnt <= 0)
+		thread_cnt = std::thread::hardware_concurrency();
+
+	//a few pieces for each thread, one that take longer is made up by the others
+	split = NULL;
+	split_max = thread_cnt > 1 ? thread_cnt * 4 - 1 : 0;
+	if (split_max)
+		split = new (std::nothrow) size_t[split_max];
+	if (split == NULL)
+		split_max = 0;
+
+	begin = data;
+	len = size / sizeof(wchar_t);
+	if (*begin == 0xfeff) {
+		begin++;
+		len--;
+	}
+
+	//without the memory for the index the chars are scanned one by one
+	if (index_build(&index, begin, len, split, split_max))
+		tree = parse_data(data, size, NULL, 0, NULL);
+	else if (index.split_cnt > 0)
+		tree = parse_split(data, size, &index, thread_cnt);
+	else
+		tree = parse_data(data, size, NULL, 0, &index);
+
+	index_free(&index);
+	delete[] split;
+	free(data);
+
+	return tree;
+}
+
+#define	XML_PIPE_BLOCK_SIZE	(1024 * 1024)
+#define	XML_PIPE_BLOCK_CNT	4
+
+/* the reader thread fill the blocks at 'tail', the parser drain them from 'head' */
+struct xml_pipe {
+	FILE			*fp;
+	int			block_size;
+	int			block_cnt;
+	unsigned char		*block;
+	int			*block_len;
+	unsigned int		head;
+	unsigned int		tail;
+	int			head_off;
+	int			eof;
+	int			err;
+	int			stop;
+	std::mutex		lock;
+	std::condition_variable	cond;
+};
+
+static void pipe_reader(struct xml_pipe *pipe)
+{
+	int n;
+	unsigned char *block;
+
+	for (;;) {
+		{
+			std::unique_lock<std::mutex> guard(pipe->lock);
+			while (pipe->tail - pipe->head == (unsigned int)pipe->block_cnt && !pipe->stop)
+				pipe->cond.wait(guard);
+			if (pipe->stop)
+				return ;
+		}
+
+		//the block at 'tail' is owned by the reader until 'tail' move
+		block = pipe->block + (size_t)(pipe->tail % pipe->block_cnt) * pipe->block_size;
+		n = fread(block, 1, pipe->block_size, pipe->fp);
+
+		std::lock_guard<std::mutex> guard(pipe->lock);
+		pipe->block_len[pipe->tail % pipe->block_cnt] = n;
+		pipe->tail++;
+		if (n < pipe->block_size) {
+			pipe->eof = 1;
+			pipe->err = ferror(pipe->fp);
+		}
+		pipe->cond.notify_all();
+
+		if (pipe->eof)
+			return ;
+	}
+}
+
+static int pipe_read(void *ud, void *buff, int size)
+{
+	int n;
+	int len;
+	int copy;
+	unsigned char *block;
+	struct xml_pipe *pipe;
+
+	pipe = (struct xml_pipe *)ud;
+	std::unique_lock<std::mutex> guard(pipe->lock);
+
+	while (pipe->head == pipe->tail && !pipe->eof)
+		pipe->cond.wait(guard);
+
+	n = 0;
+	while (n < size && pipe->head != pipe->tail) {
+		block = pipe->block + (size_t)(pipe->head % pipe->block_cnt) * pipe->block_size;
+		len = pipe->block_len[pipe->head % pipe->block_cnt];
+
+		copy = len - pipe->head_off;
+		if (copy > size - n)
+			copy = size - n;
+
+		memcpy((unsigned char *)buff + n, block + pipe->head_off, copy);
+		n += copy;
+		pipe->head_off += copy;
+
+		if (pipe->head_off == len) {
+			pipe->head++;
+			pipe->head_off = 0;
+			pipe->cond.notify_all();
+		}
+	}
+
+	if (n == 0 && pipe->err)
+		return -1;
+
+	return n;
+}
+
+struct xml_element *xml_load_file_pipe(const wchar_t *path, int block_size, int block_cnt)
+{
+	int codec;
+	struct xml_pipe pipe;
+	struct xml_unzip z;
+	struct xml_stream stream;
+	struct xml_element *tree;
+
+	if (block_size <= 0)
+		block_size = XML_PIPE_BLOCK_SIZE;
+	if (block_cnt < 2)
+		block_cnt = XML_PIPE_BLOCK_CNT;
+
+	pipe.fp = _wfopen(path, L"rb");
+	if (pipe.fp == NULL)
+		return NULL;
+
+	codec = file_codec(pipe.fp);
+
+	pipe.block_size = block_size;
+	pipe.block_cnt = block_cnt;
+	pipe.block = (unsigned char *)malloc((size_t)block_size * block_cnt);
+	pipe.block_len = (int *)malloc(block_cnt * sizeof(int));
+	pipe.head = 0;
+	pipe.tail = 0;
+	pipe.head_off = 0;
+	pipe.eof = 0;
+	pipe.err = 0;
+	pipe.stop = 0;
+
+	memset(&stream, 0, sizeof(stream));
+	stream.read = pipe_read;
+	stream.ud = &pipe;
+
+	//the decompression run on the parser side, the reader thread only wait on the disk
+	memset(&z, 0, sizeof(z));
+	if (codec != XML_CODEC_NONE) {
+		stream.read = unzip_read;
+		stream.ud = &z;
+		if (unzip_init(&z, codec, pipe_read, &pipe))
+			stream.read = NULL;
+	}
+
+	tree = NULL;
+	if (pipe.block && pipe.block_len && stream.read) {
+		std::thread reader(pipe_reader, &pipe);
+
+		tree = parse_stream(&stream, block_size / sizeof(wchar_t) + 4, NULL, 0);
+
+		//the parser may stop early on a broken document
+		{
+			std::lock_guard<std::mutex> guard(pipe.lock);
+			pipe.stop = 1;
+			pipe.cond.notify_all();
+		}
+		reader.join();
+	}
+
+	unzip_exit(&z);
+	if (pipe.block)
+		free(pipe.block);
+	if (pipe.block_len)
+		free(pipe.block_len);
+	fclose(pipe.fp);
+
+	return tree;
+}
+
+/* each worker own a range of the paths packed as (tail << 32 | head), idle workers steal half of another one */
+struct xml_load_worker {
+	std::atomic<unsigned long long>	range;
+	wchar_t				*buff;
+	size_t				buff_size;
+};
+
+struct xml_load_batch {
+	const wchar_t		**path;
+	struct xml_element	**tree;
+	int			worker_cnt;
+	struct xml_load_worker	*worker;
+	std::atomic<int>	fail;
+};
+
+static unsigned long long range_pack(unsigned int head, unsigned int tail)
+{
+	return (unsigned long long)tail << 32 | head;
+}
+
+static int range_take(struct xml_load_worker *w)
+{
+	unsigned int head, tail;
+	unsigned long long r;
+
+	r = w->range.load();
+	for (;;) {
+		head = (unsigned int)r;
+		tail = (unsigned int)(r >> 32);
+		if (head >= tail)
+			return -1;
+
+		if (w->range.compare_exchange_weak(r, range_pack(head + 1, tail)))
+			return head;
+	}
+}
+
+static int range_steal(struct xml_load_batch *batch, int self)
+{
+	int i;
+	unsigned int mid;
+	unsigned int head, tail;
+	unsigned long long r;
+	struct xml_load_worker *victim;
+
+	for (i = 1; i < batch->worker_cnt; i++) {
+		victim = &batch->worker[(self + i) % batch->worker_cnt];
+		r = victim->range.load();
+		for (;;) {
+			head = (unsigned int)r;
+			tail = (unsigned int)(r >> 32);
+			if (head >= tail)
+				break;
+
+			mid = head + (tail - head) / 2;
+			if (victim->range.compare_exchange_weak(r, range_pack(head, mid))) {
+				batch->worker[self].range.store(range_pack(mid, tail));
+				return range_take(&batch->worker[self]);
+			}
+		}
+	}
+
+	return -1;
+}
+
+static void load_worker(struct xml_load_batch *batch, int self)
+{
+	int i;
+	size_t size;
+	struct xml_load_worker *w;
+
+	w = &batch->worker[self];
+	for (;;) {
+		i = range_take(w);
+		if (i < 0)
+			i = range_steal(batch, self);
+		if (i < 0)
+			break;
+
+		batch->tree[i] = NULL;
+		if (read_file_into(batch->path[i], &w->buff, &w->buff_size, &size) == 0)
+			batch->tree[i] = parse_data(w->buff, size, NULL, 0, NULL);
+
+		if (batch->tree[i] == NULL)
+			batch->fail++;
+	}
+
+	if (w->buff)
+		free(w->buff);
+}
+
+int xml_load_many(const wchar_t **path, int cnt, struct xml_element **tree, int thread_cnt)
+{
+	int i;
+	int n;
+	std::thread *thread;
+	struct xml_load_worker one;
+	struct xml_load_batch batch;
+
+	assert(path);
+	assert(tree);
+
+	if (thread_cnt <= 0)
+		thread_cnt = std::thread::hardware_concurrency();
+	if (thread_cnt > cnt)
+		thread_cnt = cnt;
+	if (thread_cnt <= 0)
+		thread_cnt = 1;
+
+	batch.worker = new (std::nothrow) struct xml_load_worker[thread_cnt];
+	if (batch.worker == NULL) {
+		batch.worker = &one;
+		thread_cnt = 1;
+	}
+
+	batch.path = path;
+	batch.tree = tree;
+	batch.worker_cnt = thread_cnt;
+	batch.fail.store(0);
+
+	for (i = 0; i < thread_cnt; i++) {
+		batch.worker[i].range.store(range_pack((long long)cnt * i / thread_cnt, (long long)cnt * (i + 1) / thread_cnt));
+		batch.worker[i].buff = NULL;
+		batch.worker[i].buff_size = 0;
+	}
+
+	//the share of a thread that can't start is stolen by the others, this one at least
+	n = 0;
+	thread = thread_cnt > 1 ? new (std::nothrow) std::thread[thread_cnt - 1] : NULL;
+	for (i = 1; thread && i < thread_cnt; i++, n++) {
+		try {
+			thread[i - 1] = std::thread(load_worker, &batch, i);
+		} catch (const std::system_error &) {
+			break;
+		}
+	}
+
+	load_worker(&batch, 0);
+
+	for (i = 0; i < n; i++)
+		thread[i].join();
+
+	delete[] thread;
+	if (batch.worker != &one)
+		delete[] batch.worker;
+
+	return batch.fail.load();
+}
+
+struct xml_element *xml_load_file_filter(const wchar_t *path, const wchar_t **filter, int filter_cnt)
+{
+	struct xml_filter f;
+	struct xml_element *tree;
+
+	assert(filter);
+
+	tree = NULL;
+	if (filter_init(&f, filter, filter_cnt) == 0)
+		tree = load_file(path, &f, 0);
+
+	filter_exit(&f);
+
+	return tree;
+}
+
+#define	XML_READER_WINDOW	(64 * 1024)
+
+/* the elements at one level of a file are handed out one by one, what is around them
+ * is dropped as soon as it is closed. a record is parsed into 'pool', which is emptied
+ * and taken again for the next one, so the memory stay that of the biggest record.
+ */
+struct xml_reader {
+	FILE			*fp;
+	struct xml_unzip	z;
+	struct xml_stream	stream;
+	struct xml_state_content content;
+	struct xml_pool		*pool;
+	int			depth;
+	//handed out last, it go at the next call
+	struct xml_element	*rec;
+};
+
+//'elm' is closed, so it is the last of its brothers under parse
+static void reader_cut(struct xml_state_content *content, struct xml_element *elm)
+{
+	if (elm->prev)
+		elm->prev->next = elm->next;
+	else if (elm->parent)
+		elm->parent->child = elm->next;
+	else
+		content->tree = elm->next;
+
+	if (elm->next)
+		elm->next->prev = elm->prev;
+
+	if (content->curr == elm)
+		content->curr = elm->prev ? elm->prev : elm->parent;
+
+	elm->prev = NULL;
+	elm->next = NULL;
+	elm->parent = NULL;
+}
+
+//all closed nodes are cut, anything but '<?xml ?>' left was never closed
+static int reader_left(const struct xml_element *tree)
+{
+	struct xml_iter it;
+
+	iter_init(&it, tree, 1);
+	while (iter_next(&it)) {
+		if (it.event == XML_WALK_ENTER && it.node->type != XML_ROOT)
+			return 1;
+	}
+
+	return 0;
+}
+
+/* 'depth' 0 take the top level elements, 1 the children of the document element and so on */
+struct xml_reader *xml_reader_open(const wchar_t *path, int depth)
+{
+	int codec;
+	struct xml_reader *r;
+
+	assert(path);
+	assert(depth >= 0);
+
+	r = (struct xml_reader *)malloc(sizeof(*r));
+	if (r == NULL)
+		return NULL;
+
+	memset(r, 0, sizeof(*r));
+	r->depth = depth;
+
+	r->fp = _wfopen(path, L"rb");
+	if (r->fp == NULL)
+		goto err;
+
+	codec = file_codec(r->fp);
+	if (codec != XML_CODEC_NONE) {
+		if (unzip_init(&r->z, codec, file_read, r->fp))
+			goto err;
+
+		r->stream.read = unzip_read;
+		r->stream.ud = &r->z;
+	} else {
+		r->stream.read = file_read;
+		r->stream.ud = r->fp;
+	}
+
+	r->pool = pool_new(0);
+	if (r->pool == NULL)
+		goto err;
+
+	r->pool->ref = 1;
+	r->content.pool = r->pool;
+	r->content.pool_depth = depth;
+	if (stream_start(&r->content, &r->stream, XML_READER_WINDOW))
+		goto err;
+
+	r->content.last_state = r->content.curr_state = XML_STATE_OPEN;
+	if (r->content.data_curr >= r->content.data_end)
+		r->content.last_state = XML_STATE_END;
+
+	return r;
+err:
+	xml_reader_close(r);
+	return NULL;
+}
+
+/* the record handed out before is freed first, NULL at the end of the file or on error */
+struct xml_element *xml_reader_next(struct xml_reader *r)
+{
+	int n;
+	struct xml_element *elm;
+	struct xml_state_content *content;
+
+	assert(r);
+
+	content = &r->content;
+	if (r->rec) {
+		xml_free(r->rec);
+		r->rec = NULL;
+		//nothing else is under 'depth' between two records
+		assert(r->pool->ref == 1);
+		pool_reset(r->pool);
+	}
+
+	while (content->last_state != XML_STATE_END) {
+		parse_step(content);
+
+		elm = content->done;
+		content->done = NULL;
+		if (elm == NULL || elm->type == XML_ROOT)
+			continue;
+
+		n = node_depth(elm->parent, r->depth + 1);
+		if (n > r->depth)
+			continue;
+
+		reader_cut(content, elm);
+		if (n == r->depth && elm->type != XML_COMMENT) {
+			r->rec = elm;
+			return elm;
+		}
+
+		xml_free(elm);
+	}
+
+	return NULL;
+}
+
+/* -1 when the file was broken or cut short */
+int xml_reader_close(struct xml_reader *r)
+{
+	int err;
+
+	assert(r);
+
+	err = r->content.have_err || r->stream.err;
+	if (r->rec)
+		xml_free(r->rec);
+
+	if (r->content.tree) {
+		err |= reader_left(r->content.tree);
+		free_forest(r->content.tree);
+	}
+
+	if (r->pool)
+		pool_put(r->pool);
+	stream_free(&r->stream);
+
+	unzip_exit(&r->z);
+	if (r->fp)
+		fclose(r->fp);
+
+	free(r);
+
+	return err ? -1 : 0;
+}
+
+struct xml_bound {
+	size_t			off;
+	int			valid;
+	unsigned long long	hash;
+	unsigned long long	hash_new;
+};
+
+/* every begin and end of the tree, in document order */
+static int collect_bound(const struct xml_element *tree, struct array *bound)
+{
+	struct xml_bound b;
+	struct xml_iter it;
+	const struct xml_element *elm;
+
+	memset(&b, 0, sizeof(b));
+
+	iter_init(&it, tree, 1);
+	while (iter_next(&it)) {
+		elm = it.node;
+		//a node added since the parse has no range
+		if (elm->side == NULL)
+			return -1;
+
+		if (it.event == XML_WALK_ENTER) {
+			if (elm->side->src_end <= elm->side->src_begin || elm->side->src_begin < b.off)
+				return -1;
+
+			b.off = elm->side->src_begin;
+			b.hash = elm->side->src_hbegin;
+		} else {
+			if (elm->side->src_end < b.off)
+				return -1;
+
+			b.off = elm->side->src_end;
+			b.hash = elm->side->src_hend;
+		}
+
+		if (array_push(bound, &b))
+			return -1;
+	}
+
+	return 0;
+}
+
+static void shift_bound(size_t *off, unsigned long long *hash, size_t stop, ptrdiff_t delta, unsigned long long diff)
+{
+	*hash += diff * hash_pow(*off - stop);
+	*off += delta;
+}
+
+/* move everything behind the patched region, 'elm' and its brothers first, then up the parents */
+static void shift_after(struct xml_element *elm, struct xml_element *parent, size_t stop, ptrdiff_t delta, unsigned long long diff)
+{
+	struct xml_iter it;
+
+	for (;;) {
+		iter_init(&it, elm, 1);
+		while (iter_next(&it)) {
+			if (it.event == XML_WALK_ENTER)
+				shift_bound(&it.node->side->src_begin, &it.node->side->src_hbegin, stop, delta, diff);
+			else
+				shift_bound(&it.node->side->src_end, &it.node->side->src_hend, stop, delta, diff);
+		}
+
+		if (parent == NULL)
+			break;
+
+		shift_bound(&parent->side->src_end, &parent->side->src_hend, stop, delta, diff);
+		elm = parent->next;
+		parent = parent->parent;
+	}
+}
+
+//an edited tree no longer mirror its source, it is parsed again as a whole
+static int forest_dirty(const struct xml_element *tree)
+{
+	for (; tree; tree = tree->next) {
+		if (node_dirty(tree))
+			return 1;
+	}
+
+	return 0;
+}
+
+//an untracked tree is tracked from now on
+static struct xml_element *reload_all(struct xml_element *tree, const wchar_t *data, size_t size)
+{
+	struct xml_element *fresh;
+
+	fresh = parse_data(data, size, NULL, node_meta(tree) ? node_meta(tree)->track : XML_TRACK_RANGE, NULL);
+	if (fresh == NULL)
+		return NULL;
+
+	free_forest(tree);
+
+	return fresh;
+}
+
+static struct xml_element *reload_data(struct xml_element *tree, const wchar_t *data, size_t size)
+{
+	ptrdiff_t k;
+	ptrdiff_t cnt;
+	ptrdiff_t lo, hi;
+	size_t off_lo, off_hi;
+	size_t start, stop;
+	size_t n_old, n_new;
+	ptrdiff_t delta;
+	const wchar_t *h;
+	const wchar_t *begin;
+	const wchar_t *end;
+	unsigned long long hash;
+	unsigned long long hash_end;
+	unsigned long long start_hash;
+	unsigned long long stop_hash;
+	struct array *bound;
+	struct xml_bound *b;
+	struct xml_meta *meta;
+	struct xml_element *elm, *tmp;
+	struct xml_element *list, *parent;
+	struct xml_element *first, *last;
+	struct xml_element *prev, *next;
+	struct xml_element *forest;
+	struct xml_element *hold;
+	struct xml_state_content content;
+
+	meta = node_meta(tree);
+	bound = array_create(sizeof(struct xml_bound));
+	if (meta == NULL || size < 2 || bound == NULL || forest_dirty(tree) || collect_bound(tree, bound)) {
+		if (bound)
+			array_release(bound);
+		return reload_all(tree, data, size);
+	}
+
+	begin = data;
+	end = data + size / sizeof(wchar_t);
+	if (*begin == 0xfeff)
+		begin++;
+
+	n_old = meta->len;
+	n_new = (size_t)(end - begin);
+	delta = (ptrdiff_t)n_new - (ptrdiff_t)n_old;
+	cnt = (ptrdiff_t)array_size(bound);
+
+	//longest run of boundaries whose whole prefix is unchanged
+	lo = -1;
+	h = begin;
+	hash = 0;
+	for (k = 0; k < cnt; k++) {
+		b = &array_at(bound, k, struct xml_bound);
+		if (b->off > n_new)
+			break;
+
+		hash = hash_step(hash, h, begin + b->off);
+		h = begin + b->off;
+		if (hash != b->hash)
+			break;
+
+		lo = k;
+	}
+
+	if (lo == cnt - 1 && n_new == n_old && hash_step(hash, h, end) == meta->hash) {
+		array_release(bound);
+		return tree;
+	}
+
+	off_lo = lo < 0 ? 0 : array_at(bound, lo, struct xml_bound).off;
+	hash = lo < 0 ? 0 : array_at(bound, lo, struct xml_bound).hash;
+
+	//the same from the end, a suffix is compared through the prefix hashes around it
+	h = begin + off_lo;
+	for (k = lo + 1; k < cnt; k++) {
+		b = &array_at(bound, k, struct xml_bound);
+		b->valid = (ptrdiff_t)b->off + delta >= (ptrdiff_t)off_lo;
+		if (b->valid == 0)
+			continue;
+
+		hash = hash_step(hash, h, begin + b->off + delta);
+		h = begin + b->off + delta;
+		b->hash_new = hash;
+	}
+
+	hash_end = hash_step(hash, h, end);
+
+	hi = cnt;
+	for (k = cnt - 1; k > lo; k--) {
+		b = &array_at(bound, k, struct xml_bound);
+		if (b->valid == 0 || meta->hash - hash_end != (b->hash - b->hash_new) * hash_pow(n_old - b->off))
+			break;
+
+		hi = k;
+	}
+
+	off_hi = hi < cnt ? array_at(bound, hi, struct xml_bound).off : n_old;
+	array_release(bound);
+
+	//walk down while the change sit between the children of one element
+	parent = NULL;
+	list = tree;
+	for (;;) {
+		first = NULL;
+		last = NULL;
+		for (elm = list; elm; elm = elm->next) {
+			//nothing follow '<?xml ?>', so its end is the end of the document
+			if (first == NULL && (elm->side->src_end > off_lo || (elm->type == XML_ROOT && elm->side->src_end == off_lo)))
+				first = elm;
+			if (elm->side->src_begin < off_hi)
+				last = elm;
+		}
+
+		if (first == NULL || first != last || first->child == NULL)
+			break;
+
+		for (elm = first->child; elm->next; elm = elm->next)
+			;
+
+		if (first->child->side->src_begin > off_lo)
+			break;
+		if (first->type != XML_ROOT && elm->side->src_end < off_hi)
+			break;
+
+		parent = first;
+		list = first->child;
+	}
+
+	//the top level itself changed
+	if (parent == NULL)
+		return reload_all(tree, data, size);
+
+	//the region run from the end of a brother to the begin of another, or to the ends of the list
+	prev = NULL;
+	next = NULL;
+	for (elm = list; elm; elm = elm->next) {
+		if (elm->side->src_end <= off_lo)
+			prev = elm;
+		if (elm->side->src_begin >= off_hi) {
+			next = elm;
+			break;
+		}
+	}
+
+	for (last = list; last->next; last = last->next)
+		;
+
+	start = prev ? prev->side->src_end : list->side->src_begin;
+	start_hash = prev ? prev->side->src_hend : list->side->src_hbegin;
+	if (next) {
+		stop = next->side->src_begin;
+		stop_hash = next->side->src_hbegin;
+	} else if (parent->type == XML_ROOT) {
+		stop = parent->side->src_end;
+		stop_hash = parent->side->src_hend;
+	} else {
+		stop = last->side->src_end;
+		stop_hash = last->side->src_hend;
+	}
+
+	//reparse only [start, stop) of the old source, which became [start, stop + delta)
+	memset(&content, 0, sizeof(content));
+	content.track = meta->track;
+	content.data_begin = begin;
+	content.data_curr = begin + start;
+	content.data_end = begin + stop + delta;
+	content.hash_pos = content.data_curr;
+	content.hash = start_hash;
+
+	forest = NULL;
+	if (skip_space(content.data_curr, content.data_end) < content.data_end) {
+		//inside a stand-in for 'parent', a close tag or an open one left behind is seen as the
+		//whole parse would see it. anything the region can't hold is parsed again as a whole
+		hold = xml_new_len(parent->name, parent->name_len, NULL, 0, parent->type);
+		if (hold == NULL)
+			return reload_all(tree, data, size);
+
+		hold->is_closed = 0;
+		content.tree = hold;
+		content.curr = hold;
+		parse_run(&content);
+		if (content.tree == NULL)
+			return reload_all(tree, data, size);
+
+		if (hold->is_closed || hold->next || next_parent(&content) != hold) {
+			free_forest(hold);
+			return reload_all(tree, data, size);
+		}
+
+		forest = hold->child;
+		hold->child = NULL;
+		xml_free(hold);
+	} else {
+		hash_mark(&content, content.data_end);
+	}
+
+	shift_after(next, parent, stop, delta, content.hash - stop_hash);
+	meta->hash += (content.hash - stop_hash) * hash_pow(n_old - stop);
+	meta->len = n_new;
+	tree->side->meta = NULL;
+
+	elm = prev ? prev->next : list;
+	while (elm != next) {
+		tmp = elm->next;
+		elm->parent = NULL;
+		elm->prev = NULL;
+		xml_free(elm);
+		elm = tmp;
+	}
+
+	last = prev;
+	for (elm = forest; elm; elm = elm->next) {
+		elm->parent = parent;
+		elm->prev = last;
+		if (last)
+			last->next = elm;
+		else if (parent)
+			parent->child = elm;
+		else
+			tree = elm;
+		last = elm;
+	}
+
+	if (last)
+		last->next = next;
+	else if (parent)
+		parent->child = next;
+	else
+		tree = next;
+
+	if (next)
+		next->prev = last;
+
+	if (parent)
+		hash_drop(parent);
+
+	tree->side->meta = meta;
+
+	return tree;
+}
+
+/* the patched tree, which may not be 'tree' itself, the nodes out of the edited region are kept.
+ * NULL when the file can't be read or parsed, 'tree' is then left as it was and is still the
+ * caller's, so keep it: 'tree = xml_reload_file(tree, path)' would lose it
+ */
+struct xml_element *xml_reload_file(struct xml_element *tree, const wchar_t *path)
+{
+	wchar_t *data;
+	size_t size;
+
+	assert(tree);
+
+	data = read_file(path, &size);
+	if (data == NULL)
+		return NULL;
+
+	tree = reload_data(tree, data, size);
+	keep_source(tree, data, size);
+	free(data);
+
+	return tree;
+}
+
+
+
+//'tree' and everything below it, the links around it are left as they are
+static void free_tree(struct xml_element *tree, int brothers)
+{
+        struct xml_iter it;
+
+        iter_init(&it, tree, brothers);
+        while (iter_next(&it)) {
+                if (it.event == XML_WALK_LEAVE)
+                        xml_free_element(it.node);
+        }
+}
+
+int xml_free_child(struct xml_element *tree)
+{
+        struct xml_element *child;
+
+        assert(tree);
+	if (tree == NULL)
+		return 0;
+        
+        child = tree->child;
+        if (child == NULL)
+                return 0;
+
+        mark_dirty(tree, XML_DIRTY_SELF);
+        tree->child = NULL;
+
+        free_tree(child, 1);
+        
+        return 0;
+}
+int xml_free(struct xml_element *tree)
+{
+	if (tree == NULL)
+		return 0;
+ 
+        if (tree->parent)
+                mark_dirty(tree->parent, XML_DIRTY_SELF);
+
+        if (tree->parent && tree->parent->child == tree) {
+                assert(tree->prev == NULL);
+                tree->parent->child = tree->next;
+        } else if (tree->prev) {
+                tree->prev->next = tree->next;
+        } else {
+                //do nothing
+        }
+
+        if (tree->next)
+                tree->next->prev = tree->prev;
+
+        free_tree(tree, 0);
+
+        return 0;
+}
+
+int xml_free_all(struct xml_element *tree)
+{
+        free_forest(tree);
+
+        return 0;
+}
+
+//the heap held by 'tree' and its brothers, the source it keep included
+size_t xml_mem_size(const struct xml_element *tree)
+{
+	size_t i;
+	size_t size;
+	struct xml_iter it;
+	const struct xml_element *elm;
+	const struct xml_attr *attr;
+
+	assert(tree);
+
+	size = 0;
+	iter_init(&it, tree, 1);
+	while (iter_next(&it)) {
+		if (it.event == XML_WALK_LEAVE)
+			continue;
+
+		elm = it.node;
+		size += sizeof(*elm) + (elm->name_len + 1) * sizeof(wchar_t);
+		if (elm->value)
+			size += (elm->value_len + 1) * sizeof(wchar_t);
+		if (array_size(&elm->attr) > XML_ATTR_INLINE)
+			size += elm->attr.buff_size;
+		for (i = 0; i < array_size(&elm->attr); i++) {
+			attr = &array_at(&elm->attr, i, struct xml_attr);
+			size += (attr->name_len + attr->value_len + 2) * sizeof(wchar_t);
+			if (conv_get(attr))
+				size += sizeof(struct xml_conv_cache);
+		}
+
+		if (elm->side)
+			size += sizeof(*elm->side);
+		if (node_meta(elm)) {
+			size += sizeof(struct xml_meta);
+			if (node_meta(elm)->src)
+				size += (node_meta(elm)->len + 1) * sizeof(wchar_t);
+		}
+	}
+
+	return size;
+}
+
+enum xml_type xml_get_type(const struct xml_element *node)
+{
+        assert(node);
+
+        return node->type;
+}
+
+static struct xml_attr *find_attr(const struct xml_element *node, const wchar_t *attr_name)
+{
+        size_t i;
+        size_t len;
+        struct xml_attr *attr;
+
+        assert(node);
+        assert(attr_name);
+
+        len = wcslen(attr_name);
+        for (i = 0; i < array_size(&node->attr); i++) {
+                attr = &array_at(&node->attr, i, struct xml_attr);
+                if (attr->name_len == len && wmemcmp(attr->name, attr_name, len) == 0)
+                        return attr;
+        }
+
+        return NULL;
+}
+
+const wchar_t *xml_get_attr(const struct xml_element *node, const wchar_t *attr_name)
+{
+        struct xml_attr *attr;
+
+        attr = find_attr(node, attr_name);
+        if (attr == NULL)
+                return NULL;
+
+        return attr->value; 
+}
+
+static int conv_value(const wchar_t *value, int type, union xml_conv_val *val)
+{
+        if (value == NULL)
+                return XML_CONV_MISSING;
+
+        switch (type) {
+        case XML_CACHE_I64:
+                return str_toi64(value, &val->i64);
+        case XML_CACHE_U64:
+                return str_tou64(value, &val->u64);
+        case XML_CACHE_DOUBLE:
+                return str_todouble(value, &val->d);
+        default:
+                return str_tobool(value, &val->b);
+        }
+}
+
+/* the cache is looked at and filled only when 'cache' is set. it is filled once, the first
+ * thread to publish win and the others free their copy, so a shared tree can be read from
+ * any thread. a tree in a buffer of the caller is never written
+ */
+static int conv_attr(const struct xml_element *node, const wchar_t *attr_name, int type, union xml_conv_val *val, int cache)
+{
+        int ret;
+        struct xml_attr *attr;
+        struct xml_conv_cache *c;
+        struct xml_conv_cache *none;
+
+        attr = find_attr(node, attr_name);
+        if (attr == NULL)
+                return XML_CONV_MISSING;
+
+        if (cache == 0)
+                return conv_value(attr->value, type, val);
+
+        c = conv_get(attr);
+        if (c && c->type == type) {
+                *val = c->val;
+                return c->ret;
+        }
+
+        ret = conv_value(attr->value, type, val);
+        if (c || (node_pooled(node) & XML_POOL_EXTERN))
+                return ret;
+
+        c = (struct xml_conv_cache *)malloc(sizeof(*c));
+        if (c == NULL)
+                return ret;
+
+        c->type = type;
+        c->ret = ret;
+        c->val = *val;
+        none = NULL;
+        if (!((xml_conv_slot *)&attr->conv)->compare_exchange_strong(none, c, std::memory_order_release, std::memory_order_relaxed))
+                free(c);
+
+        return ret;
+}
+
+int xml_get_attr_i64(const struct xml_element *node, const wchar_t *attr_name, long long *v, int cache)
+{
+        int ret;
+        union xml_conv_val val;
+
+        ret = conv_attr(node, attr_name, XML_CACHE_I64, &val, cache);
+        if (ret == XML_CONV_OK)
+                *v = val.i64;
+
+        return ret;
+}
+
+int xml_get_attr_u64(const struct xml_element *node, const wchar_t *attr_name, unsigned long long *v, int cache)
+{
+        int ret;
+        union xml_conv_val val;
+
+        ret = conv_attr(node, attr_name, XML_CACHE_U64, &val, cache);
+        if (ret == XML_CONV_OK)
+                *v = val.u64;
+
+        return ret;
+}
+
+int xml_get_attr_double(const struct xml_element *node, const wchar_t *attr_name, double *v, int cache)
+{
+        int ret;
+        union xml_conv_val val;
+
+        ret = conv_attr(node, attr_name, XML_CACHE_DOUBLE, &val, cache);
+        if (ret == XML_CONV_OK)
+                *v = val.d;
+
+        return ret;
+}
+
+int xml_get_attr_bool(const struct xml_element *node, const wchar_t *attr_name, int *v, int cache)
+{
+        int ret;
+        union xml_conv_val val;
+
+        ret = conv_attr(node, attr_name, XML_CACHE_BOOL, &val, cache);
+        if (ret == XML_CONV_OK)
+                *v = val.b;
+
+        return ret;
+}
+
+int xml_get_attr_enum(const struct xml_element *node, const wchar_t *attr_name, const wchar_t **table, int cnt, int *v)
+{
+        const wchar_t *value;
+
+        value = xml_get_attr(node, attr_name);
+        if (value == NULL)
+                return XML_CONV_MISSING;
+
+        return str_toenum(value, table, cnt, v);
+}
+
+const wchar_t *xml_get_name(const struct xml_element *node)
+{
+        assert(node);
+        return node->name;
+}
+
+const wchar_t *xml_get_value(const struct xml_element *node)
+{
+        assert(node);
+        return node->value;
+}
+
+size_t xml_get_name_len(const struct xml_element *node)
+{
+        assert(node);
+        return node->name_len;
+}
+
+size_t xml_get_value_len(const struct xml_element *node)
+{
+        assert(node);
+        return node->value_len;
+}
+
+int xml_get_attr_cnt(const struct xml_element *node)
+{
+        assert(node);
+        return (int)array_size(&node->attr);
+}
+
+const wchar_t *xml_get_attr_name(const struct xml_element *node, int i)
+{
+        assert(node);
+        assert(i >= 0 && (size_t)i < array_size(&node->attr));
+        return array_at(&node->attr, i, struct xml_attr).name;
+}
+
+const wchar_t *xml_get_attr_value(const struct xml_element *node, int i)
+{
+        assert(node);
+        assert(i >= 0 && (size_t)i < array_size(&node->attr));
+        return array_at(&node->attr, i, struct xml_attr).value;
+}
+
+size_t xml_get_attr_name_len(const struct xml_element *node, int i)
+{
+        assert(node);
+        assert(i >= 0 && (size_t)i < array_size(&node->attr));
+        return array_at(&node->attr, i, struct xml_attr).name_len;
+}
+
+size_t xml_get_attr_value_len(const struct xml_element *node, int i)
+{
+        assert(node);
+        assert(i >= 0 && (size_t)i < array_size(&node->attr));
+        return array_at(&node->attr, i, struct xml_attr).value_len;
+}
+
+int xml_get_value_i64(const struct xml_element *node, long long *v)
+{
+        int ret;
+        union xml_conv_val val;
+
+        assert(node);
+        ret = conv_value(node->value, XML_CACHE_I64, &val);
+        if (ret == XML_CONV_OK)
+                *v = val.i64;
+
+        return ret;
+}
+
+int xml_get_value_u64(const struct xml_element *node, unsigned long long *v)
+{
+        int ret;
+        union xml_conv_val val;
+
+        assert(node);
+        ret = conv_value(node->value, XML_CACHE_U64, &val);
+        if (ret == XML_CONV_OK)
+                *v = val.u64;
+
+        return ret;
+}
+
+int xml_get_value_double(const struct xml_element *node, double *v)
+{
+        int ret;
+        union xml_conv_val val;
+
+        assert(node);
+        ret = conv_value(node->value, XML_CACHE_DOUBLE, &val);
+        if (ret == XML_CONV_OK)
+                *v = val.d;
+
+        return ret;
+}
+
+int xml_get_value_bool(const struct xml_element *node, int *v)
+{
+        int ret;
+        union xml_conv_val val;
+
+        assert(node);
+        ret = conv_value(node->value, XML_CACHE_BOOL, &val);
+        if (ret == XML_CONV_OK)
+                *v = val.b;
+
+        return ret;
+}
+
+int xml_get_value_enum(const struct xml_element *node, const wchar_t **table, int cnt, int *v)
+{
+        assert(node);
+        if (node->value == NULL)
+                return XML_CONV_MISSING;
+
+        return str_toenum(node->value, table, cnt, v);
+}
+/* a shorter value is copied over the old one in place */
+wchar_t *xml_set_value_len(struct xml_element *node, const wchar_t *value, size_t len)
+{
+        wchar_t *v;
+
+        assert(node);
+        assert(value);
+
+        v = (wchar_t *)node->value;
+        if (v == NULL || len > node->value_len) {
+                v = (wchar_t *) malloc((len + 1)* sizeof(wchar_t));
+                if (v == NULL)
+                        return NULL;
+
+                if (node->value && (node_pooled(node) & XML_POOL_VALUE) == 0)
+                        free((wchar_t *)node->value);
+                if (node->side)
+                        node->side->pooled &= ~XML_POOL_VALUE;
+        }
+
+        wmemmove(v, value, len);
+        v[len] = 0;
+
+        node->value = v;
+        node->value_len = len;
+        mark_dirty(node, XML_DIRTY_VALUE);
+
+        return (wchar_t *)value;
+}
+
+wchar_t *xml_set_value(struct xml_element *node, const wchar_t *value)
+{
+        assert(value);
+
+        return xml_set_value_len(node, value, wcslen(value));
+}
+
+
+struct xml_element *xml_walkdown(const struct xml_element *node)
+{
+        assert(node);
+        return node->child;
+}
+
+struct xml_element *xml_walkup(const struct xml_element *node)
+{
+        assert(node);
+        return node->parent;
+}
+
+struct xml_element *xml_walknext(const struct xml_element *node)
+{
+        assert(node);
+        return node->next;
+}
+
+struct xml_element *xml_walkprev(const struct xml_element *node)
+{
+        assert(node);
+        return node->next;
+}
+
+/* every node below 'tree' is met twice, a node can be freed on XML_WALK_LEAVE */
+void xml_iter_init(struct xml_iter *it, const struct xml_element *tree, int brothers)
+{
+        assert(it);
+        iter_init(it, tree, brothers);
+}
+
+int xml_iter_next(struct xml_iter *it)
+{
+        assert(it);
+        return iter_next(it);
+}
+
+//the children of the node just entered are not walked
+void xml_iter_skip(struct xml_iter *it)
+{
+        assert(it);
+        if (it->event == XML_WALK_ENTER)
+                it->skip = 1;
+}
+struct xml_element *xml_search_child(const struct xml_element *parent, const wchar_t *name)
+{
+        size_t len;
+        struct xml_element *elm;
+
+        assert(parent);
+
+        len = wcslen(name);
+        for (elm = parent->child; elm; elm = elm->next) {
+               if (elm->name_len == len && wmemcmp(elm->name, name, len) == 0)
+                       break;
+        }
+
+        return elm;
+}
+
+struct xml_element *xml_search_brother(struct xml_element *brother, const wchar_t *name)
+{
+        size_t len;
+        struct xml_element *elm;
+
+        assert(brother);
+
+        len = wcslen(name);
+        for (elm = brother; elm; elm = elm->next) {
+               if (elm->name_len == len && wmemcmp(elm->name, name, len) == 0)
+                       break;
+        }
+
+        return elm;
+}
+
+
+struct xml_element *xml_new_len(const wchar_t *name, size_t name_len, const wchar_t *value, size_t value_len, enum xml_type type)
+{
+        wchar_t *name_tmp;
+        wchar_t *value_tmp;
+        struct xml_element      *elm;
+
+        assert(name);
+
+        if (value == NULL)
+                value_len = 0;
+
+        if (name_len == 0)
+                return NULL;
+
+        elm = (struct xml_element *)malloc(sizeof(*elm));
+        if (elm == NULL)
+                return elm;
+
+        memset(elm, 0, sizeof(*elm));
+        attr_init(elm);
+        elm->is_closed = 1;
+        elm->type = type;
+
+        name_tmp = (wchar_t *)malloc((name_len + 1) * sizeof(wchar_t));
+        if (name_tmp == NULL) {
+                free(elm);
+                return NULL;
+        }
+
+        wmemcpy(name_tmp, name, name_len);
+        name_tmp[name_len] = 0;
+
+        if (value_len) {
+                value_tmp = (wchar_t *)malloc((value_len + 1) * sizeof(wchar_t));
+                if (value_tmp == NULL) {
+                        free(name_tmp);
+                        free(elm);
+                        return NULL;
+                }
+
+                wmemcpy(value_tmp, value, value_len);
+                value_tmp[value_len] = 0;
+        } else {
+                value_tmp = NULL;
+        }
+
+        elm->name = name_tmp;
+        elm->name_len = name_len;
+        elm->value = value_tmp;
+        elm->value_len = value_len;
+
+        return elm;
+}
+
+struct xml_element *xml_new(const wchar_t *name, const wchar_t *value, enum xml_type type)
+{
+        assert(name);
+
+        return xml_new_len(name, wcslen(name), value, value ? wcslen(value) : 0, type);
+}
+
+
+struct xml_element *xml_append_child(struct xml_element *parent, struct xml_element *child)
+{
+        struct xml_element *tmp;
+        assert(parent);
+        assert(child);
+
+	assert(parent->value == NULL);
+
+        adopt(child);
+
+        if (parent->child == NULL) {
+                parent->child = child;
+                child->parent = parent;
+                if (parent->type == XML_ELEMENT_SELF) {
+                        parent->type = XML_ELEMENT;
+                        mark_dirty(parent, XML_DIRTY_SELF);
+                }
+                mark_dirty(child, XML_DIRTY_NEW);
+                return child;
+        }
+
+        for (tmp = parent->child; tmp->next; tmp = tmp->next)
+                ;
+
+        tmp->next = child;
+        child->prev = tmp;
+        child->parent = tmp->parent;
+        mark_dirty(child, XML_DIRTY_NEW);
+
+        return child;
+}
+
+struct xml_element *xml_append_brother(struct xml_element *b1, struct xml_element *b2)
+{
+        struct xml_element *tmp;
+
+        assert(b1);
+        assert(b2);
+
+        assert(b1->is_closed);
+
+        adopt(b2);
+
+        for (tmp = b1; tmp->next; tmp = tmp->next)
+                ;
+
+        tmp->next = b2;
+        b2->prev = tmp;
+        b2->parent = b1->parent;
+        mark_dirty(b2, XML_DIRTY_NEW);
+
+        return b2;
+}
+
+/* a document written front to back, every node and string come from one pool */
+struct xml_builder {
+	struct xml_pool		*pool;
+	struct xml_element	*tree;
+	//the open element, NULL at the top level
+	struct xml_element	*curr;
+	//the last node under 'curr', a new one is linked behind it
+	struct xml_element	*last;
+	int			err;
+};
+
+static wchar_t *build_str(struct xml_builder *b, const wchar_t *str, size_t len)
+{
+	wchar_t *s;
+
+	s = (wchar_t *)pool_alloc(b->pool, (len + 1) * sizeof(wchar_t));
+	if (s == NULL)
+		return NULL;
+
+	wmemcpy(s, str, len);
+	s[len] = 0;
+
+	return s;
+}
+
+static struct xml_element *build_node(struct xml_builder *b, enum xml_type type, const wchar_t *name, size_t len)
+{
+	wchar_t *s;
+	struct xml_element *elm;
+
+	if (b->err || len == 0 || (b->curr && b->curr->value)) {
+		b->err = 1;
+		return NULL;
+	}
+
+	elm = (struct xml_element *)pool_alloc(b->pool, XML_NODE_SIDE);
+	s = build_str(b, name, len);
+	if (elm == NULL || s == NULL) {
+		b->err = 1;
+		return NULL;
+	}
+
+	side_init(elm);
+	elm->type = type;
+	elm->name = s;
+	elm->name_len = len;
+	elm->side->pool = b->pool;
+	elm->side->pooled = XML_POOL_NAME;
+	b->pool->ref++;
+
+	elm->parent = b->curr;
+	elm->prev = b->last;
+	if (b->last)
+		b->last->next = elm;
+	else if (b->curr)
+		b->curr->child = elm;
+	else
+		b->tree = elm;
+
+	b->last = elm;
+
+	return elm;
+}
+
+struct xml_builder *xml_builder_new(void)
+{
+	struct xml_builder *b;
+
+	b = (struct xml_builder *)malloc(sizeof(*b));
+	if (b == NULL)
+		return NULL;
+
+	memset(b, 0, sizeof(*b));
+	b->pool = pool_new(0);
+	if (b->pool == NULL) {
+		free(b);
+		return NULL;
+	}
+
+	b->pool->ref = 1;
+
+	return b;
+}
+
+//a negative length is taken as NUL terminated, the same for all xml_builder_*
+int xml_builder_open(struct xml_builder *b, const wchar_t *name, ptrdiff_t len, enum xml_type type)
+{
+	struct xml_element *elm;
+
+	assert(b);
+	assert(name);
+	assert(type != XML_COMMENT);
 
-		if (array_push(content->tmp->attr, &attr)) {
-			free(attr.name);
-			free(attr.value);
-			content->have_err = 1;
-			content->curr_state = XML_STATE_END;
-			return 0;
-		}
-	}
+	elm = build_node(b, type, name, len < 0 ? wcslen(name) : (size_t)len);
+	if (elm == NULL)
+		return -1;
 
-	content->curr_state = XML_STATE_DISPATCH;
+	b->curr = elm;
+	b->last = NULL;
 
 	return 0;
 }
-static int state_value(struct xml_state_content *content)
-{
-	int len;
-	wchar_t *value;
-	content->data_curr = skip_space(content->data_curr, content->data_end);
-
-        if (content->data_end - content->data_curr >= 2 &&
-                *content->data_curr == L'<' &&
-                *(content->data_curr + 1) == L'/') {
-                content->curr_state = XML_STATE_DISPATCH;
-                return 0;
-        } else if (*content->data_curr == L'<') {
-		add_elem(content);
-		content->curr_state = XML_STATE_OPEN;
-		return 0;
-	}
 
-	len = strlen_t(content->data_curr, content->data_end, L"<");
+//only before the first child or text of the element just opened
+int xml_builder_attr(struct xml_builder *b, const wchar_t *name, ptrdiff_t name_len, const wchar_t *value, ptrdiff_t value_len)
+{
+	struct xml_attr attr;
 
-	assert(content->tmp);
+	assert(b);
+	assert(name);
+	assert(value);
 
-	value = (wchar_t *)malloc((len + 1) * sizeof(wchar_t));
-	if (value == NULL) {
-		content->curr_state = XML_STATE_END;
-		return 0;
-	}
+	if (b->err || b->curr == NULL || b->last || b->curr->value)
+		goto err;
 
-	strcpy_t(value, content->data_curr, L"<");
+	memset(&attr, 0, sizeof(attr));
+	attr.name_len = name_len < 0 ? wcslen(name) : (size_t)name_len;
+	attr.value_len = value_len < 0 ? wcslen(value) : (size_t)value_len;
+	attr.name = build_str(b, name, attr.name_len);
+	attr.value = build_str(b, value, attr.value_len);
+	if (attr.name == NULL || attr.value == NULL)
+		goto err;
 
-	content->tmp->value = value;
-	content->data_curr += len;
+	if (array_push(&b->curr->attr, &attr) < 0)
+		goto err;
 
-	
-	content->curr_state = XML_STATE_DISPATCH;
+	b->curr->side->pooled |= XML_POOL_ATTR;
 
 	return 0;
+err:
+	b->err = 1;
+	return -1;
 }
-static int state_close(struct xml_state_content *content)
+
+//an element hold a value or children, never both
+int xml_builder_text(struct xml_builder *b, const wchar_t *text, ptrdiff_t len)
 {
+	size_t n;
+	wchar_t *v;
 
-	close_elem(content);
-	add_elem(content);
-	
-	content->curr_state = XML_STATE_DISPATCH;
+	assert(b);
+	assert(text);
+
+	n = len < 0 ? wcslen(text) : (size_t)len;
+
+	if (b->err || b->curr == NULL || b->last || b->curr->value)
+		goto err;
+
+	v = build_str(b, text, n);
+	if (v == NULL)
+		goto err;
+
+	b->curr->value = v;
+	b->curr->value_len = n;
+	b->curr->side->pooled |= XML_POOL_VALUE;
 
 	return 0;
+err:
+	b->err = 1;
+	return -1;
 }
-static int state_end(struct xml_state_content *content)
+
+int xml_builder_comment(struct xml_builder *b, const wchar_t *text, ptrdiff_t len)
 {
-        if (content->have_err == 0)
-                return 0;
- 
-        if (content->tmp)
-                xml_free_element(content->tmp);
-        if (content->tree)
-                xml_free(content->tree);
+	struct xml_element *elm;
 
-        content->tree = NULL;
+	assert(b);
+	assert(text);
+
+	elm = build_node(b, XML_COMMENT, text, len < 0 ? wcslen(text) : (size_t)len);
+	if (elm == NULL)
+		return -1;
+
+	elm->is_closed = 1;
 
 	return 0;
 }
-static int state_dispatch(struct xml_state_content *content)
+
+int xml_builder_close(struct xml_builder *b)
 {
-	if (content->last_state != XML_STATE_CLOSE && content->data_curr >= content->data_end) {
-		content->have_err = 1;
-		content->curr_state = XML_STATE_END;
-		return 0;
+	assert(b);
+
+	if (b->err || b->curr == NULL) {
+		b->err = 1;
+		return -1;
 	}
 
-	switch (content->last_state) {
-        case XML_STATE_OPEN:
-                if (str_issapce(*content->data_curr) ||
-                        (content->data_curr + 2 >= content->data_end)) {
-                        content->have_err = 1;
-                        content->curr_state = XML_STATE_END;
-                }
-                
-                if (content->tmp == NULL) {
-                        content->have_err = 1;
-                        content->curr_state = XML_STATE_END;
+	b->curr->is_closed = 1;
+	b->last = b->curr;
+	b->curr = b->curr->parent;
 
-                        return 0;
-                }
+	return 0;
+}
 
-                if (content->tmp->type == XML_COMMENT)
-                        content->curr_state = XML_STATE_COMMENT;
-                else
-                        content->curr_state = XML_STATE_NAME;
-                break;
-	case XML_STATE_NAME:
-		if (str_issapce(*content->data_curr)) {
-			content->curr_state = XML_STATE_ATTR;
-		} else if (content->data_end - content->data_curr > 1 && *content->data_curr == L'>') {
-			content->data_curr += 1;
-			content->curr_state = XML_STATE_VALUE;
-		} else {
-			content->have_err = 1;
-			content->curr_state = XML_STATE_END;
-		}
-		break;
-        case XML_STATE_COMMENT:
-		content->data_curr = skip_space(content->data_curr, content->data_end);
-                if (content->data_curr == content->data_end)
-                        content->curr_state = XML_STATE_END;
+/* 'b' is gone after it, the tree come back only when every element was closed */
+struct xml_element *xml_builder_end(struct xml_builder *b)
+{
+	struct xml_element *tree;
 
-                if (content->data_end - content->data_curr > 2 && *content->data_curr == L'<' && *(content->data_curr + 1) == L'/')
-			content->curr_state = XML_STATE_CLOSE;
-                else
-                        content->curr_state = XML_STATE_OPEN;
-                break;
-	case XML_STATE_ATTR:
-		content->data_curr = skip_space(content->data_curr, content->data_end);
-		if (content->data_curr >= content->data_end) {
-			content->have_err = 1;
-			content->curr_state = XML_STATE_END;
-		} else if (*content->data_curr == L'>') {
-			content->data_curr += 1;
-			content->curr_state = XML_STATE_VALUE;
-		} else if ((content->data_end - content->data_curr > 2 && *content->data_curr == L'/' && *(content->data_curr + 1) == L'>') ||
-			(content->data_end - content->data_curr > 2 && *content->data_curr == L'?' && *(content->data_curr + 1) == L'>')) {
-			content->curr_state = XML_STATE_CLOSE;
-			content->data_curr += 1;
-		} else {
-			content->have_err = 1;
-			content->curr_state = XML_STATE_END;
-		}
-		break;
-	case XML_STATE_VALUE:
-		content->data_curr = skip_space(content->data_curr, content->data_end);
-		if (*content->data_curr == L'<' && *(content->data_curr + 1) == L'/') {
-			content->curr_state = XML_STATE_CLOSE;
-		} else {
-			content->have_err = 1;
-			content->curr_state = XML_STATE_END;
-		}
-		break;
-	case XML_STATE_CLOSE:
-		content->data_curr = skip_space(content->data_curr, content->data_end);
-		if (content->data_end - content->data_curr > 2 && *content->data_curr == L'<' && *(content->data_curr + 1) == L'/')
-			content->curr_state = XML_STATE_CLOSE;
-		else if (content->data_curr < content->data_end)
-			content->curr_state = XML_STATE_OPEN;
-		else
-			content->curr_state = XML_STATE_END;
-		break;
+	assert(b);
 
+	tree = b->tree;
+	if (b->err || b->curr) {
+		free_forest(tree);
+		tree = NULL;
 	}
-	return 0;
+
+	pool_put(b->pool);
+	free(b);
+
+	return tree;
 }
 
-typedef int (state_func_t)(struct xml_state_content *content);
-state_func_t *state_func_tbl[] = {
-	state_open,
-	state_name,
-        state_comment,
-	state_attr,
-	state_value,
-	state_close,
-	state_end,
-	state_dispatch,
-};
+#define	XML_ALIGN(n)	(((n) + 7) & ~(size_t)7)
 
-static xml_element *parse_data(const wchar_t *data, unsigned long size)
+static size_t compact_str(size_t len)
 {
-	enum xml_state last_state;
-	struct xml_state_content state_content;
+	return XML_ALIGN((len + 1) * sizeof(wchar_t));
+}
 
-	assert(size % 2 == 0);
-	assert(data);
+static wchar_t *compact_put(char **p, const wchar_t *str, size_t len)
+{
+	wchar_t *s;
 
-	if (size < 2)
-		return NULL;
+	s = (wchar_t *)*p;
+	if (len)
+		wmemcpy(s, str, len);
+	s[len] = 0;
+	*p += compact_str(len);
 
-	memset(&state_content, 0, sizeof(state_content));
+	return s;
+}
+
+struct xml_compact_size {
+	size_t	cnt;
+	size_t	node;
+	size_t	attr;
+	size_t	str;
+};
+
+static size_t compact_measure(const struct xml_element *tree, struct xml_compact_size *sz)
+{
+	size_t i;
+	struct xml_iter it;
+	const struct xml_element *elm;
+	const struct xml_attr *attr;
+
+	memset(sz, 0, sizeof(*sz));
+	iter_init(&it, tree, 1);
+	while (iter_next(&it)) {
+		if (it.event == XML_WALK_LEAVE)
+			continue;
+
+		elm = it.node;
+		sz->cnt++;
+		sz->str += compact_str(elm->name_len);
+		if (elm->value)
+			sz->str += compact_str(elm->value_len);
+		if (array_size(&elm->attr) > XML_ATTR_INLINE)
+			sz->attr += XML_ALIGN(array_size(&elm->attr) * sizeof(struct xml_attr));
+		for (i = 0; i < array_size(&elm->attr); i++) {
+			attr = &array_at(&elm->attr, i, struct xml_attr);
+			sz->str += compact_str(attr->name_len) + compact_str(attr->value_len);
+		}
+	}
 
-	state_content.data_curr = data;
-	state_content.data_end = data + size / sizeof(wchar_t);
+	//each node bring its side, the pool it belong to is kept there
+	sz->node = XML_ALIGN(sz->cnt * XML_NODE_SIDE);
 
-	if (*state_content.data_curr == 0xfeff)
-		state_content.data_curr += 1;
+	return sz->node + sz->attr + sz->str;
+}
+
+/* the nodes in depth first order then the attributes and the strings, none of them carry a meta */
+static struct xml_element *compact_fill(const struct xml_element *tree, const struct xml_compact_size *sz, char *block, struct xml_pool *pool)
+{
+	size_t i;
+	size_t cnt;
+	char *node_p;
+	char *attr_p;
+	char *str_p;
+	struct xml_iter it;
+	struct xml_attr *attr;
+	struct xml_element *elm;
+	struct xml_element *top;
+	struct xml_element *up;
+	struct xml_element *last;
+
+	node_p = block;
+	attr_p = node_p + sz->node;
+	str_p = attr_p + sz->attr;
+
+	top = NULL;
+	up = NULL;
+	last = NULL;
+	iter_init(&it, tree, 1);
+	while (iter_next(&it)) {
+		if (it.event == XML_WALK_LEAVE) {
+			last = up;
+			up = up->parent;
+			continue;
+		}
 
+		elm = (struct xml_element *)node_p;
+		node_p += XML_NODE_SIDE;
+		*elm = *it.node;
+		elm->side = (struct xml_side *)(elm + 1);
+		if (it.node->side) {
+			*elm->side = *it.node->side;
+		} else {
+			memset(elm->side, 0, sizeof(*elm->side));
+			elm->side->dirty = XML_DIRTY_NEW;
+		}
+		elm->parent = up;
+		elm->prev = last;
+		elm->next = NULL;
+		elm->child = NULL;
+		elm->side->meta = NULL;
+		elm->side->apart = 0;
+		if (last)
+			last->next = elm;
+		else if (up)
+			up->child = elm;
+		else
+			top = elm;
+
+		elm->side->pool = pool;
+		elm->side->pooled = pool ? XML_POOL_NAME : XML_POOL_NAME | XML_POOL_EXTERN;
+		elm->name = compact_put(&str_p, it.node->name, it.node->name_len);
+		if (it.node->value) {
+			elm->value = compact_put(&str_p, it.node->value, it.node->value_len);
+			elm->side->pooled |= XML_POOL_VALUE;
+		}
 
+		cnt = array_size(&it.node->attr);
+		if (cnt > XML_ATTR_INLINE) {
+			array_init(&elm->attr, sizeof(struct xml_attr), attr_p, cnt);
+			attr_p += XML_ALIGN(cnt * sizeof(struct xml_attr));
+		} else {
+			attr_init(elm);
+		}
 
-	state_content.tree = NULL;
-	last_state = state_content.last_state = state_content.curr_state = XML_STATE_OPEN;
+		elm->side->pooled |= XML_POOL_ATTR;
+		for (i = 0; i < cnt; i++) {
+			array_push(&elm->attr, &array_at(&it.node->attr, i, struct xml_attr));
+			attr = &array_at(&elm->attr, i, struct xml_attr);
+			attr->name = compact_put(&str_p, attr->name, attr->name_len);
+			attr->value = compact_put(&str_p, attr->value, attr->value_len);
+			attr->conv = NULL;
+		}
 
-	while (state_content.last_state != XML_STATE_END) {
-		last_state = state_content.curr_state;
-		state_func_tbl[state_content.curr_state](&state_content);
-		state_content.last_state = last_state;
+		up = elm;
+		last = NULL;
 	}
 
-        assert(state_content.have_err == 0);
-
-	return state_content.tree;
+	return top;
 }
 
-struct xml_element *xml_load_file(const wchar_t *path)
+/* a copy of 'tree' and its brothers in one block, 'tree' is freed unless it give NULL */
+struct xml_element *xml_compact(struct xml_element *tree)
 {
-	FILE *fp;
-	wchar_t	*data;
-	struct _stat	st;
-	struct xml_element	*tree;
+	struct xml_pool *pool;
+	struct xml_element *top;
+	struct xml_compact_size sz;
 
-	if (_wstat(path, &st) == -1)
-		return NULL;
-	
-	tree = NULL;
-	fp = NULL;
-	data = NULL;
+	assert(tree);
 
-	fp = _wfopen(path, L"rb");
-	if (fp == NULL)
-		goto end;
+	if (tree->parent || tree->prev)
+		return NULL;
 
-	data = (wchar_t *)malloc(st.st_size);
-	if (data == NULL)
-		goto end;
-	
-	if (fread(data, 1, st.st_size, fp) != (size_t)st.st_size)
-		goto end;
- 
-	tree = parse_data(data, st.st_size);
+	pool = pool_new(compact_measure(tree, &sz));
+	if (pool == NULL)
+		return NULL;
 
-end:
-	if (fp)
-		fclose(fp);
-	if (data)
-		free(data);
+	pool->ref = sz.cnt;
+	pool->head->used = pool->head->size;
+	top = compact_fill(tree, &sz, (char *)(pool->head + 1), pool);
 
-	return tree;
-}
+	//the source the ranges index move over with the meta
+	top->side->meta = node_meta(tree);
+	if (tree->side)
+		tree->side->meta = NULL;
 
+	free_forest(tree);
 
+	return top;
+}
 
-int xml_free_child(struct xml_element *tree)
+//what xml_compact_to need, 'tree' and its brothers
+size_t xml_compact_size(const struct xml_element *tree)
 {
-	struct xml_element *tmp;
-
-        assert(tree);
-	if (tree == NULL)
-		return 0;
-        
-        tree = tree->child;
-        if (tree == NULL)
-                return 0;
+	struct xml_compact_size sz;
 
-        tree->parent->child = NULL;
+	assert(tree);
 
-        while (tree) {
-                tmp = tree;
-		if (tmp->child)
-			xml_free(tmp->child);
-		
-                tree = tree->next;
-		xml_free_element(tmp);
-	}
-        
-        return 0;
+	return compact_measure(tree, &sz);
 }
-int xml_free(struct xml_element *tree)
+
+/* the same layout into 'buff', aligned to 8, 'tree' is left as it is.
+ * the copy belong to 'buff' and is never given to xml_free.
+ */
+struct xml_element *xml_compact_to(const struct xml_element *tree, void *buff, size_t size)
 {
-	if (tree == NULL)
-		return 0;
- 
-        if (tree->parent && tree->parent->child == tree) {
-                assert(tree->prev == NULL);
-                tree->parent->child = tree->next;
-        } else if (tree->prev) {
-                tree->prev->next = tree->next;
-        } else {
-                //do nothing
-        }
+	struct xml_compact_size sz;
 
-        xml_free_child(tree);
+	assert(tree);
+	assert(buff);
+	assert(((size_t)buff & 7) == 0);
 
-        xml_free_element(tree);
+	if (tree->parent || tree->prev || compact_measure(tree, &sz) > size)
+		return NULL;
 
-        return 0;
+	return compact_fill(tree, &sz, (char *)buff, NULL);
 }
 
-enum xml_type xml_get_type(const struct xml_element *node)
+static void *move_ptr(const void *p, ptrdiff_t delta)
 {
-        assert(node);
-
-        return node->type;
+	return p ? (char *)p + delta : NULL;
 }
 
-const wchar_t *xml_get_attr(const struct xml_element *node, const wchar_t *attr_name)
+/* the block of xml_compact_to copied whole from 'from' to 'buff', its pointers are made to
+ * follow. 'tree' is what xml_compact_to gave at 'from', it is only counted on, never read
+ */
+struct xml_element *xml_compact_move(void *buff, const void *from, const struct xml_element *tree)
 {
-        int i;
-
-        assert(node);
-        assert(attr_name);
-
-        for (i = 0; i < array_size(node->attr); i++) {
-                if (wcscmp(array_at(node->attr, i, struct xml_attr).name, attr_name) == 0)
-                        break;
-        }
-        
-        if (i >= array_size(node->attr))
-                return NULL;
+	size_t i;
+	ptrdiff_t delta;
+	struct xml_iter it;
+	struct xml_attr *attr;
+	struct xml_element *elm;
+	struct xml_element *top;
+
+	assert(buff);
+	assert(from);
+	assert(tree);
+
+	delta = (char *)buff - (const char *)from;
+	top = (struct xml_element *)move_ptr(tree, delta);
+
+	//a node is moved when it is entered, before the walk read where it go next
+	iter_init(&it, top, 1);
+	while (iter_next(&it)) {
+		if (it.event == XML_WALK_LEAVE)
+			continue;
+
+		elm = it.node;
+		elm->side = (struct xml_side *)move_ptr(elm->side, delta);
+		assert(elm->side->pooled & XML_POOL_EXTERN);
+		elm->name = (const wchar_t *)move_ptr(elm->name, delta);
+		elm->value = (const wchar_t *)move_ptr(elm->value, delta);
+		elm->next = (struct xml_element *)move_ptr(elm->next, delta);
+		elm->prev = (struct xml_element *)move_ptr(elm->prev, delta);
+		elm->parent = (struct xml_element *)move_ptr(elm->parent, delta);
+		elm->child = (struct xml_element *)move_ptr(elm->child, delta);
+		elm->attr.buff = move_ptr(elm->attr.buff, delta);
+		for (i = 0; i < array_size(&elm->attr); i++) {
+			attr = &array_at(&elm->attr, i, struct xml_attr);
+			attr->name = (wchar_t *)move_ptr(attr->name, delta);
+			attr->value = (wchar_t *)move_ptr(attr->value, delta);
+		}
+	}
 
-        return array_at(node->attr, i, struct xml_attr).value; 
+	return top;
 }
 
-const wchar_t *xml_get_name(const struct xml_element *node)
+static unsigned long long hash_mix(unsigned long long h, unsigned long long v)
 {
-        assert(node);
-        return node->name;
+	v ^= v >> 33;
+	v *= 0xff51afd7ed558ccdULL;
+	v ^= v >> 33;
+
+	return (h ^ v) * XML_HASH_MUL;
 }
 
-const wchar_t *xml_get_value(const struct xml_element *node)
+//what the node hold itself, an empty value is the same as none
+static unsigned long long hash_self(const struct xml_element *elm)
 {
-        assert(node);
-        return node->value;
+	size_t i;
+	unsigned long long h;
+	const struct xml_attr *attr;
+
+	h = hash_mix(0, elm->type);
+	h = hash_mix(h, elm->name_len);
+	h = hash_step(h, elm->name, elm->name + elm->name_len);
+	h = hash_mix(h, array_size(&elm->attr));
+	for (i = 0; i < array_size(&elm->attr); i++) {
+		attr = &array_at(&elm->attr, i, struct xml_attr);
+		h = hash_mix(h, attr->name_len);
+		h = hash_step(h, attr->name, attr->name + attr->name_len);
+		h = hash_mix(h, attr->value_len);
+		h = hash_step(h, attr->value, attr->value + attr->value_len);
+	}
+
+	h = hash_mix(h, elm->value ? elm->value_len : 0);
+	if (elm->value)
+		h = hash_step(h, elm->value, elm->value + elm->value_len);
+
+	return h;
 }
-/* TODO:
- *      һַͼ¼ڴСִ
- *      ǰַȽ϶ֱcopy
+
+/* bottom up, a subtree still hashed is not entered again. the hashes are kept on the nodes the
+ * first time they are asked for, so xml_hash, xml_equal and xml_diff write into a tree not hashed
+ * yet and two threads can't run them on it at once. on a hashed tree they only read, xml_cache,
+ * xml_doc and xml_shm hash theirs before they hand them out. a node kept its hash in its side,
+ * made here when it had none, so -1 is no memory
  */
+static int tree_hash(const struct xml_element *tree, unsigned long long *hash)
+{
+	unsigned long long h;
+	struct xml_iter it;
+	struct xml_element *elm;
+	const struct xml_element *child;
+
+	iter_init(&it, tree, 0);
+	while (iter_next(&it)) {
+		elm = it.node;
+		if (it.event == XML_WALK_ENTER) {
+			if (node_hashed(elm))
+				xml_iter_skip(&it);
+			continue;
+		}
+
+		if (node_hashed(elm))
+			continue;
+
+		if (side_get(elm) == NULL)
+			return -1;
+
+		h = hash_self(elm);
+		for (child = elm->child; child; child = child->next)
+			h = hash_mix(h, child->side->hash);
 
+		elm->side->hash = h;
+		elm->side->hashed = 1;
+	}
 
-wchar_t *xml_set_value(struct xml_element *node, const wchar_t *value)
+	*hash = tree->side->hash;
+
+	return 0;
+}
+
+static int same_self(const struct xml_element *a, const struct xml_element *b)
 {
-        int len;
-        wchar_t *v;
+	size_t i;
+	const struct xml_attr *x;
+	const struct xml_attr *y;
 
-        assert(value);
+	if (a->type != b->type || a->name_len != b->name_len || wmemcmp(a->name, b->name, a->name_len) != 0)
+		return 0;
 
-        v = (wchar_t *)node->value;
+	if ((a->value ? a->value_len : 0) != (b->value ? b->value_len : 0))
+		return 0;
+	if (a->value && b->value && wmemcmp(a->value, b->value, a->value_len) != 0)
+		return 0;
 
-        if (node->value) {
-                free(v);
-                node->value = NULL;
-        }
-        
-        len = wcslen(value);
-        v = (wchar_t *) malloc((len + 1)* sizeof(wchar_t));
-        if (v == NULL)
-                return NULL;
+	if (array_size(&a->attr) != array_size(&b->attr))
+		return 0;
 
-        wcsncpy(v, value, len);
-        v[len] = 0;
- 
-        node->value =v;
+	for (i = 0; i < array_size(&a->attr); i++) {
+		x = &array_at(&a->attr, i, struct xml_attr);
+		y = &array_at(&b->attr, i, struct xml_attr);
+		if (x->name_len != y->name_len || x->value_len != y->value_len)
+			return 0;
+		if (wmemcmp(x->name, y->name, x->name_len) != 0 || wmemcmp(x->value, y->value, x->value_len) != 0)
+			return 0;
+	}
 
-        return (wchar_t *)value;
+	return 1;
 }
 
-
-struct xml_element *xml_walkdown(const struct xml_element *node)
+/* both walked in step, two nodes hashed already are told apart by the hash first. a hash can
+ * collide, so two subtrees are only the same once this say so
+ */
+static int same_tree(const struct xml_element *a, const struct xml_element *b)
 {
-        assert(node);
-        return node->child;
+	int more;
+	struct xml_iter ia;
+	struct xml_iter ib;
+
+	iter_init(&ia, a, 0);
+	iter_init(&ib, b, 0);
+	for (;;) {
+		more = iter_next(&ia);
+		if (more != iter_next(&ib))
+			return 0;
+		if (more == 0)
+			return 1;
+
+		if (ia.event != ib.event)
+			return 0;
+		if (ia.event != XML_WALK_ENTER)
+			continue;
+
+		if (node_hashed(ia.node) && node_hashed(ib.node) && ia.node->side->hash != ib.node->side->hash)
+			return 0;
+		if (!same_self(ia.node, ib.node))
+			return 0;
+	}
 }
 
-struct xml_element *xml_walkup(const struct xml_element *node)
+//a different hash is a quick no, the same one is checked node by node, as is all without a hash
+static int same_hash_tree(const struct xml_element *a, const struct xml_element *b)
 {
-        assert(node);
-        return node->parent;
+	unsigned long long ha;
+	unsigned long long hb;
+
+	if (tree_hash(a, &ha) == 0 && tree_hash(b, &hb) == 0 && ha != hb)
+		return 0;
+
+	return same_tree(a, b);
 }
 
-struct xml_element *xml_walknext(const struct xml_element *node)
+static int same_tag(const struct xml_element *a, const struct xml_element *b)
 {
-        assert(node);
-        return node->next;
+	return a->type == b->type && a->name_len == b->name_len && wmemcmp(a->name, b->name, a->name_len) == 0;
 }
 
-struct xml_element *xml_walkprev(const struct xml_element *node)
+//at the top of a document the brothers are taken in too, elsewhere only the node
+static const struct xml_element *list_stop(const struct xml_element *elm)
 {
-        assert(node);
-        return node->next;
+	return elm->parent ? elm->next : NULL;
 }
-struct xml_element *xml_search_child(const struct xml_element *parent, const wchar_t *name)
+
+//0 when there was no memory to keep the hashes
+unsigned long long xml_hash(const struct xml_element *tree)
 {
-        struct xml_element *elm;
+	unsigned long long h;
 
-        assert(parent);
+	assert(tree);
 
-        for (elm = parent->child; elm; elm = elm->next) {
-               if (wcscmp(elm->name, name) == 0)
-                       break;
-        }
+	if (tree_hash(tree, &h))
+		return 0;
 
-        return elm;
+	return h;
 }
 
-struct xml_element *xml_search_brother(struct xml_element *brother, const wchar_t *name)
+int xml_equal(const struct xml_element *a, const struct xml_element *b)
 {
-        struct xml_element *elm;
+	const struct xml_element *a_stop;
+	const struct xml_element *b_stop;
 
-        assert(brother);
+	assert(a);
+	assert(b);
 
-        for (elm = brother; elm; elm = elm->next) {
-               if (wcscmp(elm->name, name) == 0)
-                       break;
-        }
+	a_stop = list_stop(a);
+	b_stop = list_stop(b);
+	for (; a != a_stop && b != b_stop; a = a->next, b = b->next) {
+		if (!same_hash_tree(a, b))
+			return 0;
+	}
 
-        return elm;
+	return a == a_stop && b == b_stop;
 }
 
+/* two lists of brothers to compare, [a, a_stop) against [b, b_stop) */
+struct xml_diff_span {
+	const struct xml_element	*a;
+	const struct xml_element	*a_stop;
+	const struct xml_element	*b;
+	const struct xml_element	*b_stop;
+};
 
-struct xml_element *xml_new(const wchar_t *name, const wchar_t *value, enum xml_type type)
+static const struct xml_element *span_last(const struct xml_element *elm, const struct xml_element *stop)
 {
-        int name_len;
-        int value_len;
-        wchar_t *name_tmp;
-        wchar_t *value_tmp;
-        struct xml_element      *elm;
-
-        assert(name);
- 
-        elm = (struct xml_element *)malloc(sizeof(*elm));
-        if (elm == NULL)
-                return elm;
-
-        memset(elm, 0, sizeof(*elm));
-        elm->is_closed = 1;
-        elm->type = type;
-
-        name_len = wcslen(name);
-        if (value)
-                value_len = wcslen(value);
-        else
-                value_len = 0;
- 
-        if (name_len == 0) {
-                free(elm);
-                return NULL;
-        }
-
-        if (name_len) {
-                name_tmp = (wchar_t *)malloc((name_len + 1) * sizeof(wchar_t));
-                wcsncpy(name_tmp, name, name_len);
-                name_tmp[name_len] = 0;
-        } else {
-                name_tmp = NULL;
-        }
-
-        if (value_len) {
-                value_tmp = (wchar_t *)malloc((value_len + 1) * sizeof(wchar_t));
-                wcsncpy(value_tmp, value, value_len);
-                value_tmp[value_len] = 0;
-        } else {
-                value_tmp = NULL;
-        }
+	const struct xml_element *last;
 
-        if (name_tmp == NULL) {
-                if (value_tmp)
-                        free(value_tmp);
-                free(elm);
-
-                return NULL;
-        }
-
-        elm->name = name_tmp;
-        elm->value = value_tmp;
+	for (last = NULL; elm != stop; elm = elm->next)
+		last = elm;
 
-        return elm;
+	return last;
 }
 
-struct xml_element *xml_append_child(struct xml_element *parent, struct xml_element *child)
+/* the equal heads and tails are cut, what is left is matched in order by the tag. an equal
+ * subtree is walked once to confirm its hash, one that differ is entered on the hash alone
+ */
+static int diff_span(const struct xml_diff_span *s, struct array *todo, xml_diff_cb *cb, void *ud)
 {
-        struct xml_element *tmp;
-        assert(parent);
-        assert(child);
-
-	assert(parent->value == NULL);
-
-        if (parent->child == NULL) {
-                parent->child = child;
-                child->parent = parent;
-                if (parent->type == XML_ELEMENT_SELF)
-                        parent->type = XML_ELEMENT;
-                return child;
-        }
+	int n;
+	const struct xml_element *a, *a_last, *a_end;
+	const struct xml_element *b, *b_last, *b_end;
+	struct xml_diff_span sub;
+
+	a = s->a;
+	b = s->b;
+	while (a != s->a_stop && b != s->b_stop && same_hash_tree(a, b)) {
+		a = a->next;
+		b = b->next;
+	}
 
-        for (tmp = parent->child; tmp->next; tmp = tmp->next)
-                ;
+	a_end = s->a_stop;
+	b_end = s->b_stop;
+	a_last = span_last(a, a_end);
+	b_last = span_last(b, b_end);
+	while (a_last && b_last && same_hash_tree(a_last, b_last)) {
+		a_end = a_last;
+		b_end = b_last;
+		a_last = a_last == a ? NULL : a_last->prev;
+		b_last = b_last == b ? NULL : b_last->prev;
+	}
 
-        tmp->next = child;
-        child->prev = tmp;
-        child->parent = tmp->parent;
+	n = 0;
+	while (a != a_end || b != b_end) {
+		if (a != a_end && b != b_end && same_tag(a, b)) {
+			if (!same_self(a, b)) {
+				cb(ud, a, b);
+				n++;
+			}
+
+			sub.a = a->child;
+			sub.a_stop = NULL;
+			sub.b = b->child;
+			sub.b_stop = NULL;
+			if (!same_hash_tree(a, b) && array_push(todo, &sub))
+				return -1;
+
+			a = a->next;
+			b = b->next;
+		} else if (b != b_end && (a == a_end || (b->next != b_end && same_tag(a, b->next)))) {
+			cb(ud, NULL, b);
+			n++;
+			b = b->next;
+		} else {
+			cb(ud, a, NULL);
+			n++;
+			a = a->next;
+		}
+	}
 
-        return child;
+	return n;
 }
 
-struct xml_element *xml_append_brother(struct xml_element *b1, struct xml_element *b2)
+/* 'cb' get (a, b) for a node changed in place, (a, NULL) for one removed and (NULL, b) for one added,
+ * a subtree whose hash differ is entered at once, return how many changes there are or -1 */
+int xml_diff(const struct xml_element *a, const struct xml_element *b, xml_diff_cb *cb, void *ud)
 {
-        struct xml_element *tmp;
+	int n;
+	int total;
+	size_t cnt;
+	struct array todo;
+	struct xml_diff_span s;
+
+	assert(a);
+	assert(b);
+	assert(cb);
+
+	array_init(&todo, sizeof(struct xml_diff_span), NULL, 0);
+
+	s.a = a;
+	s.a_stop = list_stop(a);
+	s.b = b;
+	s.b_stop = list_stop(b);
+	if (array_push(&todo, &s))
+		return -1;
+
+	total = 0;
+	while ((cnt = array_size(&todo)) > 0) {
+		s = array_at(&todo, cnt - 1, struct xml_diff_span);
+		array_erase(&todo, cnt - 1);
+		n = diff_span(&s, &todo, cb, ud);
+		if (n < 0) {
+			total = -1;
+			break;
+		}
 
-        assert(b1);
-        assert(b2);
+		total += n;
+	}
 
-        assert(b1->is_closed);
+	array_release(&todo);
 
-        for (tmp = b1; tmp->next; tmp = tmp->next)
-                ;
+	return total;
+}
 
-        tmp->next = b2;
-        b2->prev = tmp;
-        b2->parent = b1->parent;
+static size_t put_str(wchar_t *buff, const wchar_t *str, size_t len)
+{
+        wmemcpy(buff, str, len);
 
-        return b2;
+        return len;
 }
 
-static int format_name(const struct xml_element *elm, wchar_t *buff, int size, int descent)
+#define	put_lit(buff, lit)	put_str(buff, lit, sizeof(lit) / sizeof(wchar_t) - 1)
+
+static size_t format_name(const struct xml_element *elm, wchar_t *buff, size_t size, int descent)
 {
-        int i;
-        int len;
+        size_t i;
+        size_t len;
+        const struct xml_attr *attr;
 
         assert(elm);
         assert(buff);
 
         len = 0;
  
-        assert(size > descent);
-        if (size < descent)
+        assert(size > (size_t)descent);
+        if (size < (size_t)descent)
                 return 0;
 
         len += descent;
         while (descent--)
                 buff[descent] = L'\t';
         if (elm->type == XML_ROOT)
-                len += swprintf(buff + len, L"<?%s", elm->name);
+                len += put_lit(buff + len, L"<?");
         else if (elm->type == XML_COMMENT)
-                len += swprintf(buff + len, L"<!--%s", elm->name);
+                len += put_lit(buff + len, L"<!--");
         else if (elm->type == XML_ELEMENT || elm->type == XML_ELEMENT_SELF)
-                len += swprintf(buff + len, L"<%s", elm->name);
+                len += put_lit(buff + len, L"<");
         else
                 assert(!"unknow xml element type");
 
-        for (i = 0; i < array_size(elm->attr); i++) {
-                len += swprintf(buff + len, L"\t%s=\"%s\"\r\n",
-                                array_at(elm->attr, i, struct xml_attr).name,
-                                array_at(elm->attr, i, struct xml_attr).value
-                        );
+        len += put_str(buff + len, elm->name, elm->name_len);
+
+        for (i = 0; i < array_size(&elm->attr); i++) {
+                attr = &array_at(&elm->attr, i, struct xml_attr);
+                len += put_lit(buff + len, L"\t");
+                len += put_str(buff + len, attr->name, attr->name_len);
+                len += put_lit(buff + len, L"=\"");
+                len += put_str(buff + len, attr->value, attr->value_len);
+                len += put_lit(buff + len, L"\"\r\n");
         }
         
         if (elm->type == XML_ELEMENT_SELF) {
                 assert(elm->value == NULL);
-                len += swprintf(buff + len, L"/>");
+                len += put_lit(buff + len, L"/>");
         } else if (elm->value && elm->type == XML_ELEMENT) {
-                len += swprintf(buff + len, L">%s", elm->value);
+                len += put_lit(buff + len, L">");
+                len += put_str(buff + len, elm->value, elm->value_len);
         } else if (elm->child && elm->type == XML_ELEMENT) {
-                len += swprintf(buff + len, L">\r\n");
+                len += put_lit(buff + len, L">\r\n");
         } else if (elm->type == XML_ELEMENT) {
-                len += swprintf(buff + len, L">");
+                len += put_lit(buff + len, L">");
         } else if (elm->type == XML_COMMENT) {
-                len += swprintf(buff + len, L"-->\r\n");
+                len += put_lit(buff + len, L"-->\r\n");
         } else if (elm->type == XML_ROOT) {
-                len += swprintf(buff + len, L"?>\r\n");
+                len += put_lit(buff + len, L"?>\r\n");
         } else {
                 assert(!"oh, i forget this condition");
         }
         return len;
 }
 
-static int format_end(const struct xml_element *elm, wchar_t *buff, int size, int descent)
+//a comment is already closed by format_name
+static size_t format_end(const struct xml_element *elm, wchar_t *buff, size_t size, int descent)
 {
-        int len;
+        size_t len;
         assert(elm);
         assert(buff);
  
-        assert(size >= descent);
-        if (size < descent)
+        assert(size >= (size_t)descent);
+        if (size < (size_t)descent)
                 return 0;
 
         len = 0;
@@ -982,18 +5444,20 @@ static int format_end(const struct xml_element *elm, wchar_t *buff, int size, in
                         buff[descent] = L'\t';
         }
 
-        if (elm->type == XML_ELEMENT)
-                len += swprintf(buff + len, L"</%s>\r\n", elm->name);
-        else if (elm->type == XML_COMMENT)
-                len += swprintf(buff + len, L"-->");
+        if (elm->type == XML_ELEMENT) {
+                len += put_lit(buff + len, L"</");
+                len += put_str(buff + len, elm->name, elm->name_len);
+                len += put_lit(buff + len, L">\r\n");
+        }
 
         return len;
 }
 
-static int cacl_name(const struct xml_element *elm, int descent)
+static size_t cacl_name(const struct xml_element *elm, int descent)
 {
-        int i;
-        int len;
+        size_t i;
+        size_t len;
+        const struct xml_attr *attr;
 
         assert(elm);
 
@@ -1001,22 +5465,22 @@ static int cacl_name(const struct xml_element *elm, int descent)
  
         len += descent;
         if (elm->type == XML_ROOT) {
-                len += 2;       //swprintf(buff + len, L"<?%s", elm->name);
-                len += wcslen(elm->name);
+                len += 2;       //L"<?%s"
         } else if (elm->type == XML_COMMENT) {
-                len += 4;
-                len += wcslen(elm->name);       //L"<!--%s", elm->name);
+                len += 4;       //L"<!--%s"
         } else if (elm->type == XML_ELEMENT || elm->type == XML_ELEMENT_SELF) {
-                len += 1; //L"<%s"
-                len += wcslen(elm->name);
+                len += 1;       //L"<%s"
         } else {
                 assert(!"unknow xml element type");
         }
 
-        for (i = 0; i < array_size(elm->attr); i++) {
+        len += elm->name_len;
+
+        for (i = 0; i < array_size(&elm->attr); i++) {
+                attr = &array_at(&elm->attr, i, struct xml_attr);
                 len += 6;       //L"\t%s=\"%s\"\r\n"
-                len += wcslen(array_at(elm->attr, i, struct xml_attr).name);
-                len += wcslen(array_at(elm->attr, i, struct xml_attr).value);
+                len += attr->name_len;
+                len += attr->value_len;
         }
         
         if (elm->type == XML_ELEMENT_SELF) {
@@ -1024,18 +5488,15 @@ static int cacl_name(const struct xml_element *elm, int descent)
                 len += 2;       //L"/>"
         } else if (elm->value && elm->type == XML_ELEMENT) {
                 len += 1;       //L">%s
-                len += wcslen(elm->value);
+                len += elm->value_len;
         } else if (elm->child && elm->type == XML_ELEMENT) {
                 len += 3;       //L">\r\n"
         } else if (elm->type == XML_ELEMENT) {
-                len += 1;
-                //len += swprintf(buff + len, L">");
+                len += 1;       //L">"
         } else if (elm->type == XML_COMMENT) {
-                len += 5;
-                //len += swprintf(buff + len, L"-->\r\n");
+                len += 5;       //L"-->\r\n"
         } else if (elm->type == XML_ROOT) {
-                len += 4;
-                //len += swprintf(buff + len, L"?>\r\n");
+                len += 4;       //L"?>\r\n"
         } else {
                 assert(!"oh, i forget this condition");
         }
@@ -1043,9 +5504,9 @@ static int cacl_name(const struct xml_element *elm, int descent)
         return len;
 }
 
-static int cacl_end(const struct xml_element *elm, int descent)
+static size_t cacl_end(const struct xml_element *elm, int descent)
 {
-        int len;
+        size_t len;
         assert(elm);
 
         len = 0;
@@ -1059,93 +5520,214 @@ static int cacl_end(const struct xml_element *elm, int descent)
 
         if (elm->type == XML_ELEMENT) {
                 len += 5;       //L"</%s>\r\n",
-                len += wcslen(elm->name);
-        } else if (elm->type == XML_COMMENT) {
-                len += 3;       //L"-->"
+                len += elm->name_len;
         }
 
         return len;
 }
 
-static int format_tree(const struct xml_element *tree, wchar_t *buff, unsigned long cnt, int descent)
+/* how a node is written out while the source it was parsed from is at hand */
+enum xml_emit {
+	XML_EMIT_FORMAT,	//generated from the node
+	XML_EMIT_COPY,		//the source as it is
+	XML_EMIT_VALUE,		//the source tags around the new value
+	XML_EMIT_PATCH,		//the source between the children, each child on its own
+};
+
+static int emit_mode(const struct xml_element *elm, const wchar_t *src)
 {
-        int size;
-        const struct xml_element *tmp;
+        const struct xml_element *child;
 
-        assert(tree);
-        assert(buff);
- 
-	if (tree == NULL)
-		return 0;
+        if (src == NULL || node_dirty(elm) & (XML_DIRTY_NEW | XML_DIRTY_SELF))
+                return XML_EMIT_FORMAT;
 
-        size = 0;
+        if (node_dirty(elm) == 0)
+                return XML_EMIT_COPY;
 
-        while (tree) {
-                tmp = tree;
-                size += format_name(tmp, buff + size, cnt - size, descent);
+        //'<a k="v"/>' is parsed as XML_ELEMENT too
+        if (node_dirty(elm) == XML_DIRTY_VALUE) {
+                if (elm->type == XML_ELEMENT && elm->child == NULL && src[elm->side->src_end - 2] != L'/')
+                        return XML_EMIT_VALUE;
+                return XML_EMIT_FORMAT;
+        }
 
-                descent += 1;
+        if (node_dirty(elm) & XML_DIRTY_VALUE)
+                return XML_EMIT_FORMAT;
 
-		if (tmp->child)
-			size += format_tree(tmp->child, buff + size, cnt - size, descent);
+        for (child = elm->child; child; child = child->next) {
+                if ((node_dirty(child) & XML_DIRTY_NEW) == 0)
+                        return XML_EMIT_PATCH;
+        }
 
-                tree = tree->next;
+        return XML_EMIT_FORMAT;
+}
 
-                descent -= 1;
-                assert(descent >= 0);
+//'buff' is NULL when only the size is wanted
+static size_t put_src(wchar_t *buff, const wchar_t *src, size_t begin, size_t end)
+{
+        if (buff)
+                wmemcpy(buff, src + begin, end - begin);
 
-		size += format_end(tmp, buff + size, cnt - size, descent);
-	}
+        return end - begin;
+}
 
-        return size;
+static size_t put_indent(wchar_t *buff, int descent)
+{
+        int i;
+
+        if (buff) {
+                for (i = 0; i < descent; i++)
+                        buff[i] = L'\t';
+        }
+
+        return descent;
+}
+
+//the first and the last child still at its place in the source
+static const struct xml_element *src_child(const struct xml_element *elm, int last)
+{
+        const struct xml_element *child;
+        const struct xml_element *found;
+
+        found = NULL;
+        for (child = elm->child; child; child = child->next) {
+                if ((node_dirty(child) & XML_DIRTY_NEW) == 0) {
+                        found = child;
+                        if (last == 0)
+                                break;
+                }
+        }
+
+        return found;
 }
 
-static int cacl_tree(const struct xml_element *tree, int descent)
+//the nearest brother before 'elm' still at its place in the source
+static const struct xml_element *src_prev(const struct xml_element *elm)
 {
-        int size;
-        const struct xml_element *tmp;
+        for (elm = elm->prev; elm; elm = elm->prev) {
+                if ((node_dirty(elm) & XML_DIRTY_NEW) == 0)
+                        return elm;
+        }
 
-        assert(tree);
-	if (tree == NULL)
-		return 0;
+        return NULL;
+}
+
+/* what one step of a walk put out, 'buff' is NULL when only the size is wanted.
+ * the nodes of a patched parent sit between the source around them,
+ * elsewhere what is copied is put on a line of its own.
+ */
+static size_t save_event(struct xml_iter *it, int depth, const wchar_t *src, wchar_t *buff, size_t cnt)
+{
+        size_t size;
+        int mode;
+        int patched;
+        const wchar_t *gt;
+        const struct xml_element *elm;
+        const struct xml_element *near;
 
         size = 0;
+        elm = it->node;
+        mode = emit_mode(elm, src);
+        patched = depth > 0 && emit_mode(elm->parent, src) == XML_EMIT_PATCH;
+
+        if (it->event == XML_WALK_LEAVE) {
+                if (mode == XML_EMIT_FORMAT) {
+                        size += buff ? format_end(elm, buff + size, cnt - size, depth) : cacl_end(elm, depth);
+                } else if (mode == XML_EMIT_PATCH) {
+                        near = src_child(elm, 1);
+                        size += put_src(buff ? buff + size : NULL, src, near->side->src_end, elm->side->src_end);
+                }
+
+                if (mode != XML_EMIT_FORMAT && patched == 0 && elm->type != XML_ROOT)
+                        size += put_src(buff ? buff + size : NULL, L"\r\n", 0, 2);
+
+                return size;
+        }
+
+        if (patched && (node_dirty(elm) & XML_DIRTY_NEW) == 0) {
+                near = src_prev(elm);
+                size += put_src(buff ? buff + size : NULL, src, near ? near->side->src_end : elm->side->src_begin, elm->side->src_begin);
+        }
 
-        while (tree) {
-                tmp = tree;
-                size += cacl_name(tmp, descent);
+        if (mode != XML_EMIT_FORMAT && patched == 0)
+                size += put_indent(buff ? buff + size : NULL, depth);
 
-                descent += 1;
+        switch (mode) {
+        case XML_EMIT_COPY:
+                size += put_src(buff ? buff + size : NULL, src, elm->side->src_begin, elm->side->src_end);
+                xml_iter_skip(it);
+                break;
+        case XML_EMIT_VALUE:
+                gt = wmemchr(src + elm->side->src_begin, L'>', elm->side->src_end - elm->side->src_begin);
+                assert(gt);
+                size += put_src(buff ? buff + size : NULL, src, elm->side->src_begin, (size_t)(gt + 1 - src));
+                size += put_src(buff ? buff + size : NULL, elm->value, 0, elm->value_len);
+                size += put_src(buff ? buff + size : NULL, src, elm->side->src_end - elm->name_len - 3, elm->side->src_end);
+                xml_iter_skip(it);
+                break;
+        case XML_EMIT_PATCH:
+                near = src_child(elm, 0);
+                size += put_src(buff ? buff + size : NULL, src, elm->side->src_begin, near->side->src_begin);
+                break;
+        default:
+                size += buff ? format_name(elm, buff + size, cnt - size, depth) : cacl_name(elm, depth);
+                break;
+        }
 
-		if (tmp->child)
-			size += cacl_tree(tmp->child, descent);
+        assert(buff == NULL || size <= cnt);
 
-                tree = tree->next;
+        return size;
+}
 
-                descent -= 1;
-                assert(descent >= 0);
+//'tree' and its brothers when 'brothers', every depth is 'base' deeper than in the walk
+static size_t save_tree(const struct xml_element *tree, int brothers, int base, const wchar_t *src, wchar_t *buff, size_t cnt)
+{
+        size_t size;
+        struct xml_iter it;
 
-		size += cacl_end(tmp, descent);
-	}
+        size = 0;
+        iter_init(&it, tree, brothers);
+        while (iter_next(&it))
+                size += save_event(&it, base + it.depth, src, buff ? buff + size : NULL, cnt - size);
 
         return size;
 }
 
-int xml_need_len(const struct xml_element *tree)
+//NULL when the tree was not read from a file as a whole
+static const wchar_t *tree_source(const struct xml_element *tree)
+{
+        const wchar_t *src;
+
+        while (tree->parent)
+                tree = tree->parent;
+        while (tree->prev)
+                tree = tree->prev;
+
+        if (node_meta(tree) == NULL || node_meta(tree)->src == NULL)
+                return NULL;
+
+        src = node_meta(tree)->src;
+        if (*src == 0xfeff)
+                src++;
+
+        return src;
+}
+
+size_t xml_need_len(const struct xml_element *tree)
 {
-        int size;
+        size_t size;
         assert(tree);
 	if (tree == NULL)
 		return 0;
 
-        size = cacl_tree(tree, 0);
+        size = save_tree(tree, 1, 0, tree_source(tree), NULL, 0);
 
         return size + 1;
 }
 
-int xml_save_data(const struct xml_element *tree, wchar_t *buff, unsigned long cnt)
+ptrdiff_t xml_save_data(const struct xml_element *tree, wchar_t *buff, size_t cnt)
 {
-        int size;
+        size_t size;
  
         assert(tree);
         assert(buff);
@@ -1157,8 +5739,199 @@ int xml_save_data(const struct xml_element *tree, wchar_t *buff, unsigned long c
         buff++;
         cnt--;
 
-        size = format_tree(tree, buff, cnt, 0);
+        size = save_tree(tree, 1, 0, tree_source(tree), buff, cnt);
+        if (size < cnt)
+                buff[size] = 0;
 
-        return size + 1;
+        return (ptrdiff_t)(size + 1);
+}
+
+/* a tree is cut into the children of one node, they are sized then written side by side */
+struct xml_save_batch {
+	const wchar_t			*src;
+	const struct xml_element	**piece;
+	size_t				*off;
+	int				piece_cnt;
+	int				depth;
+	wchar_t				*buff;
+	std::atomic<int>		next;
+};
+
+static void save_worker(struct xml_save_batch *batch, int write)
+{
+	int i;
+
+	while ((i = batch->next.fetch_add(1)) < batch->piece_cnt) {
+		if (write)
+			save_tree(batch->piece[i], 0, batch->depth, batch->src, batch->buff + batch->off[i], batch->off[i + 1] - batch->off[i]);
+		else
+			batch->off[i + 1] = save_tree(batch->piece[i], 0, batch->depth, batch->src, NULL, 0);
+	}
+}
+
+//the pieces are taken one by one, so what a thread that can't start leave is done here
+static void save_run(struct xml_save_batch *batch, int thread_cnt, int write)
+{
+	int i;
+	int n;
+	std::thread *thread;
+
+	batch->next.store(0);
+
+	n = 0;
+	thread = new (std::nothrow) std::thread[thread_cnt - 1];
+	for (i = 1; thread && i < thread_cnt; i++, n++) {
+		try {
+			thread[i - 1] = std::thread(save_worker, batch, write);
+		} catch (const std::system_error &) {
+			break;
+		}
+	}
+
+	save_worker(batch, write);
+
+	for (i = 0; i < n; i++)
+		thread[i].join();
+
+	delete[] thread;
+}
+
+//the node with the most children, going down until there are 'want' of them, NULL for the top level
+static const struct xml_element *save_split(const struct xml_element *tree, const wchar_t *src, int want, int *depth)
+{
+	int n;
+	int c;
+	int most;
+	int mode;
+	int level;
+	const struct xml_element *elm;
+	const struct xml_element *child;
+	const struct xml_element *best;
+	const struct xml_element *split;
+
+	split = NULL;
+	*depth = 0;
+	for (level = 0; level < 8; level++) {
+		n = 0;
+		most = 0;
+		best = NULL;
+		for (elm = tree; elm; elm = elm->next) {
+			n++;
+			mode = emit_mode(elm, src);
+			if (mode != XML_EMIT_FORMAT && mode != XML_EMIT_PATCH)
+				continue;
+
+			for (child = elm->child, c = 0; child; child = child->next)
+				c++;
+
+			if (c > most) {
+				most = c;
+				best = elm;
+			}
+		}
+
+		if (n >= want || best == NULL)
+			break;
+
+		split = best;
+		tree = best->child;
+		*depth = level + 1;
+	}
+
+	return split;
+}
+
+//the walk of the whole tree with the children of 'split' left out, 'gap' is kept for them after 'head'
+static size_t save_around(const struct xml_element *tree, const struct xml_element *split, const wchar_t *src, wchar_t *buff, size_t cnt, size_t gap, size_t *head)
+{
+	size_t size;
+	struct xml_iter it;
+
+	size = 0;
+	*head = 0;
+	if (split == NULL)
+		return gap;
+
+	iter_init(&it, tree, 1);
+	while (iter_next(&it)) {
+		size += save_event(&it, it.depth, src, buff ? buff + size : NULL, cnt - size);
+		if (it.node == split && it.event == XML_WALK_ENTER) {
+			*head = size;
+			size += gap;
+			xml_iter_skip(&it);
+		}
+	}
+
+	return size;
 }
 
+/* what xml_save_data write, 'thread_cnt' <= 0 for one thread per core */
+ptrdiff_t xml_save_data_mt(const struct xml_element *tree, wchar_t *buff, size_t cnt, int thread_cnt)
+{
+	int i;
+	size_t size;
+	size_t head;
+	const struct xml_element *elm;
+	const struct xml_element *split;
+	struct xml_save_batch batch;
+
+	assert(tree);
+	assert(buff);
+	if (cnt < 2)
+		return -1;
+
+	if (thread_cnt <= 0)
+		thread_cnt = std::thread::hardware_concurrency();
+
+	batch.src = tree_source(tree);
+	split = save_split(tree, batch.src, thread_cnt * 4, &batch.depth);
+
+	batch.piece_cnt = 0;
+	for (elm = split ? split->child : tree; elm; elm = elm->next)
+		batch.piece_cnt++;
+
+	if (thread_cnt > batch.piece_cnt)
+		thread_cnt = batch.piece_cnt;
+	if (thread_cnt <= 1)
+		return xml_save_data(tree, buff, cnt);
+
+	batch.piece = new (std::nothrow) const struct xml_element *[batch.piece_cnt];
+	batch.off = new (std::nothrow) size_t[batch.piece_cnt + 1];
+	if (batch.piece == NULL || batch.off == NULL) {
+		delete[] batch.piece;
+		delete[] batch.off;
+		return xml_save_data(tree, buff, cnt);
+	}
+
+	for (i = 0, elm = split ? split->child : tree; elm; elm = elm->next)
+		batch.piece[i++] = elm;
+
+	save_run(&batch, thread_cnt, 0);
+
+	batch.off[0] = 0;
+	for (i = 0; i < batch.piece_cnt; i++)
+		batch.off[i + 1] += batch.off[i];
+
+	size = save_around(tree, split, batch.src, NULL, 0, batch.off[batch.piece_cnt], &head);
+	if (size >= cnt) {
+		delete[] batch.piece;
+		delete[] batch.off;
+		return -1;
+	}
+
+	//unicode
+	buff[0] = 0xfeff;
+	buff++;
+	cnt--;
+
+	batch.buff = buff + head;
+	save_run(&batch, thread_cnt, 1);
+	save_around(tree, split, batch.src, buff, size, batch.off[batch.piece_cnt], &head);
+	if (size < cnt)
+		buff[size] = 0;
+
+	delete[] batch.piece;
+	delete[] batch.off;
+
+	return (ptrdiff_t)(size + 1);
+}
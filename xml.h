@@ -1,6 +1,8 @@
 #ifndef _XML_H
 #define	_XML_H
 
+#include <stddef.h>
+
 enum xml_type {
         XML_ROOT,
         XML_COMMENT,
@@ -8,26 +10,94 @@ enum xml_type {
         XML_ELEMENT_SELF,
 };
 
+enum xml_conv {
+        XML_CONV_OK = 0,
+        XML_CONV_FORMAT = -1,
+        XML_CONV_RANGE = -2,
+        XML_CONV_MISSING = -3,
+};
+
+enum xml_walk {
+        XML_WALK_ENTER,
+        XML_WALK_LEAVE,
+};
+
+enum xml_track {
+        XML_TRACK_RANGE = 1,
+        XML_TRACK_SOURCE = 2,
+};
+
 struct xml_element;
+struct xml_builder;
+struct xml_reader;
+
+typedef void (xml_diff_cb)(void *ud, const struct xml_element *a, const struct xml_element *b);
+
+struct xml_iter {
+        struct xml_element      *node;
+        int                     event;
+        int                     depth;
+        struct xml_element      *next;
+        struct xml_element      *up;
+        int                     brothers;
+        int                     skip;
+};
 
 struct xml_element *xml_load_file(const wchar_t *path);
+struct xml_element *xml_load_file_filter(const wchar_t *path, const wchar_t **filter, int filter_cnt);
+struct xml_element *xml_load_file_pipe(const wchar_t *path, int block_size, int block_cnt);
+struct xml_element *xml_load_file_track(const wchar_t *path, int track);
+struct xml_element *xml_load_file_index(const wchar_t *path, int thread_cnt);
+struct xml_element *xml_reload_file(struct xml_element *tree, const wchar_t *path);
+int xml_load_many(const wchar_t **path, int cnt, struct xml_element **tree, int thread_cnt);
+
+struct xml_reader *xml_reader_open(const wchar_t *path, int depth);
+struct xml_element *xml_reader_next(struct xml_reader *r);
+int xml_reader_close(struct xml_reader *r);
 
 struct xml_element *xml_new(const wchar_t *name, const wchar_t *value, enum xml_type type);
+struct xml_element *xml_new_len(const wchar_t *name, size_t name_len, const wchar_t *value, size_t value_len, enum xml_type type);
 int xml_free_child(struct xml_element *tree);
 int xml_free(struct xml_element *tree);
+int xml_free_all(struct xml_element *tree);
+size_t xml_mem_size(const struct xml_element *tree);
 
 enum xml_type xml_get_type(const struct xml_element *node);
 const wchar_t *xml_get_attr(const struct xml_element *node, const wchar_t *attr_name);
 const wchar_t *xml_get_name(const struct xml_element *node);
 const wchar_t *xml_get_value(const struct xml_element *node);
+size_t xml_get_name_len(const struct xml_element *node);
+size_t xml_get_value_len(const struct xml_element *node);
+
+int xml_get_attr_cnt(const struct xml_element *node);
+const wchar_t *xml_get_attr_name(const struct xml_element *node, int i);
+const wchar_t *xml_get_attr_value(const struct xml_element *node, int i);
+size_t xml_get_attr_name_len(const struct xml_element *node, int i);
+size_t xml_get_attr_value_len(const struct xml_element *node, int i);
+
+int xml_get_attr_i64(const struct xml_element *node, const wchar_t *attr_name, long long *v, int cache);
+int xml_get_attr_u64(const struct xml_element *node, const wchar_t *attr_name, unsigned long long *v, int cache);
+int xml_get_attr_double(const struct xml_element *node, const wchar_t *attr_name, double *v, int cache);
+int xml_get_attr_bool(const struct xml_element *node, const wchar_t *attr_name, int *v, int cache);
+int xml_get_attr_enum(const struct xml_element *node, const wchar_t *attr_name, const wchar_t **table, int cnt, int *v);
+int xml_get_value_i64(const struct xml_element *node, long long *v);
+int xml_get_value_u64(const struct xml_element *node, unsigned long long *v);
+int xml_get_value_double(const struct xml_element *node, double *v);
+int xml_get_value_bool(const struct xml_element *node, int *v);
+int xml_get_value_enum(const struct xml_element *node, const wchar_t **table, int cnt, int *v);
 
 wchar_t *xml_set_value(struct xml_element *node, const wchar_t *value);
+wchar_t *xml_set_value_len(struct xml_element *node, const wchar_t *value, size_t len);
 
 struct xml_element *xml_walkdown(const struct xml_element *node);
 struct xml_element *xml_walkup(const struct xml_element *node);
 struct xml_element *xml_walknext(const struct xml_element *node);
 struct xml_element *xml_walkprev(const struct xml_element *node);
 
+void xml_iter_init(struct xml_iter *it, const struct xml_element *tree, int brothers);
+int xml_iter_next(struct xml_iter *it);
+void xml_iter_skip(struct xml_iter *it);
+
 struct xml_element *xml_search_child(const struct xml_element *parent, const wchar_t *name);
 struct xml_element *xml_search_brother(const struct xml_element *brother, const wchar_t *name);
 
@@ -35,9 +105,26 @@ struct xml_element *xml_search_brother(const struct xml_element *brother, const
 struct xml_element *xml_append_child(struct xml_element *parent, struct xml_element *child);
 struct xml_element *xml_append_brother(struct xml_element *b1, struct xml_element *b2);
 
+struct xml_builder *xml_builder_new(void);
+int xml_builder_open(struct xml_builder *b, const wchar_t *name, ptrdiff_t len, enum xml_type type);
+int xml_builder_attr(struct xml_builder *b, const wchar_t *name, ptrdiff_t name_len, const wchar_t *value, ptrdiff_t value_len);
+int xml_builder_text(struct xml_builder *b, const wchar_t *text, ptrdiff_t len);
+int xml_builder_comment(struct xml_builder *b, const wchar_t *text, ptrdiff_t len);
+int xml_builder_close(struct xml_builder *b);
+struct xml_element *xml_builder_end(struct xml_builder *b);
+
+struct xml_element *xml_compact(struct xml_element *tree);
+size_t xml_compact_size(const struct xml_element *tree);
+struct xml_element *xml_compact_to(const struct xml_element *tree, void *buff, size_t size);
+struct xml_element *xml_compact_move(void *buff, const void *from, const struct xml_element *tree);
+
+unsigned long long xml_hash(const struct xml_element *tree);
+int xml_equal(const struct xml_element *a, const struct xml_element *b);
+int xml_diff(const struct xml_element *a, const struct xml_element *b, xml_diff_cb *cb, void *ud);
 
-int xml_need_len(const struct xml_element *tree);
-int xml_save_data(const struct xml_element *tree, wchar_t *buff, unsigned long cnt);
+size_t xml_need_len(const struct xml_element *tree);
+ptrdiff_t xml_save_data(const struct xml_element *tree, wchar_t *buff, size_t cnt);
+ptrdiff_t xml_save_data_mt(const struct xml_element *tree, wchar_t *buff, size_t cnt, int thread_cnt);
 
 #endif // !_XML_H
 
@@ -0,0 +1,290 @@
+#ifndef _XML_HPP
+#define	_XML_HPP
+
+#include <stddef.h>
+#include <wchar.h>
+#include <string>
+#include <string_view>
+#include "xml.h"
+
+/* C++ view of xml.h, a document own its tree and a node is a plain handle into it:
+ *
+ *	xml::document doc = xml::document::load(L"a.xml");
+ *	for (xml::node n : doc.root().children())
+ *		for (xml::attr a : n.attrs())
+ *			use(n.name(), a.name(), a.value());
+ *
+ * nothing throw, a failed call give an empty document or node. an empty node answer every call
+ * with an empty value, its type() is XML_ELEMENT.
+ */
+
+namespace xml {
+
+typedef std::wstring_view string_view;
+
+class document;
+
+static inline string_view make_view(const wchar_t *s, size_t len)
+{
+	return s ? string_view(s, len) : string_view();
+}
+
+class attr {
+public:
+	attr(const struct xml_element *elm, int i) : elm(elm), i(i) {}
+
+	string_view name() const { return make_view(xml_get_attr_name(elm, i), xml_get_attr_name_len(elm, i)); }
+	string_view value() const { return make_view(xml_get_attr_value(elm, i), xml_get_attr_value_len(elm, i)); }
+
+private:
+	const struct xml_element *elm;
+	int i;
+};
+
+class attr_iterator {
+public:
+	attr_iterator(const struct xml_element *elm, int i) : elm(elm), i(i) {}
+
+	attr operator*() const { return attr(elm, i); }
+	attr_iterator &operator++() { i++; return *this; }
+	bool operator==(const attr_iterator &o) const { return i == o.i; }
+	bool operator!=(const attr_iterator &o) const { return i != o.i; }
+
+private:
+	const struct xml_element *elm;
+	int i;
+};
+
+class attr_range {
+public:
+	explicit attr_range(const struct xml_element *elm) : elm(elm), cnt(elm ? xml_get_attr_cnt(elm) : 0) {}
+
+	attr_iterator begin() const { return attr_iterator(elm, 0); }
+	attr_iterator end() const { return attr_iterator(elm, cnt); }
+	int size() const { return cnt; }
+
+private:
+	const struct xml_element *elm;
+	int cnt;
+};
+
+class node_range;
+
+class node {
+public:
+	node() : elm(NULL) {}
+	explicit node(struct xml_element *elm) : elm(elm) {}
+
+	explicit operator bool() const { return elm != NULL; }
+	bool operator==(const node &o) const { return elm == o.elm; }
+	bool operator!=(const node &o) const { return elm != o.elm; }
+	struct xml_element *get() const { return elm; }
+
+	enum xml_type type() const { return elm ? xml_get_type(elm) : XML_ELEMENT; }
+	string_view name() const { return elm ? make_view(xml_get_name(elm), xml_get_name_len(elm)) : string_view(); }
+	string_view value() const { return elm ? make_view(xml_get_value(elm), xml_get_value_len(elm)) : string_view(); }
+
+	//data() is NULL when the attribute is missing
+	string_view attr(const wchar_t *name) const
+	{
+		int i;
+		int cnt;
+		size_t len;
+
+		if (elm == NULL || name == NULL)
+			return string_view();
+
+		len = wcslen(name);
+		cnt = xml_get_attr_cnt(elm);
+		for (i = 0; i < cnt; i++) {
+			if (xml_get_attr_name_len(elm, i) == len && wmemcmp(xml_get_attr_name(elm, i), name, len) == 0)
+				return make_view(xml_get_attr_value(elm, i), xml_get_attr_value_len(elm, i));
+		}
+
+		return string_view();
+	}
+
+	attr_range attrs() const { return attr_range(elm); }
+
+	node parent() const { return elm ? node(xml_walkup(elm)) : node(); }
+	node child() const { return elm ? node(xml_walkdown(elm)) : node(); }
+	node child(const wchar_t *name) const { return elm ? node(xml_search_child(elm, name)) : node(); }
+	node next() const { return elm ? node(xml_walknext(elm)) : node(); }
+	inline node_range children() const;
+
+	bool set_value(const wchar_t *value) { return elm && xml_set_value(elm, value) != NULL; }
+
+	/* take the tree out of 'sub', it belong to this document from now on */
+	inline node append_child(document &&sub);
+	inline node append_brother(document &&sub);
+	inline node append_child(const wchar_t *name, const wchar_t *value = NULL, enum xml_type type = XML_ELEMENT);
+
+private:
+	struct xml_element *elm;
+};
+
+class node_iterator {
+public:
+	explicit node_iterator(struct xml_element *elm) : elm(elm) {}
+
+	node operator*() const { return node(elm); }
+	node_iterator &operator++() { elm = xml_walknext(elm); return *this; }
+	bool operator==(const node_iterator &o) const { return elm == o.elm; }
+	bool operator!=(const node_iterator &o) const { return elm != o.elm; }
+
+private:
+	struct xml_element *elm;
+};
+
+class node_range {
+public:
+	explicit node_range(struct xml_element *first) : first(first) {}
+
+	node_iterator begin() const { return node_iterator(first); }
+	node_iterator end() const { return node_iterator(NULL); }
+
+private:
+	struct xml_element *first;
+};
+
+class document {
+public:
+	document() noexcept : tree(NULL) {}
+	explicit document(struct xml_element *tree) noexcept : tree(tree) {}
+	document(document &&o) noexcept : tree(o.release()) {}
+	~document() { reset(); }
+
+	document &operator=(document &&o) noexcept
+	{
+		if (this != &o)
+			reset(o.release());
+
+		return *this;
+	}
+
+	document(const document &) = delete;
+	document &operator=(const document &) = delete;
+
+	static document load(const wchar_t *path) { return document(xml_load_file(path)); }
+
+	//'track' is of xml_track, reload() patch such a tree instead of parsing it again
+	static document load(const wchar_t *path, int track) { return document(xml_load_file_track(path, track)); }
+
+	static document load(const wchar_t *path, const wchar_t **filter, int filter_cnt)
+	{
+		return document(xml_load_file_filter(path, filter, filter_cnt));
+	}
+
+	static document create(const wchar_t *name, const wchar_t *value = NULL, enum xml_type type = XML_ELEMENT)
+	{
+		return document(xml_new(name, value, type));
+	}
+
+	//the old tree is kept when it fail
+	int reload(const wchar_t *path)
+	{
+		struct xml_element *fresh;
+
+		if (tree == NULL)
+			return -1;
+
+		fresh = xml_reload_file(tree, path);
+		if (fresh == NULL)
+			return -1;
+
+		tree = fresh;
+
+		return 0;
+	}
+
+	//the nodes handed out before are gone when it succeed
+	int compact()
+	{
+		struct xml_element *fresh;
+
+		if (tree == NULL)
+			return -1;
+
+		fresh = xml_compact(tree);
+		if (fresh == NULL)
+			return -1;
+
+		tree = fresh;
+
+		return 0;
+	}
+
+	explicit operator bool() const { return tree != NULL; }
+	node root() const { return node(tree); }
+	struct xml_element *get() const { return tree; }
+
+	struct xml_element *release() noexcept
+	{
+		struct xml_element *t;
+
+		t = tree;
+		tree = NULL;
+
+		return t;
+	}
+
+	void reset(struct xml_element *t = NULL) noexcept
+	{
+		if (tree)
+			xml_free_all(tree);
+
+		tree = t;
+	}
+
+	//what xml_save_data write, the BOM included
+	std::wstring save() const
+	{
+		size_t need;
+		ptrdiff_t len;
+		std::wstring s;
+
+		if (tree == NULL)
+			return s;
+
+		need = xml_need_len(tree);
+		s.resize(need + 1);
+		len = xml_save_data(tree, &s[0], need + 1);
+		s.resize(len > 0 ? (size_t)len : 0);
+
+		return s;
+	}
+
+private:
+	struct xml_element *tree;
+};
+
+inline node_range node::children() const
+{
+	return node_range(elm ? xml_walkdown(elm) : NULL);
+}
+
+//'sub' is left as it was when it fail, an element with a value take no child
+inline node node::append_child(document &&sub)
+{
+	if (elm == NULL || !sub || xml_get_value(elm))
+		return node();
+
+	return node(xml_append_child(elm, sub.release()));
+}
+
+inline node node::append_brother(document &&sub)
+{
+	if (elm == NULL || !sub)
+		return node();
+
+	return node(xml_append_brother(elm, sub.release()));
+}
+
+inline node node::append_child(const wchar_t *name, const wchar_t *value, enum xml_type type)
+{
+	return append_child(document::create(name, value, type));
+}
+
+}
+
+#endif
@@ -0,0 +1,326 @@
+/* xml_bench: time the scanning kernels of xml_str.cpp and the operations of array.c on their own,
+ * so a change to one of them can be judged apart from the whole parse.
+ *
+ * the scans run over tokens whose lengths follow what is seen in documents, names are short,
+ * values a bit longer and text the longest, each token ended by one of the terminators the
+ * parser look for. the time is the best of a few rounds, in ns for each call and each char read.
+ * the array operations are timed for a few element sizes and counts, in ns for each operation.
+ *
+ * usage: xml_bench [name], only the benchmarks whose name contain 'name' are run
+ */
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+#include <chrono>
+#include "xml_str.h"
+#include "array.h"
+
+#define	BENCH_CHARS	(1024 * 1024)
+#define	BENCH_ROUND	5
+#define	BENCH_ERASE	1000
+//the arrays bigger than it are left out
+#define	BENCH_ARRAY_MAX	(64 * 1024 * 1024)
+
+enum bench_kernel {
+	BENCH_STRLEN,
+	BENCH_STRCPY,
+	BENCH_SKIP,
+	BENCH_FORWARD,
+	BENCH_COUNT,
+};
+
+//token lengths from 'min' to 'max', the short ones are the most
+struct bench_dist {
+	const char	*name;
+	int		min;
+	int		max;
+};
+
+struct bench_scan {
+	int				kernel;
+	const char			*name;
+	const struct bench_dist		*dist;
+	//'termi' end a token, for str_count the first one is counted up to the second
+	const wchar_t			*termi;
+	const char			*termi_name;
+};
+
+static const struct bench_dist dist_name = {"name", 2, 16};
+static const struct bench_dist dist_value = {"value", 1, 32};
+static const struct bench_dist dist_text = {"text", 8, 256};
+static const struct bench_dist dist_indent = {"indent", 1, 16};
+static const struct bench_dist dist_tag = {"tag", 0, 6};
+
+static const struct bench_scan scan_list[] = {
+	{BENCH_STRLEN,	"strlen_t",	&dist_name,	L">\r\n \t",	"'>' or space"},
+	{BENCH_STRLEN,	"strlen_t",	&dist_name,	L"=\r\n \t",	"'=' or space"},
+	{BENCH_STRLEN,	"strlen_t",	&dist_value,	L"\"",		"'\"'"},
+	{BENCH_STRLEN,	"strlen_t",	&dist_text,	L"<",		"'<'"},
+	{BENCH_STRLEN,	"strlen_t",	&dist_text,	L"-",		"'-'"},
+	{BENCH_STRCPY,	"strcpy_t",	&dist_name,	L">\r\n \t",	"'>' or space"},
+	{BENCH_STRCPY,	"strcpy_t",	&dist_name,	L"=\r\n \t",	"'=' or space"},
+	{BENCH_STRCPY,	"strcpy_t",	&dist_text,	L"-",		"'-'"},
+	{BENCH_SKIP,	"skip_space",	&dist_indent,	L"<",		"not space"},
+	{BENCH_FORWARD,	"str_forward",	&dist_value,	L"\"",		"'\"'"},
+	{BENCH_FORWARD,	"str_forward",	&dist_text,	L"<",		"'<'"},
+	{BENCH_COUNT,	"str_count",	&dist_tag,	L"\">",		"'\"' up to '>'"},
+};
+
+static const int array_size_list[] = {4, 16, 64, 256};
+static const size_t array_cnt_list[] = {1000, 100000, 1000000};
+
+static unsigned int rand_state = 2463534242u;
+static volatile size_t sink;
+
+static unsigned int bench_rand(void)
+{
+	rand_state ^= rand_state << 13;
+	rand_state ^= rand_state >> 17;
+	rand_state ^= rand_state << 5;
+
+	return rand_state;
+}
+
+static double bench_now(void)
+{
+	return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static int bench_len(const struct bench_dist *dist)
+{
+	int range;
+
+	range = dist->max - dist->min + 1;
+
+	//the product of two draws lean toward the short end
+	return dist->min + (int)((unsigned long long)(bench_rand() % range) * (bench_rand() % range) / range);
+}
+
+//a char of the token body, never one of 'termi'
+static wchar_t bench_char(const wchar_t *termi, int space)
+{
+	static const wchar_t pool[] = L"abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_.:-,;";
+	wchar_t ch;
+
+	do {
+		if (space && bench_rand() % 6 == 0)
+			ch = L' ';
+		else
+			ch = pool[bench_rand() % (sizeof(pool) / sizeof(pool[0]) - 1)];
+	} while (wcschr(termi, ch));
+
+	return ch;
+}
+
+/* up to 'size' chars of tokens each ended by one of the terminators, 'start' tell where
+ * they begin. a last terminator end the buffer so no scan run past it. return how many
+ * tokens there are
+ */
+static size_t bench_fill(const struct bench_scan *scan, wchar_t *buff, size_t size, size_t *start)
+{
+	int i;
+	int n;
+	size_t pos;
+	size_t cnt;
+
+	pos = 0;
+	cnt = 0;
+	for (;;) {
+		n = bench_len(scan->dist);
+		start[cnt] = pos;
+		if (scan->kernel == BENCH_COUNT) {
+			//'name="value" ' 'n' times, then the '>'
+			if (pos + n * 12 + 2 >= size)
+				break;
+
+			for (i = 0; i < n; i++)
+				pos += swprintf(buff + pos, size - pos, L" a%d=\"%d\"", i, (int)(bench_rand() % 1000));
+			buff[pos++] = L'>';
+		} else {
+			if (pos + n + 2 >= size)
+				break;
+
+			for (i = 0; i < n; i++) {
+				if (scan->kernel == BENCH_SKIP)
+					buff[pos++] = L"  \t\r\n"[bench_rand() % 5];
+				else
+					buff[pos++] = bench_char(scan->termi, scan->dist == &dist_text);
+			}
+
+			if (scan->kernel == BENCH_SKIP)
+				buff[pos++] = bench_char(L" \t\r\n", 0);
+			else
+				buff[pos++] = scan->termi[bench_rand() % wcslen(scan->termi)];
+		}
+
+		cnt++;
+	}
+
+	buff[pos] = scan->kernel == BENCH_SKIP ? L'x' : scan->termi[wcslen(scan->termi) - 1];
+	buff[pos + 1] = 0;
+
+	return cnt;
+}
+
+//one call for each token
+static void bench_pass(const struct bench_scan *scan, const wchar_t *buff, const wchar_t *end,
+	const size_t *start, size_t cnt, wchar_t *out)
+{
+	size_t i;
+	size_t sum;
+	const wchar_t *p;
+
+	sum = 0;
+	for (i = 0; i < cnt; i++) {
+		p = buff + start[i];
+		switch (scan->kernel) {
+		case BENCH_STRLEN:
+			sum += strlen_t(p, end, scan->termi);
+			break;
+		case BENCH_STRCPY:
+			sum += strcpy_t(out, p, scan->termi);
+			break;
+		case BENCH_SKIP:
+			sum += skip_space(p, end) - p;
+			break;
+		case BENCH_FORWARD:
+			sum += str_forward(p, end, scan->termi[0]) - p;
+			break;
+		default:
+			sum += str_count(p, end, scan->termi[0], scan->termi[1], scan->termi[1]);
+			break;
+		}
+	}
+
+	sink = sum;
+}
+
+static void bench_scan_run(const struct bench_scan *scan, wchar_t *buff, size_t *start, wchar_t *out)
+{
+	int r;
+	size_t cnt;
+	size_t chars;
+	double t;
+	double best;
+
+	rand_state = 2463534242u;
+	cnt = bench_fill(scan, buff, BENCH_CHARS, start);
+	chars = wcslen(buff);
+
+	best = 0;
+	for (r = 0; r < BENCH_ROUND; r++) {
+		t = bench_now();
+		bench_pass(scan, buff, buff + chars, start, cnt, out);
+		t = bench_now() - t;
+		if (r == 0 || t < best)
+			best = t;
+	}
+
+	printf("%-12s %-7s %-16s %9.1f %9.2f %9.3f\n", scan->name, scan->dist->name, scan->termi_name,
+		(double)chars / cnt - 1, best / cnt, best / chars);
+}
+
+static void bench_array_run(int em_size, size_t cnt)
+{
+	int r;
+	size_t i;
+	size_t n;
+	size_t *index;
+	double t;
+	double push;
+	double get;
+	double erase;
+	unsigned char em[256];
+	struct array *arr;
+
+	assert(em_size <= (int)sizeof(em));
+
+	index = (size_t *)malloc(cnt * sizeof(*index));
+	if (index == NULL)
+		return ;
+
+	memset(em, 0x5a, sizeof(em));
+	for (i = 0; i < cnt; i++)
+		index[i] = bench_rand() % cnt;
+
+	n = cnt < BENCH_ERASE ? cnt : BENCH_ERASE;
+	push = get = erase = 0;
+	for (r = 0; r < BENCH_ROUND; r++) {
+		arr = array_create(em_size);
+		if (arr == NULL)
+			break;
+
+		t = bench_now();
+		for (i = 0; i < cnt; i++)
+			array_push(arr, em);
+		t = bench_now() - t;
+		if (r == 0 || t < push)
+			push = t;
+
+		t = bench_now();
+		for (i = 0; i < cnt; i++)
+			array_get(arr, index[i], em);
+		t = bench_now() - t;
+		if (r == 0 || t < get)
+			get = t;
+
+		//each erase move the tail behind it
+		t = bench_now();
+		for (i = 0; i < n; i++)
+			array_erase(arr, index[i] % array_size(arr));
+		t = bench_now() - t;
+		if (r == 0 || t < erase)
+			erase = t;
+
+		array_release(arr);
+	}
+
+	free(index);
+
+	printf("%-12s %5d %9zu %9.2f %9.2f %9.1f\n", "array", em_size, cnt, push / cnt, get / cnt, erase / n);
+}
+
+int main(int argc, char *argv[])
+{
+	size_t i;
+	size_t j;
+	size_t *start;
+	wchar_t *buff;
+	wchar_t *out;
+	const char *filter;
+
+	filter = argc > 1 ? argv[1] : "";
+
+	buff = (wchar_t *)malloc((BENCH_CHARS + 1) * sizeof(wchar_t));
+	out = (wchar_t *)malloc((BENCH_CHARS + 1) * sizeof(wchar_t));
+	start = (size_t *)malloc(BENCH_CHARS * sizeof(size_t));
+	if (buff == NULL || out == NULL || start == NULL) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+
+	printf("%-12s %-7s %-16s %9s %9s %9s\n", "kernel", "input", "terminator", "avg len", "ns/call", "ns/char");
+	for (i = 0; i < sizeof(scan_list) / sizeof(scan_list[0]); i++) {
+		if (strstr(scan_list[i].name, filter))
+			bench_scan_run(&scan_list[i], buff, start, out);
+	}
+
+	free(buff);
+	free(out);
+	free(start);
+
+	if (strstr("array", filter) == NULL)
+		return 0;
+
+	printf("\n%-12s %5s %9s %9s %9s %9s\n", "", "size", "count", "push ns", "get ns", "erase ns");
+	for (i = 0; i < sizeof(array_size_list) / sizeof(array_size_list[0]); i++) {
+		for (j = 0; j < sizeof(array_cnt_list) / sizeof(array_cnt_list[0]); j++) {
+			if (array_size_list[i] * array_cnt_list[j] <= BENCH_ARRAY_MAX)
+				bench_array_run(array_size_list[i], array_cnt_list[j]);
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,271 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <wchar.h>
+#include <sys/stat.h>
+#include <mutex>
+#include <new>
+#include "xml.h"
+#include "xml_cache.h"
+
+/*
+ * a file is parsed once for everyone who ask for it, the tree is shared read only.
+ * an entry is found by its full path and is good while the file keep the same
+ * (dev, ino, mtime, size), the entries nobody hold go least recently used first
+ * once the trees take more than 'budget' bytes.
+ *
+ * the tree is hashed before it is handed out, so any thread may call on it what
+ * take a const tree in xml.h: the getters, the typed ones with 'cache' too, the
+ * walks and searches, xml_hash, xml_equal, xml_diff, xml_mem_size, xml_need_len
+ * and the saves. nothing that change it, nor xml_compact or xml_reload_file.
+ */
+
+struct xml_cache_entry {
+	struct xml_cache_entry	*prev;
+	struct xml_cache_entry	*next;
+	wchar_t			*path;
+	unsigned long long	dev;
+	unsigned long long	ino;
+	long long		mtime;
+	long long		size;
+	struct xml_element	*tree;
+	size_t			mem;
+	int			ref;
+	//the file changed, it is freed when the last holder put it back
+	int			stale;
+};
+
+struct xml_cache {
+	std::mutex		lock;
+	//the most recently used first
+	struct xml_cache_entry	*head;
+	struct xml_cache_entry	*tail;
+	size_t			budget;
+	size_t			mem;
+};
+
+static void entry_unlink(struct xml_cache *cache, struct xml_cache_entry *e)
+{
+	if (e->prev)
+		e->prev->next = e->next;
+	else
+		cache->head = e->next;
+
+	if (e->next)
+		e->next->prev = e->prev;
+	else
+		cache->tail = e->prev;
+
+	e->prev = NULL;
+	e->next = NULL;
+}
+
+static void entry_front(struct xml_cache *cache, struct xml_cache_entry *e)
+{
+	e->prev = NULL;
+	e->next = cache->head;
+	if (cache->head)
+		cache->head->prev = e;
+	else
+		cache->tail = e;
+
+	cache->head = e;
+}
+
+static void entry_free(struct xml_cache_entry *e)
+{
+	if (e->tree)
+		xml_free_all(e->tree);
+
+	free(e->path);
+	free(e);
+}
+
+static void entry_drop(struct xml_cache *cache, struct xml_cache_entry *e)
+{
+	entry_unlink(cache, e);
+	cache->mem -= e->mem;
+	entry_free(e);
+}
+
+static int entry_match(const struct xml_cache_entry *e, const struct _stat64 *st)
+{
+	return e->dev == (unsigned long long)st->st_dev && e->ino == (unsigned long long)st->st_ino &&
+		e->mtime == (long long)st->st_mtime && e->size == (long long)st->st_size;
+}
+
+//an entry still held is never dropped, so 'mem' may stay over the budget for a while
+static void cache_trim(struct xml_cache *cache)
+{
+	struct xml_cache_entry *e;
+	struct xml_cache_entry *prev;
+
+	for (e = cache->tail; e && cache->mem > cache->budget; e = prev) {
+		prev = e->prev;
+		if (e->ref == 0)
+			entry_drop(cache, e);
+	}
+}
+
+//the entry of 'path' still good for 'st', one that is not any more is marked stale
+static struct xml_cache_entry *cache_find(struct xml_cache *cache, const wchar_t *path, const struct _stat64 *st)
+{
+	struct xml_cache_entry *e;
+
+	for (e = cache->head; e; e = e->next) {
+		if (e->stale || wcscmp(e->path, path) != 0)
+			continue;
+
+		if (entry_match(e, st))
+			return e;
+
+		if (e->ref == 0) {
+			entry_drop(cache, e);
+		} else {
+			e->stale = 1;
+			cache->mem -= e->mem;
+			e->mem = 0;
+		}
+
+		break;
+	}
+
+	return NULL;
+}
+
+struct xml_cache *xml_cache_create(size_t budget)
+{
+	struct xml_cache *cache;
+
+	cache = new (std::nothrow) struct xml_cache;
+	if (cache == NULL)
+		return NULL;
+
+	cache->head = NULL;
+	cache->tail = NULL;
+	cache->budget = budget;
+	cache->mem = 0;
+
+	return cache;
+}
+
+//every tree handed out must be put back before
+int xml_cache_release(struct xml_cache *cache)
+{
+	struct xml_cache_entry *e;
+
+	assert(cache);
+
+	while (cache->head) {
+		e = cache->head;
+		assert(e->ref == 0);
+		entry_unlink(cache, e);
+		entry_free(e);
+	}
+
+	delete cache;
+
+	return 0;
+}
+
+/* the file is stat before it is read, so a change in between is seen by the next call */
+const struct xml_element *xml_cache_get(struct xml_cache *cache, const wchar_t *path)
+{
+	wchar_t *full;
+	struct _stat64 st;
+	struct xml_cache_entry *e;
+	struct xml_cache_entry *fresh;
+	struct xml_element *elm;
+
+	assert(cache);
+	assert(path);
+
+	full = _wfullpath(NULL, path, 0);
+	if (full == NULL)
+		return NULL;
+
+	if (_wstat64(full, &st) == -1) {
+		free(full);
+		return NULL;
+	}
+
+	{
+		std::lock_guard<std::mutex> guard(cache->lock);
+		e = cache_find(cache, full, &st);
+		if (e) {
+			e->ref++;
+			entry_unlink(cache, e);
+			entry_front(cache, e);
+			free(full);
+			return e->tree;
+		}
+	}
+
+	//parsed without the lock, the hits on other files go on meanwhile
+	fresh = (struct xml_cache_entry *)calloc(1, sizeof(*fresh));
+	if (fresh == NULL) {
+		free(full);
+		return NULL;
+	}
+
+	fresh->path = full;
+	fresh->dev = st.st_dev;
+	fresh->ino = st.st_ino;
+	fresh->mtime = st.st_mtime;
+	fresh->size = st.st_size;
+	fresh->tree = xml_load_file(full);
+	if (fresh->tree == NULL) {
+		entry_free(fresh);
+		return NULL;
+	}
+
+	//the hashes are filled now, a holder only read them after
+	for (elm = fresh->tree; elm; elm = xml_walknext(elm))
+		xml_hash(elm);
+
+	fresh->mem = xml_mem_size(fresh->tree);
+	fresh->ref = 1;
+
+	std::unique_lock<std::mutex> guard(cache->lock);
+	//someone else may have parsed the same file in the meantime
+	e = cache_find(cache, full, &st);
+	if (e) {
+		e->ref++;
+		entry_unlink(cache, e);
+		entry_front(cache, e);
+		guard.unlock();
+		entry_free(fresh);
+		return e->tree;
+	}
+
+	entry_front(cache, fresh);
+	cache->mem += fresh->mem;
+	cache_trim(cache);
+
+	return fresh->tree;
+}
+
+int xml_cache_put(struct xml_cache *cache, const struct xml_element *tree)
+{
+	struct xml_cache_entry *e;
+
+	assert(cache);
+	assert(tree);
+
+	std::lock_guard<std::mutex> guard(cache->lock);
+	for (e = cache->head; e; e = e->next) {
+		if (e->tree == tree && e->ref > 0)
+			break;
+	}
+
+	assert(e);
+	if (e == NULL)
+		return -1;
+
+	e->ref--;
+	if (e->ref == 0 && e->stale)
+		entry_drop(cache, e);
+	else
+		cache_trim(cache);
+
+	return 0;
+}
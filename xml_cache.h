@@ -0,0 +1,15 @@
+#ifndef _XML_CACHE_H
+#define	_XML_CACHE_H
+
+#include <stddef.h>
+
+struct xml_element;
+struct xml_cache;
+
+struct xml_cache *xml_cache_create(size_t budget);
+int xml_cache_release(struct xml_cache *cache);
+
+const struct xml_element *xml_cache_get(struct xml_cache *cache, const wchar_t *path);
+int xml_cache_put(struct xml_cache *cache, const struct xml_element *tree);
+
+#endif // !_XML_CACHE_H
@@ -0,0 +1,527 @@
+#ifndef _XML_CORE_HPP
+#define	_XML_CORE_HPP
+
+#include <stdlib.h>
+#include <string.h>
+#include "xml.h"
+
+/* a parser of its own, written after the state machine of xml.cpp, over any char type and with
+ * what it keep and check fixed at compile time:
+ *
+ *	xml::core_doc<char16_t, xml::policy<false, false, false> > doc;
+ *	if (doc.parse(data, len) == 0)
+ *		walk(doc.root());
+ *
+ * the nodes live in the arena of the document, with 'copy_string' off they point into 'data'.
+ * 'data' is taken as it is, only a BOM in front is skipped, nothing is decoded.
+ *
+ * it share no code with xml.cpp, test_core of xml_test.cpp check both give the same tree. where
+ * they still differ, this one is the stricter or keep more:
+ *	- a closing tag must match its element, xml.cpp don't look at it for an element without child
+ *	- an element still open at the end is an error
+ *	- an attribute value may hold '>'
+ *	- a comment may start with a space or hold a '-', xml.cpp end its text at the first '-'
+ *	- '/>' always give XML_ELEMENT_SELF, xml.cpp keep XML_ELEMENT when there are attributes
+ */
+
+#define	XML_CORE_CHUNK	(64 * 1024)
+
+namespace xml {
+
+template <bool KeepComment, bool CheckClose, bool CopyString>
+struct policy {
+	static const bool keep_comment = KeepComment;
+	static const bool check_close = CheckClose;
+	static const bool copy_string = CopyString;
+};
+
+typedef policy<true, true, true> policy_default;
+typedef policy<false, false, false> policy_trust;
+
+template <typename CharT>
+struct core_attr {
+	const CharT	*name;
+	size_t		name_len;
+	const CharT	*value;
+	size_t		value_len;
+};
+
+template <typename CharT>
+struct core_node {
+	enum xml_type		type;
+	const CharT		*name;
+	size_t			name_len;
+	const CharT		*value;
+	size_t			value_len;
+	core_attr<CharT>	*attr;
+	size_t			attr_cnt;
+	core_node		*parent;
+	core_node		*child;
+	core_node		*last;
+	core_node		*next;
+};
+
+class core_arena {
+public:
+	core_arena() : head(NULL) {}
+	~core_arena() { clear(); }
+
+	void clear()
+	{
+		struct chunk *c;
+
+		while (head) {
+			c = head;
+			head = c->next;
+			free(c);
+		}
+	}
+
+	void *alloc(size_t size)
+	{
+		size_t n;
+		void *p;
+		struct chunk *c;
+
+		size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+		if (head == NULL || head->size - head->used < size) {
+			n = size > XML_CORE_CHUNK ? size : XML_CORE_CHUNK;
+			c = (struct chunk *)malloc(sizeof(*c) + n);
+			if (c == NULL)
+				return NULL;
+
+			c->next = head;
+			c->size = n;
+			c->used = 0;
+			head = c;
+		}
+
+		p = (char *)(head + 1) + head->used;
+		head->used += size;
+
+		return p;
+	}
+
+private:
+	struct chunk {
+		struct chunk	*next;
+		size_t		size;
+		size_t		used;
+	};
+
+	struct chunk *head;
+
+	core_arena(const core_arena &);
+	core_arena &operator=(const core_arena &);
+};
+
+template <typename CharT, typename Policy = policy_default>
+class core_doc {
+public:
+	typedef core_node<CharT> node;
+	typedef core_attr<CharT> attr;
+
+	core_doc() : tree(NULL), scratch(NULL), scratch_cap(0) {}
+	~core_doc() { free(scratch); }
+
+	const node *root() const { return tree; }
+
+	/* return 0 or -1, the tree of the last parse is dropped */
+	int parse(const CharT *data, size_t len)
+	{
+		enum state s;
+
+		arena.clear();
+		tree = NULL;
+		tail = NULL;
+		base = NULL;
+		curr = NULL;
+		tmp = NULL;
+		p = data;
+		end = data + len;
+
+		skip_bom();
+
+		s = S_OPEN;
+		while (s != S_END && s != S_ERR) {
+			switch (s) {
+			case S_OPEN:
+				s = state_open();
+				break;
+			case S_ATTR:
+				s = state_attr();
+				break;
+			case S_VALUE:
+				s = state_value();
+				break;
+			case S_CLOSE:
+				s = state_close();
+				break;
+			default:
+				s = S_ERR;
+				break;
+			}
+		}
+
+		if (s == S_ERR) {
+			arena.clear();
+			tree = NULL;
+			return -1;
+		}
+
+		return tree ? 0 : -1;
+	}
+
+private:
+	enum state {
+		S_OPEN,
+		S_ATTR,
+		S_VALUE,
+		S_CLOSE,
+		S_END,
+		S_ERR,
+	};
+
+	core_arena	arena;
+	node		*tree;
+	node		*tail;
+	//'<?xml ?>' hold the nodes behind it, so it is never closed
+	node		*base;
+	node		*curr;
+	node		*tmp;
+	const CharT	*p;
+	const CharT	*end;
+	attr		*scratch;
+	size_t		scratch_cap;
+	size_t		scratch_cnt;
+
+	core_doc(const core_doc &);
+	core_doc &operator=(const core_doc &);
+
+	static bool is_space(CharT ch)
+	{
+		return ch == CharT(' ') || ch == CharT('\t') || ch == CharT('\r') || ch == CharT('\n');
+	}
+
+	static bool is_name_end(CharT ch)
+	{
+		return is_space(ch) || ch == CharT('/') || ch == CharT('>') || ch == CharT('?') || ch == CharT('=');
+	}
+
+	void skip_bom()
+	{
+		if (sizeof(CharT) == 1) {
+			if (end - p >= 3 && (unsigned char)p[0] == 0xef && (unsigned char)p[1] == 0xbb && (unsigned char)p[2] == 0xbf)
+				p += 3;
+		} else if (p < end && (unsigned long)p[0] == 0xfeff) {
+			p++;
+		}
+	}
+
+	void skip_space()
+	{
+		while (p < end && is_space(*p))
+			p++;
+	}
+
+	bool match(const char *lit) const
+	{
+		const CharT *s;
+
+		for (s = p; *lit; s++, lit++) {
+			if (s >= end || *s != CharT(*lit))
+				return false;
+		}
+
+		return true;
+	}
+
+	const CharT *find(const char *lit)
+	{
+		for (; p < end; p++) {
+			if (*p == CharT(*lit) && match(lit))
+				return p;
+		}
+
+		return NULL;
+	}
+
+	size_t scan_name()
+	{
+		const CharT *s;
+
+		for (s = p; p < end && !is_name_end(*p); p++)
+			;
+
+		return (size_t)(p - s);
+	}
+
+	const CharT *keep(const CharT *s, size_t len)
+	{
+		CharT *d;
+
+		if (!Policy::copy_string)
+			return s;
+
+		d = (CharT *)arena.alloc((len + 1) * sizeof(CharT));
+		if (d == NULL)
+			return NULL;
+
+		memcpy(d, s, len * sizeof(CharT));
+		d[len] = 0;
+
+		return d;
+	}
+
+	node *new_node(enum xml_type type, const CharT *name, size_t len)
+	{
+		node *n;
+
+		n = (node *)arena.alloc(sizeof(*n));
+		if (n == NULL)
+			return NULL;
+
+		memset(n, 0, sizeof(*n));
+		n->type = type;
+		n->name = keep(name, len);
+		n->name_len = len;
+
+		return n->name ? n : NULL;
+	}
+
+	void link(node *n)
+	{
+		n->parent = curr;
+		if (curr) {
+			if (curr->last)
+				curr->last->next = n;
+			else
+				curr->child = n;
+			curr->last = n;
+		} else if (tree == NULL) {
+			tree = n;
+			tail = n;
+		} else {
+			tail->next = n;
+			tail = n;
+		}
+	}
+
+	bool push_attr(const CharT *name, size_t name_len, const CharT *value, size_t value_len)
+	{
+		attr *a;
+
+		if (scratch_cnt == scratch_cap) {
+			a = (attr *)realloc(scratch, (scratch_cap ? scratch_cap * 2 : 8) * sizeof(*a));
+			if (a == NULL)
+				return false;
+
+			scratch = a;
+			scratch_cap = scratch_cap ? scratch_cap * 2 : 8;
+		}
+
+		a = &scratch[scratch_cnt++];
+		a->name = keep(name, name_len);
+		a->name_len = name_len;
+		a->value = keep(value, value_len);
+		a->value_len = value_len;
+
+		return a->name && a->value;
+	}
+
+	bool end_attr()
+	{
+		if (scratch_cnt == 0)
+			return true;
+
+		tmp->attr = (attr *)arena.alloc(scratch_cnt * sizeof(attr));
+		if (tmp->attr == NULL)
+			return false;
+
+		memcpy(tmp->attr, scratch, scratch_cnt * sizeof(attr));
+		tmp->attr_cnt = scratch_cnt;
+
+		return true;
+	}
+
+	enum state state_open()
+	{
+		size_t len;
+		const CharT *s;
+
+		//text behind a child is not kept, like xml.cpp, and as there it can't end the element
+		s = p;
+		while (p < end && *p != CharT('<'))
+			p++;
+
+		if (p >= end)
+			return curr == base ? S_END : S_ERR;
+
+		if (match("</")) {
+			for (; s < p; s++) {
+				if (!is_space(*s))
+					return S_ERR;
+			}
+
+			return S_CLOSE;
+		}
+
+		if (match("<!--")) {
+			p += 4;
+			s = p;
+			if (find("-->") == NULL)
+				return S_ERR;
+
+			if (Policy::keep_comment) {
+				tmp = new_node(XML_COMMENT, s, (size_t)(p - s));
+				if (tmp == NULL)
+					return S_ERR;
+				link(tmp);
+			}
+
+			p += 3;
+
+			return S_OPEN;
+		}
+
+		if (match("<?")) {
+			p += 2;
+		} else {
+			p += 1;
+		}
+
+		s = p;
+		len = scan_name();
+		if (len == 0)
+			return S_ERR;
+
+		tmp = new_node(s[-1] == CharT('?') ? XML_ROOT : XML_ELEMENT, s, len);
+		if (tmp == NULL)
+			return S_ERR;
+
+		scratch_cnt = 0;
+
+		return S_ATTR;
+	}
+
+	enum state state_attr()
+	{
+		size_t name_len;
+		const CharT *name;
+		const CharT *value;
+
+		for (;;) {
+			skip_space();
+			if (p >= end)
+				return S_ERR;
+
+			if (*p == CharT('>') && tmp->type == XML_ELEMENT) {
+				p++;
+				if (!end_attr())
+					return S_ERR;
+
+				link(tmp);
+				curr = tmp;
+
+				return S_VALUE;
+			}
+
+			if (match("/>") && tmp->type == XML_ELEMENT) {
+				p += 2;
+				if (!end_attr())
+					return S_ERR;
+
+				tmp->type = XML_ELEMENT_SELF;
+				link(tmp);
+
+				return S_OPEN;
+			}
+
+			//only the first '<?xml ?>' hold what follow, a later one is a leaf
+			if (match("?>") && tmp->type == XML_ROOT) {
+				p += 2;
+				if (!end_attr())
+					return S_ERR;
+
+				link(tmp);
+				if (tree == tmp) {
+					curr = tmp;
+					base = tmp;
+				}
+
+				return S_OPEN;
+			}
+
+			name = p;
+			name_len = scan_name();
+			skip_space();
+			if (name_len == 0 || p >= end || *p != CharT('='))
+				return S_ERR;
+
+			p++;
+			skip_space();
+			if (p >= end || *p != CharT('"'))
+				return S_ERR;
+
+			p++;
+			for (value = p; p < end && *p != CharT('"'); p++)
+				;
+
+			if (p >= end)
+				return S_ERR;
+
+			if (!push_attr(name, name_len, value, (size_t)(p - value)))
+				return S_ERR;
+
+			p++;
+		}
+	}
+
+	enum state state_value()
+	{
+		const CharT *s;
+
+		skip_space();
+		if (p >= end || *p == CharT('<'))
+			return S_OPEN;
+
+		for (s = p; p < end && *p != CharT('<'); p++)
+			;
+
+		curr->value = keep(s, (size_t)(p - s));
+		curr->value_len = (size_t)(p - s);
+
+		//a text is the only content, a child can't follow it
+		return curr->value && match("</") ? S_CLOSE : S_ERR;
+	}
+
+	enum state state_close()
+	{
+		size_t len;
+		const CharT *s;
+
+		if (curr == base)
+			return S_ERR;
+
+		p += 2;
+		s = p;
+		len = scan_name();
+		skip_space();
+		if (p >= end || *p != CharT('>'))
+			return S_ERR;
+
+		if (Policy::check_close) {
+			if (len != curr->name_len || memcmp(s, curr->name, len * sizeof(CharT)) != 0)
+				return S_ERR;
+		}
+
+		p++;
+		curr = curr->parent;
+
+		return S_OPEN;
+	}
+};
+
+}
+
+#endif
@@ -0,0 +1,204 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <atomic>
+#include <mutex>
+#include <new>
+#include "array.h"
+#include "xml.h"
+#include "xml_doc.h"
+
+/*
+ * readers publish the tree they are using in their own hazard slot,
+ * a replaced tree is only freed once no slot refer to it any more.
+ * a tree is hashed before it is published, so a reader may call xml_hash,
+ * xml_equal and xml_diff on it, they only read a hashed tree.
+ */
+
+//the hazard slot of a reader, only seen in this file
+namespace {
+struct alignas(64) doc_slot {
+	std::atomic<int>			used;
+	std::atomic<struct xml_element *>	hazard;
+};
+}
+
+struct xml_doc {
+	std::atomic<struct xml_element *>	curr;
+	std::mutex		lock;
+	struct array		*retired;
+	int			reader_max;
+	struct doc_slot		*reader;
+};
+
+static void hash_forest(const struct xml_element *tree)
+{
+	for (; tree; tree = xml_walknext(tree))
+		xml_hash(tree);
+}
+
+static int is_hazard(const struct xml_doc *doc, const struct xml_element *tree)
+{
+	int i;
+
+	for (i = 0; i < doc->reader_max; i++) {
+		if (doc->reader[i].hazard.load() == tree)
+			return 1;
+	}
+
+	return 0;
+}
+
+static int reclaim(struct xml_doc *doc)
+{
+	size_t i;
+	struct xml_element *tree;
+
+	for (i = array_size(doc->retired); i-- > 0; ) {
+		tree = array_at(doc->retired, i, struct xml_element *);
+		if (is_hazard(doc, tree))
+			continue;
+
+		xml_free_all(tree);
+		array_erase(doc->retired, i);
+	}
+
+	return (int)array_size(doc->retired);
+}
+
+struct xml_doc *xml_doc_create(struct xml_element *tree, int reader_max)
+{
+	int i;
+	struct xml_doc *doc;
+
+	assert(reader_max > 0);
+
+	doc = new (std::nothrow) struct xml_doc;
+	if (doc == NULL)
+		return NULL;
+
+	doc->reader = new (std::nothrow) struct doc_slot[reader_max];
+	doc->retired = array_create(sizeof(struct xml_element *));
+	if (doc->reader == NULL || doc->retired == NULL) {
+		if (doc->retired)
+			array_release(doc->retired);
+		delete[] doc->reader;
+		delete doc;
+		return NULL;
+	}
+
+	for (i = 0; i < reader_max; i++) {
+		doc->reader[i].used.store(0);
+		doc->reader[i].hazard.store(NULL);
+	}
+
+	hash_forest(tree);
+	doc->reader_max = reader_max;
+	doc->curr.store(tree);
+
+	return doc;
+}
+
+int xml_doc_release(struct xml_doc *doc)
+{
+	int i;
+
+	assert(doc);
+
+	for (i = 0; i < doc->reader_max; i++)
+		assert(doc->reader[i].hazard.load() == NULL);
+
+	for (i = 0; (size_t)i < array_size(doc->retired); i++)
+		xml_free_all(array_at(doc->retired, i, struct xml_element *));
+
+	xml_free_all(doc->curr.load());
+	array_release(doc->retired);
+	delete[] doc->reader;
+	delete doc;
+
+	return 0;
+}
+
+int xml_doc_reader_get(struct xml_doc *doc)
+{
+	int i;
+	int used;
+
+	assert(doc);
+
+	for (i = 0; i < doc->reader_max; i++) {
+		used = 0;
+		if (doc->reader[i].used.compare_exchange_strong(used, 1))
+			return i;
+	}
+
+	return -1;
+}
+
+int xml_doc_reader_put(struct xml_doc *doc, int reader)
+{
+	assert(doc);
+	assert(reader >= 0 && reader < doc->reader_max);
+
+	doc->reader[reader].hazard.store(NULL);
+	doc->reader[reader].used.store(0);
+
+	return 0;
+}
+
+const struct xml_element *xml_doc_pin(struct xml_doc *doc, int reader)
+{
+	struct xml_element *tree;
+	struct doc_slot *r;
+
+	assert(doc);
+	assert(reader >= 0 && reader < doc->reader_max);
+
+	r = &doc->reader[reader];
+	assert(r->used.load());
+
+	do {
+		tree = doc->curr.load();
+		r->hazard.store(tree);
+	} while (tree != doc->curr.load());
+
+	return tree;
+}
+
+int xml_doc_unpin(struct xml_doc *doc, int reader)
+{
+	assert(doc);
+	assert(reader >= 0 && reader < doc->reader_max);
+
+	doc->reader[reader].hazard.store(NULL, std::memory_order_release);
+
+	return 0;
+}
+
+int xml_doc_publish(struct xml_doc *doc, struct xml_element *tree)
+{
+	struct xml_element *old;
+
+	//no reader can see it yet
+	hash_forest(tree);
+
+	std::lock_guard<std::mutex> guard(doc->lock);
+
+	//only a publisher change 'curr' and it hold the lock, so 'old' is retired before it is
+	//swapped out and a failed push leave the doc as it was
+	old = doc->curr.load();
+	if (old && array_push(doc->retired, &old))
+		return -1;
+
+	doc->curr.store(tree);
+
+	reclaim(doc);
+
+	return 0;
+}
+
+int xml_doc_reclaim(struct xml_doc *doc)
+{
+	std::lock_guard<std::mutex> guard(doc->lock);
+
+	return reclaim(doc);
+}
@@ -0,0 +1,19 @@
+#ifndef _XML_DOC_H
+#define	_XML_DOC_H
+
+struct xml_element;
+struct xml_doc;
+
+struct xml_doc *xml_doc_create(struct xml_element *tree, int reader_max);
+int xml_doc_release(struct xml_doc *doc);
+
+int xml_doc_reader_get(struct xml_doc *doc);
+int xml_doc_reader_put(struct xml_doc *doc, int reader);
+
+const struct xml_element *xml_doc_pin(struct xml_doc *doc, int reader);
+int xml_doc_unpin(struct xml_doc *doc, int reader);
+
+int xml_doc_publish(struct xml_doc *doc, struct xml_element *tree);
+int xml_doc_reclaim(struct xml_doc *doc);
+
+#endif // !_XML_DOC_H
@@ -0,0 +1,731 @@
+/* xml_gen: generate C++ structs from a schema, and a parser which fill them without building a tree
+ *
+ *	struct item
+ *		attr sku string
+ *		elem count i64
+ *	end
+ *	struct order
+ *		attr id u64
+ *		attr side enum buy sell
+ *		elem price double
+ *		elem item item[]
+ *	end
+ *	root order order
+ *
+ * types: i64 u64 double bool string, 'enum' followed by its values, or a struct defined before,
+ * a '[]' behind an element type collect every occurrence. usage: xml_gen schema.txt [out.h]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#define	GEN_NAME_MAX	64
+#define	GEN_ENUM_MAX	32
+#define	GEN_FIELD_MAX	64
+#define	GEN_STRUCT_MAX	64
+#define	GEN_SEED_MAX	100000
+
+enum gen_type {
+	GEN_I64,
+	GEN_U64,
+	GEN_DOUBLE,
+	GEN_BOOL,
+	GEN_STRING,
+	GEN_ENUM,
+	GEN_STRUCT,
+};
+
+struct gen_field {
+	int	is_attr;
+	int	type;
+	int	repeat;
+	int	sub;
+	char	name[GEN_NAME_MAX];
+	//to_ident put a '_' before a leading digit
+	char	ident[GEN_NAME_MAX + 1];
+	int	enum_cnt;
+	char	enum_val[GEN_ENUM_MAX][GEN_NAME_MAX];
+};
+
+struct gen_struct {
+	//an ident, as gen_field.ident
+	char			name[GEN_NAME_MAX + 1];
+	int			field_cnt;
+	struct gen_field	field[GEN_FIELD_MAX];
+};
+
+struct gen_schema {
+	int			struct_cnt;
+	struct gen_struct	st[GEN_STRUCT_MAX];
+	int			root;
+	char			root_name[GEN_NAME_MAX];
+};
+
+/* a perfect hash of a set of names: (hash(name, seed) & mask) differ for each one */
+struct gen_hash {
+	unsigned int	seed;
+	unsigned int	mask;
+};
+
+static const char *type_name[] = {
+	"i64", "u64", "double", "bool", "string",
+};
+
+static int line_no;
+
+static int error(const char *msg, const char *arg)
+{
+	fprintf(stderr, "xml_gen: line %d: %s '%s'\n", line_no, msg, arg);
+	return -1;
+}
+
+/* the same hash the generated code run on wchar_t */
+static unsigned int hash(const char *s, int len, unsigned int seed)
+{
+	unsigned int h;
+
+	h = seed ^ (unsigned int)len;
+	while (len--)
+		h = (h ^ (unsigned int)(unsigned char)*s++) * 16777619u;
+
+	return h ^ (h >> 15);
+}
+
+static int check_name(const char *name)
+{
+	const char *p;
+
+	if (strlen(name) >= GEN_NAME_MAX)
+		return error("name too long", name);
+
+	for (p = name; *p; p++) {
+		if (!isalnum((unsigned char)*p) && *p != '_' && *p != '-' && *p != '.' && *p != ':')
+			return error("bad name", name);
+	}
+
+	return 0;
+}
+
+static void to_ident(char *ident, const char *name)
+{
+	if (isdigit((unsigned char)*name))
+		*ident++ = '_';
+
+	for (; *name; name++)
+		*ident++ = isalnum((unsigned char)*name) ? *name : '_';
+
+	*ident = 0;
+}
+
+static int find_struct(const struct gen_schema *schema, const char *name)
+{
+	int i;
+	char ident[GEN_NAME_MAX + 1];
+
+	if (strlen(name) >= GEN_NAME_MAX)
+		return -1;
+
+	to_ident(ident, name);
+	for (i = 0; i < schema->struct_cnt; i++) {
+		if (strcmp(schema->st[i].name, ident) == 0)
+			return i;
+	}
+
+	return -1;
+}
+
+static int parse_type(const struct gen_schema *schema, struct gen_field *f, char **tok, int tok_cnt)
+{
+	int i;
+	int len;
+	char *type;
+
+	type = tok[2];
+	len = strlen(type);
+	if (len > 2 && strcmp(type + len - 2, "[]") == 0) {
+		if (f->is_attr)
+			return error("attribute can't repeat", type);
+		f->repeat = 1;
+		type[len - 2] = 0;
+	}
+
+	if (strcmp(type, "enum") == 0) {
+		if (f->repeat)
+			return error("enum can't repeat", f->name);
+		if (tok_cnt < 4 || tok_cnt - 3 > GEN_ENUM_MAX)
+			return error("bad enum", f->name);
+
+		f->type = GEN_ENUM;
+		for (i = 3; i < tok_cnt; i++) {
+			if (check_name(tok[i]))
+				return -1;
+			strcpy(f->enum_val[f->enum_cnt++], tok[i]);
+		}
+
+		return 0;
+	}
+
+	if (tok_cnt != 3)
+		return error("unexpected token behind", type);
+
+	for (i = 0; i < (int)(sizeof(type_name) / sizeof(type_name[0])); i++) {
+		if (strcmp(type, type_name[i]) == 0) {
+			f->type = i;
+			return 0;
+		}
+	}
+
+	f->sub = find_struct(schema, type);
+	if (f->sub < 0)
+		return error("struct not defined yet", type);
+	if (f->is_attr)
+		return error("attribute can't be a struct", type);
+
+	f->type = GEN_STRUCT;
+
+	return 0;
+}
+
+static int parse_schema(FILE *fp, struct gen_schema *schema)
+{
+	int i;
+	int tok_cnt;
+	char line[1024];
+	char *p;
+	char *tok[GEN_ENUM_MAX + 4];
+	struct gen_field *f;
+	struct gen_struct *st;
+
+	st = NULL;
+	schema->root = -1;
+	while (fgets(line, sizeof(line), fp)) {
+		line_no++;
+		p = strchr(line, '#');
+		if (p)
+			*p = 0;
+
+		tok_cnt = 0;
+		for (p = strtok(line, " \t\r\n"); p && tok_cnt < GEN_ENUM_MAX + 4; p = strtok(NULL, " \t\r\n"))
+			tok[tok_cnt++] = p;
+
+		if (tok_cnt == 0)
+			continue;
+
+		if (strcmp(tok[0], "struct") == 0 && tok_cnt == 2 && st == NULL) {
+			if (schema->struct_cnt >= GEN_STRUCT_MAX)
+				return error("too many structs", tok[1]);
+			if (check_name(tok[1]) || find_struct(schema, tok[1]) >= 0)
+				return error("bad struct", tok[1]);
+
+			st = &schema->st[schema->struct_cnt];
+			to_ident(st->name, tok[1]);
+		} else if (strcmp(tok[0], "end") == 0 && tok_cnt == 1 && st) {
+			schema->struct_cnt++;
+			st = NULL;
+		} else if ((strcmp(tok[0], "attr") == 0 || strcmp(tok[0], "elem") == 0) && tok_cnt >= 3 && st) {
+			if (st->field_cnt >= GEN_FIELD_MAX)
+				return error("too many fields in", st->name);
+			if (check_name(tok[1]))
+				return -1;
+
+			f = &st->field[st->field_cnt];
+			f->is_attr = tok[0][0] == 'a';
+			strcpy(f->name, tok[1]);
+			to_ident(f->ident, tok[1]);
+			for (i = 0; i < st->field_cnt; i++) {
+				if (strcmp(st->field[i].ident, f->ident) == 0)
+					return error("duplicated field", f->name);
+			}
+
+			if (parse_type(schema, f, tok, tok_cnt))
+				return -1;
+
+			st->field_cnt++;
+		} else if (strcmp(tok[0], "root") == 0 && tok_cnt == 3 && st == NULL) {
+			if (check_name(tok[1]))
+				return -1;
+
+			strcpy(schema->root_name, tok[1]);
+			schema->root = find_struct(schema, tok[2]);
+			if (schema->root < 0)
+				return error("struct not defined yet", tok[2]);
+		} else {
+			return error("bad line", tok[0]);
+		}
+	}
+
+	if (st)
+		return error("missing 'end' of", st->name);
+	if (schema->root < 0)
+		return error("missing", "root");
+
+	return 0;
+}
+
+static int find_hash(const struct gen_struct *st, int is_attr, struct gen_hash *h)
+{
+	int i;
+	int cnt;
+	unsigned int size;
+	unsigned int slot;
+	unsigned char used[GEN_FIELD_MAX * 8];
+
+	cnt = 0;
+	for (i = 0; i < st->field_cnt; i++)
+		cnt += st->field[i].is_attr == is_attr;
+
+	for (size = 1; size < (unsigned int)cnt; size <<= 1)
+		;
+
+	for (; size <= sizeof(used); size <<= 1) {
+		for (h->seed = 1; h->seed < GEN_SEED_MAX; h->seed++) {
+			memset(used, 0, size);
+			for (i = 0; i < st->field_cnt; i++) {
+				if (st->field[i].is_attr != is_attr)
+					continue;
+
+				slot = hash(st->field[i].name, strlen(st->field[i].name), h->seed) & (size - 1);
+				if (used[slot])
+					break;
+				used[slot] = 1;
+			}
+
+			if (i == st->field_cnt) {
+				h->mask = size - 1;
+				return 0;
+			}
+		}
+	}
+
+	return error("no perfect hash for", st->name);
+}
+
+static const char *field_type(const struct gen_schema *schema, const struct gen_field *f)
+{
+	static char buff[GEN_NAME_MAX + 32];
+	static const char *ctype[] = {
+		"long long", "unsigned long long", "double", "bool", "std::wstring", "int",
+	};
+
+	if (f->type == GEN_STRUCT)
+		snprintf(buff, sizeof(buff), "struct %s", schema->st[f->sub].name);
+	else
+		snprintf(buff, sizeof(buff), "%s", ctype[f->type]);
+
+	return buff;
+}
+
+static void emit_runtime(FILE *out)
+{
+	fputs(
+"#ifndef _XML_GEN_RUNTIME\n"
+"#define _XML_GEN_RUNTIME\n"
+"\n"
+"#include <wchar.h>\n"
+"#include <string>\n"
+"#include <vector>\n"
+"#include \"xml_str.h\"\n"
+"\n"
+"struct xml_gen_in {\n"
+"\tconst wchar_t *p;\n"
+"\tconst wchar_t *end;\n"
+"};\n"
+"\n"
+"static inline unsigned int xml_gen_hash(const wchar_t *s, int len, unsigned int seed)\n"
+"{\n"
+"\tunsigned int h;\n"
+"\n"
+"\th = seed ^ (unsigned int)len;\n"
+"\twhile (len--)\n"
+"\t\th = (h ^ (unsigned int)*s++) * 16777619u;\n"
+"\n"
+"\treturn h ^ (h >> 15);\n"
+"}\n"
+"\n"
+"static inline int xml_gen_is(const wchar_t *s, int len, const wchar_t *name, int name_len)\n"
+"{\n"
+"\treturn len == name_len && wmemcmp(s, name, len) == 0;\n"
+"}\n"
+"\n"
+"static inline int xml_gen_name(struct xml_gen_in *in, const wchar_t **name)\n"
+"{\n"
+"\tint len;\n"
+"\n"
+"\tif (in->p >= in->end)\n"
+"\t\treturn -1;\n"
+"\n"
+"\t*name = in->p;\n"
+"\tlen = strlen_t(in->p, in->end, L\"/>=\\r\\n \\t\");\n"
+"\tin->p += len;\n"
+"\n"
+"\treturn len ? len : -1;\n"
+"}\n"
+"\n"
+"/* 1 for an attribute, 0 at the end of a start tag, 2 if the element end with it too */\n"
+"static inline int xml_gen_attr(struct xml_gen_in *in, const wchar_t **name, int *name_len, const wchar_t **value, int *value_len)\n"
+"{\n"
+"\twchar_t quote;\n"
+"\n"
+"\tin->p = skip_space(in->p, in->end);\n"
+"\tif (in->p >= in->end)\n"
+"\t\treturn -1;\n"
+"\n"
+"\tif (*in->p == L'>') {\n"
+"\t\tin->p++;\n"
+"\t\treturn 0;\n"
+"\t}\n"
+"\n"
+"\tif (*in->p == L'/') {\n"
+"\t\tif (in->end - in->p < 2 || in->p[1] != L'>')\n"
+"\t\t\treturn -1;\n"
+"\t\tin->p += 2;\n"
+"\t\treturn 2;\n"
+"\t}\n"
+"\n"
+"\t*name_len = xml_gen_name(in, name);\n"
+"\tif (*name_len < 0)\n"
+"\t\treturn -1;\n"
+"\n"
+"\tin->p = skip_space(in->p, in->end);\n"
+"\tif (in->p >= in->end || *in->p != L'=')\n"
+"\t\treturn -1;\n"
+"\n"
+"\tin->p = skip_space(in->p + 1, in->end);\n"
+"\tif (in->p >= in->end || (*in->p != L'\\\"' && *in->p != L'\\''))\n"
+"\t\treturn -1;\n"
+"\n"
+"\tquote = *in->p++;\n"
+"\t*value = in->p;\n"
+"\tin->p = str_forward(in->p, in->end, quote);\n"
+"\tif (in->p >= in->end)\n"
+"\t\treturn -1;\n"
+"\n"
+"\t*value_len = in->p - *value;\n"
+"\tin->p++;\n"
+"\n"
+"\treturn 1;\n"
+"}\n"
+"\n"
+"/* pass text, comments and <?...?>, 1 at the name of a child, 0 behind the end tag of 'tag' */\n"
+"static inline int xml_gen_next(struct xml_gen_in *in, const wchar_t *tag, int tag_len, const wchar_t **name, int *name_len)\n"
+"{\n"
+"\tfor (;;) {\n"
+"\t\tin->p = str_forward(in->p, in->end, L'<');\n"
+"\t\tif (in->end - in->p < 2)\n"
+"\t\t\treturn -1;\n"
+"\n"
+"\t\tin->p++;\n"
+"\t\tif (*in->p == L'/') {\n"
+"\t\t\tin->p++;\n"
+"\t\t\t*name_len = xml_gen_name(in, name);\n"
+"\t\t\tin->p = skip_space(in->p, in->end);\n"
+"\t\t\tif (in->p >= in->end || *in->p != L'>' || !xml_gen_is(*name, *name_len, tag, tag_len))\n"
+"\t\t\t\treturn -1;\n"
+"\n"
+"\t\t\tin->p++;\n"
+"\t\t\treturn 0;\n"
+"\t\t}\n"
+"\n"
+"\t\tif (*in->p == L'!') {\n"
+"\t\t\tif (in->end - in->p < 3 || in->p[1] != L'-' || in->p[2] != L'-')\n"
+"\t\t\t\treturn -1;\n"
+"\n"
+"\t\t\tfor (in->p += 3; in->end - in->p >= 3; in->p++) {\n"
+"\t\t\t\tif (in->p[0] == L'-' && in->p[1] == L'-' && in->p[2] == L'>')\n"
+"\t\t\t\t\tbreak;\n"
+"\t\t\t}\n"
+"\n"
+"\t\t\tif (in->end - in->p < 3)\n"
+"\t\t\t\treturn -1;\n"
+"\n"
+"\t\t\tin->p += 3;\n"
+"\t\t\tcontinue;\n"
+"\t\t}\n"
+"\n"
+"\t\tif (*in->p == L'?') {\n"
+"\t\t\tfor (; in->end - in->p >= 2; in->p++) {\n"
+"\t\t\t\tif (in->p[0] == L'?' && in->p[1] == L'>')\n"
+"\t\t\t\t\tbreak;\n"
+"\t\t\t}\n"
+"\n"
+"\t\t\tif (in->end - in->p < 2)\n"
+"\t\t\t\treturn -1;\n"
+"\n"
+"\t\t\tin->p += 2;\n"
+"\t\t\tcontinue;\n"
+"\t\t}\n"
+"\n"
+"\t\t*name_len = xml_gen_name(in, name);\n"
+"\n"
+"\t\treturn *name_len < 0 ? -1 : 1;\n"
+"\t}\n"
+"}\n"
+"\n"
+"/* the text of the element whose name was just read, its attributes are ignored */\n"
+"static inline int xml_gen_text(struct xml_gen_in *in, const wchar_t *tag, int tag_len, const wchar_t **text, int *text_len)\n"
+"{\n"
+"\tint r;\n"
+"\tint name_len;\n"
+"\tint value_len;\n"
+"\tconst wchar_t *name;\n"
+"\tconst wchar_t *value;\n"
+"\n"
+"\twhile ((r = xml_gen_attr(in, &name, &name_len, &value, &value_len)) == 1)\n"
+"\t\t;\n"
+"\n"
+"\t*text = in->p;\n"
+"\t*text_len = 0;\n"
+"\tif (r != 0)\n"
+"\t\treturn r == 2 ? 0 : -1;\n"
+"\n"
+"\tin->p = str_forward(in->p, in->end, L'<');\n"
+"\t*text_len = in->p - *text;\n"
+"\n"
+"\treturn xml_gen_next(in, tag, tag_len, &name, &name_len) == 0 ? 0 : -1;\n"
+"}\n"
+"\n"
+"/* pass the rest of the element whose name was just read */\n"
+"static inline int xml_gen_skip(struct xml_gen_in *in, const wchar_t *tag, int tag_len)\n"
+"{\n"
+"\tint r;\n"
+"\tint name_len;\n"
+"\tint value_len;\n"
+"\tconst wchar_t *name;\n"
+"\tconst wchar_t *value;\n"
+"\n"
+"\twhile ((r = xml_gen_attr(in, &name, &name_len, &value, &value_len)) == 1)\n"
+"\t\t;\n"
+"\n"
+"\tif (r != 0)\n"
+"\t\treturn r == 2 ? 0 : -1;\n"
+"\n"
+"\twhile ((r = xml_gen_next(in, tag, tag_len, &name, &name_len)) == 1) {\n"
+"\t\tif (xml_gen_skip(in, name, name_len))\n"
+"\t\t\treturn -1;\n"
+"\t}\n"
+"\n"
+"\treturn r;\n"
+"}\n"
+"\n"
+"#endif\n"
+"\n", out);
+}
+
+static void emit_struct(FILE *out, const struct gen_schema *schema, const struct gen_struct *st)
+{
+	int i;
+	int j;
+	const struct gen_field *f;
+
+	for (i = 0; i < st->field_cnt; i++) {
+		f = &st->field[i];
+		if (f->type != GEN_ENUM)
+			continue;
+
+		fprintf(out, "enum %s_%s {\n", st->name, f->ident);
+		for (j = 0; j < f->enum_cnt; j++)
+			fprintf(out, "\t%s_%s_%s,\n", st->name, f->ident, f->enum_val[j]);
+		fprintf(out, "};\n\n");
+	}
+
+	fprintf(out, "struct %s {\n", st->name);
+	for (i = 0; i < st->field_cnt; i++) {
+		f = &st->field[i];
+		if (f->repeat)
+			fprintf(out, "\tstd::vector<%s> %s;\n", field_type(schema, f), f->ident);
+		else if (f->type == GEN_STRUCT || f->type == GEN_STRING)
+			fprintf(out, "\t%s %s;\n", field_type(schema, f), f->ident);
+		else
+			fprintf(out, "\t%s %s = 0;\n", field_type(schema, f), f->ident);
+	}
+	fprintf(out, "};\n\n");
+}
+
+/* convert 'value' into 'dst', which is a field or the last one of a vector */
+static void emit_conv(FILE *out, const struct gen_struct *st, const struct gen_field *f, const char *dst, const char *indent)
+{
+	switch (f->type) {
+	case GEN_I64:
+		fprintf(out, "%sif (str_toi64_n(value, value_len, &%s))\n%s\treturn -1;\n", indent, dst, indent);
+		break;
+	case GEN_U64:
+		fprintf(out, "%sif (str_tou64_n(value, value_len, &%s))\n%s\treturn -1;\n", indent, dst, indent);
+		break;
+	case GEN_DOUBLE:
+		fprintf(out, "%sif (str_todouble_n(value, value_len, &%s))\n%s\treturn -1;\n", indent, dst, indent);
+		break;
+	case GEN_BOOL:
+		fprintf(out, "%sif (str_tobool_n(value, value_len, &b))\n%s\treturn -1;\n", indent, indent);
+		fprintf(out, "%s%s = b != 0;\n", indent, dst);
+		break;
+	case GEN_STRING:
+		fprintf(out, "%s%s.assign(value, value_len);\n", indent, dst);
+		break;
+	case GEN_ENUM:
+		fprintf(out, "%sif (str_toenum_n(value, value_len, %s_%s_tbl, %d, &%s))\n%s\treturn -1;\n",
+			indent, st->name, f->ident, f->enum_cnt, dst, indent);
+		break;
+	}
+}
+
+static void emit_parser(FILE *out, const struct gen_schema *schema, const struct gen_struct *st, const struct gen_hash *attr, const struct gen_hash *elem)
+{
+	int i;
+	int j;
+	int slot;
+	char dst[GEN_NAME_MAX * 2];
+	const struct gen_field *f;
+
+	for (i = 0; i < st->field_cnt; i++) {
+		f = &st->field[i];
+		if (f->type != GEN_ENUM)
+			continue;
+
+		fprintf(out, "static const wchar_t *%s_%s_tbl[] = {", st->name, f->ident);
+		for (j = 0; j < f->enum_cnt; j++)
+			fprintf(out, "%sL\"%s\"", j ? ", " : "", f->enum_val[j]);
+		fprintf(out, "};\n\n");
+	}
+
+	fprintf(out, "static int xml_gen_parse_%s(struct xml_gen_in *in, const wchar_t *tag, int tag_len, struct %s *out)\n{\n", st->name, st->name);
+	fprintf(out, "\tint r;\n");
+	for (i = 0; i < st->field_cnt && st->field[i].type != GEN_BOOL; i++)
+		;
+	if (i < st->field_cnt)
+		fprintf(out, "\tint b;\n");
+	fprintf(out, "\tint name_len;\n\tint value_len;\n\tconst wchar_t *name;\n\tconst wchar_t *value;\n\n");
+	fprintf(out, "\twhile ((r = xml_gen_attr(in, &name, &name_len, &value, &value_len)) == 1) {\n");
+	fprintf(out, "\t\tswitch (xml_gen_hash(name, name_len, %uu) & %uu) {\n", attr->seed, attr->mask);
+	for (i = 0; i < st->field_cnt; i++) {
+		f = &st->field[i];
+		if (!f->is_attr)
+			continue;
+
+		slot = hash(f->name, strlen(f->name), attr->seed) & attr->mask;
+		fprintf(out, "\t\tcase %d:\n", slot);
+		fprintf(out, "\t\t\tif (!xml_gen_is(name, name_len, L\"%s\", %d))\n\t\t\t\tbreak;\n", f->name, (int)strlen(f->name));
+		snprintf(dst, sizeof(dst), "out->%s", f->ident);
+		emit_conv(out, st, f, dst, "\t\t\t");
+		fprintf(out, "\t\t\tbreak;\n");
+	}
+	fprintf(out, "\t\t}\n\t}\n\n");
+	fprintf(out, "\tif (r != 0)\n\t\treturn r == 2 ? 0 : -1;\n\n");
+
+	fprintf(out, "\twhile ((r = xml_gen_next(in, tag, tag_len, &name, &name_len)) == 1) {\n");
+	fprintf(out, "\t\tswitch (xml_gen_hash(name, name_len, %uu) & %uu) {\n", elem->seed, elem->mask);
+	for (i = 0; i < st->field_cnt; i++) {
+		f = &st->field[i];
+		if (f->is_attr)
+			continue;
+
+		slot = hash(f->name, strlen(f->name), elem->seed) & elem->mask;
+		fprintf(out, "\t\tcase %d:\n", slot);
+		fprintf(out, "\t\t\tif (!xml_gen_is(name, name_len, L\"%s\", %d))\n\t\t\t\tbreak;\n", f->name, (int)strlen(f->name));
+		if (f->repeat) {
+			fprintf(out, "\t\t\tout->%s.emplace_back();\n", f->ident);
+			snprintf(dst, sizeof(dst), "out->%s.back()", f->ident);
+		} else {
+			snprintf(dst, sizeof(dst), "out->%s", f->ident);
+		}
+
+		if (f->type == GEN_STRUCT) {
+			fprintf(out, "\t\t\tif (xml_gen_parse_%s(in, name, name_len, &%s))\n\t\t\t\treturn -1;\n", schema->st[f->sub].name, dst);
+		} else {
+			fprintf(out, "\t\t\tif (xml_gen_text(in, name, name_len, &value, &value_len))\n\t\t\t\treturn -1;\n");
+			emit_conv(out, st, f, dst, "\t\t\t");
+		}
+		fprintf(out, "\t\t\tcontinue;\n");
+	}
+	fprintf(out, "\t\t}\n\n");
+	fprintf(out, "\t\tif (xml_gen_skip(in, name, name_len))\n\t\t\treturn -1;\n");
+	fprintf(out, "\t}\n\n\treturn r;\n}\n\n");
+}
+
+static void emit_load(FILE *out, const struct gen_schema *schema)
+{
+	const char *name;
+
+	name = schema->st[schema->root].name;
+	fprintf(out, "/* parse the document in [data, end) into 'out', return 0 or -1 */\n");
+	fprintf(out, "static inline int xml_load_%s(const wchar_t *data, const wchar_t *end, struct %s *out)\n{\n", name, name);
+	fprintf(out, "\tint name_len;\n\tconst wchar_t *name;\n\tstruct xml_gen_in in;\n\n");
+	fprintf(out, "\tin.p = data;\n\tin.end = end;\n");
+	fprintf(out, "\tif (in.p < in.end && *in.p == 0xfeff)\n\t\tin.p++;\n\n");
+	fprintf(out, "\tif (xml_gen_next(&in, NULL, -1, &name, &name_len) != 1 || !xml_gen_is(name, name_len, L\"%s\", %d))\n\t\treturn -1;\n\n",
+		schema->root_name, (int)strlen(schema->root_name));
+	fprintf(out, "\treturn xml_gen_parse_%s(&in, name, name_len, out);\n}\n\n", name);
+}
+
+static int emit(FILE *out, const struct gen_schema *schema)
+{
+	int i;
+	struct gen_hash attr;
+	struct gen_hash elem;
+
+	fprintf(out, "/* generated by xml_gen, don't edit */\n");
+	fprintf(out, "#ifndef _XML_GEN_%s_H\n#define _XML_GEN_%s_H\n\n", schema->st[schema->root].name, schema->st[schema->root].name);
+	emit_runtime(out);
+
+	for (i = 0; i < schema->struct_cnt; i++)
+		emit_struct(out, schema, &schema->st[i]);
+
+	for (i = 0; i < schema->struct_cnt; i++) {
+		if (find_hash(&schema->st[i], 1, &attr) || find_hash(&schema->st[i], 0, &elem))
+			return -1;
+
+		emit_parser(out, schema, &schema->st[i], &attr, &elem);
+	}
+
+	emit_load(out, schema);
+	fprintf(out, "#endif\n");
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int err;
+	FILE *in;
+	FILE *out;
+	struct gen_schema *schema;
+
+	if (argc < 2 || argc > 3) {
+		fprintf(stderr, "usage: xml_gen schema.txt [out.h]\n");
+		return 1;
+	}
+
+	in = fopen(argv[1], "r");
+	if (in == NULL) {
+		fprintf(stderr, "xml_gen: can't open '%s'\n", argv[1]);
+		return 1;
+	}
+
+	schema = (struct gen_schema *)calloc(1, sizeof(*schema));
+	if (schema == NULL) {
+		fclose(in);
+		return 1;
+	}
+
+	err = parse_schema(in, schema);
+	fclose(in);
+
+	out = stdout;
+	if (err == 0 && argc == 3) {
+		out = fopen(argv[2], "w");
+		if (out == NULL) {
+			fprintf(stderr, "xml_gen: can't create '%s'\n", argv[2]);
+			err = -1;
+		}
+	}
+
+	if (err == 0)
+		err = emit(out, schema);
+
+	if (out && out != stdout)
+		fclose(out);
+
+	free(schema);
+
+	return err ? 1 : 0;
+}
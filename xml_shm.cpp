@@ -0,0 +1,371 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <atomic>
+#include "xml.h"
+#include "xml_shm.h"
+
+/*
+ * a master publish a tree in POSIX shared memory, the worker processes map it
+ * read only and walk it with the usual getters.
+ *
+ * '<name>' hold the generation in use, each generation live in '<name>.<gen>'.
+ * the nodes point to each other as usual, so a segment is best mapped at the
+ * address it was built at, then its pages are shared by every worker. the
+ * generations take turns between two slots far from where the system put mappings
+ * by itself, a newer one is mapped while the older one is still in use.
+ * where the range is taken in a worker, the segment is mapped private anywhere
+ * and xml_compact_move make its pointers follow, the pages it touch are then the
+ * worker's own. the master build where its slot is free, or wherever it can.
+ * the hashes are taken before publishing and a typed read never cache into a
+ * compacted tree, a worker never write into a shared segment.
+ *
+ * the slots are at XML_SHM_BASE and XML_SHM_BASE + XML_SHM_SLOT unless the master
+ * call xml_shm_set_base first. a worker try where the master built, whatever its
+ * own setting. on a 32 bit target the address space is small and crowded, the
+ * default slots there are only 256M and a tree bigger than a slot isn't published.
+ */
+
+#ifndef XML_SHM_BASE
+#if SIZE_MAX > 0xffffffffu
+#define	XML_SHM_BASE	0x3c0000000000ULL
+#else
+#define	XML_SHM_BASE	0x60000000ULL
+#endif
+#endif
+#ifndef XML_SHM_SLOT
+#if SIZE_MAX > 0xffffffffu
+#define	XML_SHM_SLOT	0x10000000000ULL
+#else
+#define	XML_SHM_SLOT	0x10000000ULL
+#endif
+#endif
+
+#define	XML_SHM_MAGIC	0x786d6c73
+#define	XML_SHM_RETRY	8
+
+struct xml_shm_ctl {
+	std::atomic<unsigned long long>	gen;
+};
+
+struct xml_shm_head {
+	unsigned int		magic;
+	unsigned long long	gen;
+	void			*addr;
+	size_t			size;
+	struct xml_element	*tree;
+};
+
+struct xml_shm {
+	char			*name;
+	struct xml_shm_ctl	*ctl;
+	struct xml_shm_head	*head;
+};
+
+#define	XML_SHM_HEAD	((sizeof(struct xml_shm_head) + 7) & ~(size_t)7)
+
+//set once by the master before it publish
+static unsigned long long shm_base = XML_SHM_BASE;
+static unsigned long long shm_size = XML_SHM_SLOT;
+
+static void shm_name(char *buff, size_t size, const char *name, unsigned long long gen)
+{
+	snprintf(buff, size, "%s.%llu", name, gen);
+}
+
+static void *shm_slot(unsigned long long gen)
+{
+	return (void *)(size_t)(shm_base + (gen & 1) * shm_size);
+}
+
+/* the two slots become [base, base + slot) and [base + slot, base + 2 * slot), both page
+ * aligned and within the address space, or -1. a tree bigger than 'slot' can't be published
+ */
+int xml_shm_set_base(unsigned long long base, unsigned long long slot)
+{
+	unsigned long long page;
+
+	page = (unsigned long long)sysconf(_SC_PAGESIZE);
+	if (base == 0 || slot == 0 || base % page || slot % page)
+		return -1;
+
+	if (slot > (unsigned long long)SIZE_MAX / 2 || base > (unsigned long long)SIZE_MAX - 2 * slot)
+		return -1;
+
+	shm_base = base;
+	shm_size = slot;
+
+	return 0;
+}
+
+//the control segment, made on the first publish
+static struct xml_shm_ctl *ctl_map(const char *name, int create)
+{
+	int fd;
+	void *p;
+
+	fd = shm_open(name, create ? O_RDWR | O_CREAT : O_RDONLY, 0644);
+	if (fd == -1)
+		return NULL;
+
+	if (create && ftruncate(fd, sizeof(struct xml_shm_ctl)) == -1) {
+		close(fd);
+		return NULL;
+	}
+
+	p = mmap(NULL, sizeof(struct xml_shm_ctl), create ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	return p == MAP_FAILED ? NULL : (struct xml_shm_ctl *)p;
+}
+
+/* shared where it was built when the range is free here too, MAP_FIXED would replace what
+ * is there so it is only a hint. else a private copy anywhere, moved to where it landed
+ */
+static struct xml_shm_head *seg_place(int fd, const struct xml_shm_head *h)
+{
+	void *p;
+	struct xml_shm_head *head;
+
+	p = mmap(h->addr, h->size, PROT_READ, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED)
+		return NULL;
+
+	if (p == h->addr)
+		return (struct xml_shm_head *)p;
+
+	munmap(p, h->size);
+	p = mmap(NULL, h->size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	if (p == MAP_FAILED)
+		return NULL;
+
+	head = (struct xml_shm_head *)p;
+	head->tree = xml_compact_move((char *)p + XML_SHM_HEAD, (const char *)h->addr + XML_SHM_HEAD, h->tree);
+	head->addr = p;
+	mprotect(p, h->size, PROT_READ);
+
+	return head;
+}
+
+//one generation read only, NULL when it is gone
+static struct xml_shm_head *seg_open(const char *name, unsigned long long gen)
+{
+	int fd;
+	char seg[256];
+	struct xml_shm_head h;
+	struct xml_shm_head *head;
+
+	shm_name(seg, sizeof(seg), name, gen);
+	fd = shm_open(seg, O_RDONLY, 0);
+	if (fd == -1)
+		return NULL;
+
+	head = NULL;
+	if (pread(fd, &h, sizeof(h), 0) == (ssize_t)sizeof(h) && h.magic == XML_SHM_MAGIC && h.gen == gen)
+		head = seg_place(fd, &h);
+
+	close(fd);
+
+	return head;
+}
+
+int xml_shm_publish(const char *name, const struct xml_element *tree)
+{
+	int fd;
+	size_t size;
+	char seg[256];
+	unsigned long long gen;
+	const struct xml_element *elm;
+	struct xml_shm_ctl *ctl;
+	struct xml_shm_head *head;
+
+	assert(name);
+	assert(tree);
+
+	ctl = ctl_map(name, 1);
+	if (ctl == NULL)
+		return -1;
+
+	gen = ctl->gen.load() + 1;
+	shm_name(seg, sizeof(seg), name, gen);
+	size = XML_SHM_HEAD + xml_compact_size(tree);
+	if (size > shm_size)
+		goto err;
+
+	fd = shm_open(seg, O_RDWR | O_CREAT | O_EXCL, 0644);
+	if (fd == -1)
+		goto err;
+
+	if (ftruncate(fd, size) == -1) {
+		close(fd);
+		goto unlink;
+	}
+
+	//the slot is a hint, a worker move the tree when it can't have the same range
+	head = (struct xml_shm_head *)mmap(shm_slot(gen), size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (head == MAP_FAILED)
+		goto unlink;
+
+	head->magic = XML_SHM_MAGIC;
+	head->gen = gen;
+	head->addr = head;
+	head->size = size;
+	head->tree = xml_compact_to(tree, (char *)head + XML_SHM_HEAD, size - XML_SHM_HEAD);
+	if (head->tree == NULL) {
+		munmap(head, size);
+		goto unlink;
+	}
+
+	for (elm = head->tree; elm; elm = xml_walknext(elm))
+		xml_hash(elm);
+
+	munmap(head, size);
+
+	//the segment is complete before anyone can see its generation
+	ctl->gen.store(gen);
+
+	//who still map the old one keep it until they unmap it
+	if (gen > 1) {
+		shm_name(seg, sizeof(seg), name, gen - 1);
+		shm_unlink(seg);
+	}
+
+	munmap(ctl, sizeof(*ctl));
+
+	return 0;
+unlink:
+	shm_unlink(seg);
+err:
+	munmap(ctl, sizeof(*ctl));
+	return -1;
+}
+
+int xml_shm_remove(const char *name)
+{
+	char seg[256];
+	unsigned long long gen;
+	struct xml_shm_ctl *ctl;
+
+	assert(name);
+
+	ctl = ctl_map(name, 0);
+	if (ctl == NULL)
+		return -1;
+
+	gen = ctl->gen.load();
+	munmap(ctl, sizeof(*ctl));
+
+	if (gen) {
+		shm_name(seg, sizeof(seg), name, gen);
+		shm_unlink(seg);
+	}
+
+	return shm_unlink(name);
+}
+
+//the segment of the generation in use, it may be gone already when a new one came meanwhile
+static struct xml_shm_head *seg_map(struct xml_shm *shm)
+{
+	int i;
+	unsigned long long gen;
+	struct xml_shm_head *head;
+
+	for (i = 0; i < XML_SHM_RETRY; i++) {
+		gen = shm->ctl->gen.load();
+		if (gen == 0)
+			return NULL;
+
+		head = seg_open(shm->name, gen);
+		if (head)
+			return head;
+	}
+
+	return NULL;
+}
+
+struct xml_shm *xml_shm_open(const char *name)
+{
+	struct xml_shm *shm;
+
+	assert(name);
+
+	shm = (struct xml_shm *)calloc(1, sizeof(*shm));
+	if (shm == NULL)
+		return NULL;
+
+	shm->name = strdup(name);
+	shm->ctl = ctl_map(name, 0);
+	if (shm->name == NULL || shm->ctl == NULL) {
+		xml_shm_close(shm);
+		return NULL;
+	}
+
+	shm->head = seg_map(shm);
+	if (shm->head == NULL) {
+		xml_shm_close(shm);
+		return NULL;
+	}
+
+	return shm;
+}
+
+/* 1 when a newer generation took the place of the old one, whose nodes are all gone then.
+ * after -1 the old tree is still there. two generations ahead the new one want the slot
+ * of the old, it is moved instead of letting the old go first
+ */
+int xml_shm_refresh(struct xml_shm *shm)
+{
+	struct xml_shm_head *head;
+
+	assert(shm);
+
+	if (shm->head && shm->ctl->gen.load() == shm->head->gen)
+		return 0;
+
+	head = seg_map(shm);
+	if (head == NULL)
+		return -1;
+
+	if (shm->head)
+		munmap(shm->head, shm->head->size);
+	shm->head = head;
+
+	return 1;
+}
+
+const struct xml_element *xml_shm_tree(const struct xml_shm *shm)
+{
+	assert(shm);
+
+	return shm->head ? shm->head->tree : NULL;
+}
+
+unsigned long long xml_shm_gen(const struct xml_shm *shm)
+{
+	assert(shm);
+
+	return shm->head ? shm->head->gen : 0;
+}
+
+int xml_shm_close(struct xml_shm *shm)
+{
+	assert(shm);
+
+	if (shm->head)
+		munmap(shm->head, shm->head->size);
+	if (shm->ctl)
+		munmap(shm->ctl, sizeof(*shm->ctl));
+	if (shm->name)
+		free(shm->name);
+
+	free(shm);
+
+	return 0;
+}
@@ -0,0 +1,17 @@
+#ifndef _XML_SHM_H
+#define	_XML_SHM_H
+
+struct xml_element;
+struct xml_shm;
+
+int xml_shm_set_base(unsigned long long base, unsigned long long slot);
+int xml_shm_publish(const char *name, const struct xml_element *tree);
+int xml_shm_remove(const char *name);
+
+struct xml_shm *xml_shm_open(const char *name);
+int xml_shm_refresh(struct xml_shm *shm);
+const struct xml_element *xml_shm_tree(const struct xml_shm *shm);
+unsigned long long xml_shm_gen(const struct xml_shm *shm);
+int xml_shm_close(struct xml_shm *shm);
+
+#endif // !_XML_SHM_H
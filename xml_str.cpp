@@ -1,4 +1,10 @@
 #include <assert.h>
+#include <errno.h>
+#include <math.h>
+#include <limits.h>
+#include <locale.h>
+#include <wchar.h>
+#include <stdlib.h>
 #include "xml_str.h"
 
 int str_issapce(wchar_t ch)
@@ -12,7 +18,7 @@ const wchar_t *skip_space(const wchar_t *data, const wchar_t *data_end)
 	assert(data);
 	assert(data_end);
 
-	while (str_issapce(*data) && data < data_end)
+	while (data < data_end && str_issapce(*data))
 		data++;
 
 	return data;
@@ -20,13 +26,13 @@ const wchar_t *skip_space(const wchar_t *data, const wchar_t *data_end)
 
 const wchar_t *str_forward(const wchar_t *data, const wchar_t *data_end, int ch)
 {
-        while (*data != ch && data < data_end)
+        while (data < data_end && *data != ch)
                 data++;
 
         return data;
 }
 
-int strlen_t(const wchar_t *c, const wchar_t *end, const wchar_t *termi)
+size_t strlen_t(const wchar_t *c, const wchar_t *end, const wchar_t *termi)
 {
 	const wchar_t *t;
 	const wchar_t *org;
@@ -49,9 +55,13 @@ end:
 	return c - org;
 }
 
-int strcpy_t(wchar_t *c, const wchar_t *src, const wchar_t *termi)
+//how many chars were copied, the 0 behind them left out
+size_t strcpy_t(wchar_t *c, const wchar_t *src, const wchar_t *termi)
 {
 	const wchar_t *t;
+	const wchar_t *begin;
+
+	begin = src;
 	while ((void) 0, 1) {
 		t = termi;
 		while (*t != 0) {
@@ -64,19 +74,334 @@ int strcpy_t(wchar_t *c, const wchar_t *src, const wchar_t *termi)
 end:
 	*c = 0;
 
-	return 0;
+	return src - begin;
 }
 
-int str_count(const wchar_t *src, const wchar_t *end, int ch, int term1, int term2)
+size_t str_count(const wchar_t *src, const wchar_t *end, int ch, int term1, int term2)
 {
-	int cnt;
+	size_t cnt;
 
 	cnt = 0;
-	while (*src != term1 && *src != term2 && src < end) {
+	//the bound first, the input need not end with a 0
+	while (src < end && *src != term1 && *src != term2) {
 		if (*src == ch)
 			cnt++;
 		src++;
 	}
 
 	return cnt;
-}
\ No newline at end of file
+}
+
+/* the conversions below allow spaces around the text, they return 0, -1 on bad text, or -2 when out of range */
+
+static const wchar_t *str_trim(const wchar_t *s, size_t *len)
+{
+	const wchar_t *end;
+
+	end = s + *len;
+	while (s < end && str_issapce(*s))
+		s++;
+
+	while (end > s && str_issapce(end[-1]))
+		end--;
+
+	*len = end - s;
+
+	return s;
+}
+
+static int str_digit(wchar_t ch)
+{
+	return ch >= L'0' && ch <= L'9';
+}
+
+static int str_unsigned(const wchar_t *s, size_t len, unsigned long long *v, int *neg)
+{
+	int d;
+	int over;
+	const wchar_t *end;
+	unsigned long long u;
+
+	s = str_trim(s, &len);
+	end = s + len;
+
+	*neg = 0;
+	if (s < end && (*s == L'-' || *s == L'+')) {
+		*neg = *s == L'-';
+		s++;
+	}
+
+	if (s == end)
+		return -1;
+
+	u = 0;
+	over = 0;
+	for (; s < end; s++) {
+		if (!str_digit(*s))
+			return -1;
+
+		d = *s - L'0';
+		if (u > (ULLONG_MAX - d) / 10)
+			over = 1;
+		u = u * 10 + d;
+	}
+
+	*v = u;
+
+	return over ? -2 : 0;
+}
+
+int str_toi64_n(const wchar_t *s, size_t len, long long *v)
+{
+	int err;
+	int neg;
+	unsigned long long u;
+
+	err = str_unsigned(s, len, &u, &neg);
+	if (err)
+		return err;
+
+	if (u > (unsigned long long)LLONG_MAX + neg)
+		return -2;
+
+	if (neg)
+		*v = u ? -(long long)(u - 1) - 1 : 0;
+	else
+		*v = (long long)u;
+
+	return 0;
+}
+
+int str_tou64_n(const wchar_t *s, size_t len, unsigned long long *v)
+{
+	int err;
+	int neg;
+	unsigned long long u;
+
+	err = str_unsigned(s, len, &u, &neg);
+	if (err)
+		return err;
+
+	if (neg && u)
+		return -2;
+
+	*v = u;
+
+	return 0;
+}
+
+static const double str_pow10[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+/* wcstod take the decimal point of the process locale, here it is always read in "C".
+ * 0, -1 when there is no such locale, or -2 when out of range
+ */
+static int str_wcstod_c(const wchar_t *s, double *d)
+{
+	int saved;
+	int over;
+#ifdef _WIN32
+	static _locale_t loc = _create_locale(LC_NUMERIC, "C");
+
+	if (loc == NULL)
+		return -1;
+
+	saved = errno;
+	errno = 0;
+	*d = _wcstod_l(s, NULL, loc);
+#else
+	locale_t old;
+	static locale_t loc = newlocale(LC_NUMERIC_MASK, "C", (locale_t)0);
+
+	if (loc == (locale_t)0)
+		return -1;
+
+	//only the calling thread is switched
+	old = uselocale(loc);
+	saved = errno;
+	errno = 0;
+	*d = wcstod(s, NULL);
+#endif
+	over = errno == ERANGE && (*d == HUGE_VAL || *d == -HUGE_VAL);
+	errno = saved;
+#ifndef _WIN32
+	uselocale(old);
+#endif
+
+	return over ? -2 : 0;
+}
+
+/* a mantissa within 2^53 times an exact power of 10 is rounded only once, the rest go to wcstod */
+int str_todouble_n(const wchar_t *s, size_t len, double *v)
+{
+	int e;
+	int neg;
+	int eneg;
+	int exp;
+	int cnt;
+	int err;
+	int digits;
+	int dropped;
+	double d;
+	wchar_t *copy;
+	wchar_t buff[64];
+	unsigned long long m;
+	const wchar_t *p;
+	const wchar_t *end;
+	const wchar_t *begin;
+
+	begin = str_trim(s, &len);
+	end = begin + len;
+	p = begin;
+
+	neg = 0;
+	if (p < end && (*p == L'-' || *p == L'+')) {
+		neg = *p == L'-';
+		p++;
+	}
+
+	//the special values of xml schema
+	if (end - p == 3 && wcsncmp(p, L"INF", 3) == 0) {
+		*v = neg ? -HUGE_VAL : HUGE_VAL;
+		return 0;
+	}
+	if (p == begin && len == 3 && wcsncmp(p, L"NaN", 3) == 0) {
+		*v = NAN;
+		return 0;
+	}
+
+	m = 0;
+	exp = 0;
+	cnt = 0;
+	digits = 0;
+	dropped = 0;
+	for (; p < end && str_digit(*p); p++, cnt++) {
+		if (digits < 19) {
+			m = m * 10 + (*p - L'0');
+			digits += m != 0;
+		} else {
+			exp++;
+			dropped |= *p != L'0';
+		}
+	}
+
+	if (p < end && *p == L'.') {
+		for (p++; p < end && str_digit(*p); p++, cnt++) {
+			if (digits < 19) {
+				m = m * 10 + (*p - L'0');
+				digits += m != 0;
+				exp--;
+			} else {
+				dropped |= *p != L'0';
+			}
+		}
+	}
+
+	if (cnt == 0)
+		return -1;
+
+	if (p < end && (*p == L'e' || *p == L'E')) {
+		p++;
+		eneg = 0;
+		if (p < end && (*p == L'-' || *p == L'+')) {
+			eneg = *p == L'-';
+			p++;
+		}
+
+		if (p == end)
+			return -1;
+
+		for (e = 0; p < end && str_digit(*p); p++) {
+			if (e < 100000)
+				e = e * 10 + (*p - L'0');
+		}
+
+		exp += eneg ? -e : e;
+	}
+
+	if (p != end)
+		return -1;
+
+	if (!dropped && m <= (1ULL << 53) && exp >= -22 && exp <= 22) {
+		d = (double)m;
+		d = exp < 0 ? d / str_pow10[-exp] : d * str_pow10[exp];
+		*v = neg ? -d : d;
+		return 0;
+	}
+
+	//the text is checked already, it only need a terminator for wcstod
+	copy = len < sizeof(buff) / sizeof(buff[0]) ? buff : (wchar_t *)malloc((len + 1) * sizeof(wchar_t));
+	if (copy == NULL)
+		return -1;
+
+	wmemcpy(copy, begin, len);
+	copy[len] = 0;
+
+	err = str_wcstod_c(copy, &d);
+
+	if (copy != buff)
+		free(copy);
+
+	if (err)
+		return err;
+
+	*v = d;
+
+	return 0;
+}
+
+int str_tobool_n(const wchar_t *s, size_t len, int *v)
+{
+	s = str_trim(s, &len);
+	if ((len == 4 && wcsncmp(s, L"true", 4) == 0) || (len == 1 && *s == L'1'))
+		*v = 1;
+	else if ((len == 5 && wcsncmp(s, L"false", 5) == 0) || (len == 1 && *s == L'0'))
+		*v = 0;
+	else
+		return -1;
+
+	return 0;
+}
+
+/* '*v' is the index of the match in 'table' */
+int str_toenum_n(const wchar_t *s, size_t len, const wchar_t **table, int cnt, int *v)
+{
+	int i;
+
+	s = str_trim(s, &len);
+	for (i = 0; i < cnt; i++) {
+		if (wcsncmp(s, table[i], len) == 0 && table[i][len] == 0) {
+			*v = i;
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+int str_toi64(const wchar_t *s, long long *v)
+{
+	return str_toi64_n(s, wcslen(s), v);
+}
+
+int str_tou64(const wchar_t *s, unsigned long long *v)
+{
+	return str_tou64_n(s, wcslen(s), v);
+}
+
+int str_todouble(const wchar_t *s, double *v)
+{
+	return str_todouble_n(s, wcslen(s), v);
+}
+
+int str_tobool(const wchar_t *s, int *v)
+{
+	return str_tobool_n(s, wcslen(s), v);
+}
+
+int str_toenum(const wchar_t *s, const wchar_t **table, int cnt, int *v)
+{
+	return str_toenum_n(s, wcslen(s), table, cnt, v);
+}
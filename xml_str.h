@@ -1,12 +1,25 @@
 #ifndef _XML_STR_H
 #define	_XML_STR_H
 
+#include <stddef.h>
+
 const wchar_t *skip_space(const wchar_t *data, const wchar_t *data_end);
 int str_issapce(wchar_t ch);
 const wchar_t *str_forward(const wchar_t *data, const wchar_t *data_end, int ch);
-int strlen_t(const wchar_t *c, const wchar_t *end, const wchar_t *termi);
-int strcpy_t(wchar_t *c, const wchar_t *src, const wchar_t *termi);
-int str_count(const wchar_t *src, const wchar_t *end, int ch, int term1, int term2);
+size_t strlen_t(const wchar_t *c, const wchar_t *end, const wchar_t *termi);
+size_t strcpy_t(wchar_t *c, const wchar_t *src, const wchar_t *termi);
+size_t str_count(const wchar_t *src, const wchar_t *end, int ch, int term1, int term2);
+
+int str_toi64(const wchar_t *s, long long *v);
+int str_tou64(const wchar_t *s, unsigned long long *v);
+int str_todouble(const wchar_t *s, double *v);
+int str_tobool(const wchar_t *s, int *v);
+int str_toenum(const wchar_t *s, const wchar_t **table, int cnt, int *v);
+int str_toi64_n(const wchar_t *s, size_t len, long long *v);
+int str_tou64_n(const wchar_t *s, size_t len, unsigned long long *v);
+int str_todouble_n(const wchar_t *s, size_t len, double *v);
+int str_tobool_n(const wchar_t *s, size_t len, int *v);
+int str_toenum_n(const wchar_t *s, size_t len, const wchar_t **table, int cnt, int *v);
 
 
 #endif // !_XML_ASSIST_H
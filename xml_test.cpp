@@ -1,13 +1,1901 @@
 // xml_test.cpp : Defines the entry point for the console application.
 //
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+#include <chrono>
+#include <thread>
+#ifdef XML_WITH_ZLIB
+#include <zlib.h>
+#endif
+#ifdef XML_WITH_SHM
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#endif
 #include "xml.h"
+#include "xml.hpp"
+#include "xml_cache.h"
+#ifdef XML_WITH_SHM
+#include "xml_shm.h"
+#endif
+#include "xml_core.hpp"
+#include "xml_test_gen.h"
 
-int main(int argc, char* argv[])
+#define	TEST_FILE	"xml_test.xml"
+#define	TEST_FILE_W	L"xml_test.xml"
+#define	TEST_FILE_GZ	"xml_test.xml.gz"
+#define	TEST_FILE_GZ_W	L"xml_test.xml.gz"
+#define	TEST_CORE_DOC	300
+#define	TEST_CORE_LEN	(64 * 1024)
+#define	TEST_INDEX_DOC	100
+#define	TEST_MANY	24
+#define	TEST_PIPE_DOC	20
+#define	TEST_GEN_DOC	50
+#define	TEST_GEN_LEN	(16 * 1024)
+#define	TEST_DEEP	20000
+#define	TEST_BUILD_DOC	50
+#define	TEST_COMPACT_DOC	50
+#define	TEST_CACHE_FILE	3
+#define	TEST_SHM_NAME	"/xml_test_shm"
+#define	TEST_SHM_BASE	0x50000000ULL
+#define	TEST_SHM_SLOT	(16 * 1024 * 1024ULL)
+//'xml big <bytes>' run test_big alone, past 4G it need about twice as much memory
+#define	TEST_BIG_SIZE	(16 * 1024 * 1024)
+#define	TEST_BIG_VALUE	(64 * 1024)
+#define	TEST_BIG_CHUNK	(64 * 1024)
+
+//the file is written as the loader read it, a BOM then our wchar_t
+static int write_file(const char *path, const wchar_t *doc)
 {
-	
-	xml_load_file(L"E:\\config_file.xml");
+	FILE *fp;
+	wchar_t bom;
+
+	fp = fopen(path, "wb");
+	if (fp == NULL)
+		return -1;
+
+	bom = 0xfeff;
+	fwrite(&bom, sizeof(bom), 1, fp);
+	fwrite(doc, sizeof(wchar_t), wcslen(doc), fp);
+	fclose(fp);
 
 	return 0;
 }
 
+static int write_doc(const wchar_t *doc)
+{
+	return write_file(TEST_FILE, doc);
+}
+
+/* reload 'tree' from 'doc' and check it against a load from scratch */
+static int reload_check(struct xml_element **tree, const wchar_t *doc)
+{
+	int ret;
+	struct xml_element *fresh;
+
+	if (write_doc(doc))
+		return -1;
+
+	//on a failure '*tree' is still ours
+	fresh = xml_reload_file(*tree, TEST_FILE_W);
+	if (fresh == NULL)
+		return -1;
+
+	*tree = fresh;
+	fresh = xml_load_file(TEST_FILE_W);
+	if (fresh == NULL)
+		return -1;
+
+	ret = xml_equal(*tree, fresh) ? 0 : -1;
+	xml_free_all(fresh);
+
+	return ret;
+}
+
+static int test_reload(void)
+{
+	int i;
+	int err;
+	struct xml_element *tree;
+	struct xml_element *last;
+	static const wchar_t *edit[] = {
+		//the brothers change places and one lose its attribute
+		L"<?xml version=\"1.0\"?>\r\n<r>\r\n<e1 k=\"7\">v9</e1>\r\n<e0/>\r\n<e1 k=\"5\"/>\r\n</r>\r\n",
+		//a value only
+		L"<?xml version=\"1.0\"?>\r\n<r>\r\n<e1 k=\"7\">v10</e1>\r\n<e0/>\r\n<e1 k=\"5\"/>\r\n</r>\r\n",
+		//the edit close the parent and open it again, the region can't be parsed alone
+		L"<?xml version=\"1.0\"?>\r\n<r>\r\n<e1 k=\"7\">v10</e1>\r\n</r><r><e0/>\r\n<e1 k=\"5\"/>\r\n</r>\r\n",
+		L"<?xml version=\"1.0\"?>\r\n<r>\r\n<e1>\r\n<!--c-->\r\n</e1>\r\n</r>\r\n",
+		L"<?xml version=\"1.0\"?>\r\n<r>\r\n<e1>\r\n</e1><e1>\r\n<!--c-->\r\n</e1>\r\n</r>\r\n",
+		//a tag with attributes right at the end of the region
+		L"<?xml version=\"1.0\"?>\r\n<r>\r\n<e1>\r\n</e1><e1 k=\"1\"/><e2/></r>\r\n",
+		//the top level itself
+		L"<?xml version=\"1.0\"?>\r\n<s>\r\n<e1 k=\"1\"/><e2/></s>\r\n",
+	};
+
+	if (write_doc(L"<?xml version=\"1.0\"?>\r\n<r>\r\n<e0 k=\"8\"/>\r\n<e1 k=\"7\">\r\n</e1>\r\n</r>\r\n"))
+		return -1;
+
+	tree = xml_load_file_track(TEST_FILE_W, XML_TRACK_RANGE);
+	if (tree == NULL)
+		return -1;
+
+	err = 0;
+	for (i = 0; i < (int)(sizeof(edit) / sizeof(edit[0])) && err == 0; i++) {
+		err = reload_check(&tree, edit[i]);
+		if (err)
+			fprintf(stderr, "reload: edit %d\n", i);
+	}
+
+	//a file that can't be parsed or read give NULL and leave the tree as it was
+	last = err ? NULL : xml_load_file(TEST_FILE_W);
+	if (last) {
+		if (write_doc(L"<?xml version=\"1.0\"?>\r\n<s>\r\n<e1 k=\"1\"><e2/></s>\r\n") ||
+			xml_reload_file(tree, TEST_FILE_W) != NULL || !xml_equal(tree, last))
+			err = -1;
+
+		remove(TEST_FILE);
+		if (xml_reload_file(tree, TEST_FILE_W) != NULL || !xml_equal(tree, last))
+			err = -1;
+
+		if (err)
+			fprintf(stderr, "reload: a failed reload changed the tree\n");
+		xml_free_all(last);
+	}
+
+	xml_free_all(tree);
+	remove(TEST_FILE);
+
+	return err;
+}
+
+template <typename CharT>
+static int core_str(const wchar_t *a, size_t a_len, const CharT *b, size_t b_len)
+{
+	size_t i;
+
+	if (a_len != b_len)
+		return 0;
+
+	for (i = 0; i < a_len; i++) {
+		if ((unsigned long)a[i] != (unsigned long)b[i])
+			return 0;
+	}
+
+	return 1;
+}
+
+//'/>' with attributes give XML_ELEMENT in xml.cpp, see xml_core.hpp
+template <typename CharT>
+static int core_same(const struct xml_element *e, const xml::core_node<CharT> *n)
+{
+	int i;
+
+	for (; e && n; e = xml_walknext(e), n = n->next) {
+		if (xml_get_type(e) != n->type && (xml_get_type(e) != XML_ELEMENT || n->type != XML_ELEMENT_SELF ||
+			xml_walkdown(e) || xml_get_value(e)))
+			return 0;
+		if (!core_str(xml_get_name(e), xml_get_name_len(e), n->name, n->name_len))
+			return 0;
+		if ((xml_get_value(e) == NULL) != (n->value == NULL) ||
+			(n->value && !core_str(xml_get_value(e), xml_get_value_len(e), n->value, n->value_len)))
+			return 0;
+		if (xml_get_attr_cnt(e) != (int)n->attr_cnt)
+			return 0;
+		for (i = 0; i < xml_get_attr_cnt(e); i++) {
+			if (!core_str(xml_get_attr_name(e, i), xml_get_attr_name_len(e, i), n->attr[i].name, n->attr[i].name_len) ||
+				!core_str(xml_get_attr_value(e, i), xml_get_attr_value_len(e, i), n->attr[i].value, n->attr[i].value_len))
+				return 0;
+		}
+		if (!core_same(xml_walkdown(e), n->child))
+			return 0;
+	}
+
+	return e == NULL && n == NULL;
+}
+
+/* parse 'doc' with xml.cpp and with xml_core.hpp, for wchar_t and for char. return 0 when all
+ * give the same tree, 1 when all refuse it and -1 when they don't agree
+ */
+static int core_check(const wchar_t *doc)
+{
+	int ret;
+	size_t i;
+	size_t len;
+	char *narrow;
+	struct xml_element *tree;
+	xml::core_doc<wchar_t> wide_doc;
+	xml::core_doc<char, xml::policy<true, false, false> > narrow_doc;
+
+	if (write_doc(doc))
+		return -1;
+
+	len = wcslen(doc);
+	narrow = new char[len + 1];
+	for (i = 0; i < len; i++)
+		narrow[i] = (char)doc[i];
+
+	tree = xml_load_file(TEST_FILE_W);
+	ret = 0;
+	if (wide_doc.parse(doc, len) != (tree ? 0 : -1) || (tree && !core_same(tree, wide_doc.root())))
+		ret = -1;
+	if (narrow_doc.parse(narrow, len) != (tree ? 0 : -1) || (tree && !core_same(tree, narrow_doc.root())))
+		ret = -1;
+
+	if (ret == 0 && tree == NULL)
+		ret = 1;
+
+	xml_free_all(tree);
+	delete[] narrow;
+
+	return ret;
+}
+
+static unsigned int core_rand(unsigned int *seed)
+{
+	*seed = *seed * 1103515245 + 12345;
+
+	return (*seed >> 16) & 0x7fff;
+}
+
+//an element at 'p' made of what both parsers take, return how long it is
+static size_t core_gen(wchar_t *p, size_t left, unsigned int *seed, int depth)
+{
+	int i;
+	int n;
+	size_t len;
+	const wchar_t *tag;
+	static const wchar_t *name[] = {L"a", L"item", L"x:y", L"node_1"};
+	static const wchar_t *space[] = {L"", L" ", L"\r\n", L"\r\n\t\t"};
+
+	if (left < 1024)
+		return 0;
+
+	tag = name[core_rand(seed) % 4];
+	len = swprintf(p, left, L"%ls<%ls", space[core_rand(seed) % 4], tag);
+	n = core_rand(seed) % 4;
+	for (i = 0; i < n; i++)
+		len += swprintf(p + len, left - len, L" k%d=\"%u\"", i, core_rand(seed));
+
+	switch (depth > 4 ? 0 : core_rand(seed) % 4) {
+	case 0:
+		len += swprintf(p + len, left - len, L"/>");
+		break;
+	case 1:
+		len += swprintf(p + len, left - len, L">v %u</%ls>", core_rand(seed), tag);
+		break;
+	default:
+		len += swprintf(p + len, left - len, L">");
+		n = core_rand(seed) % 4;
+		for (i = 0; i < n; i++) {
+			if (core_rand(seed) % 5 == 0)
+				len += swprintf(p + len, left - len, L"<!--c%u-->", core_rand(seed));
+			else if (core_rand(seed) % 7 == 0)
+				len += swprintf(p + len, left - len, L"<?pi k=\"1\"?>");
+			else
+				len += core_gen(p + len, left - len, seed, depth + 1);
+		}
+		len += swprintf(p + len, left - len, L"%ls</%ls>", space[core_rand(seed) % 4], tag);
+		break;
+	}
+
+	return len;
+}
+
+static int test_core(void)
+{
+	int i;
+	int err;
+	size_t len;
+	unsigned int seed;
+	wchar_t *doc;
+	static const wchar_t *good[] = {
+		L"<a/>",
+		L"<a> t </a>",
+		L"<?xml version=\"1.0\"?>\r\n<a k=\"1\" j=\"2\"><b/><c>x</c></a>\r\n",
+		L"<a><?pi x=\"1\"?><b/></a>",
+		L"<?xml version=\"1.0\"?><a/><?pi?>",
+		L"<!--top--><a/><b/>",
+		L"<a>x</a>tail",
+	};
+	static const wchar_t *bad[] = {
+		L"<a k='1'/>",
+		L"<a>text<b/></a>",
+		L"<a><b/>text</a>",
+		L"<a k=\"1/>",
+	};
+
+	err = 0;
+	for (i = 0; i < (int)(sizeof(good) / sizeof(good[0])); i++) {
+		if (core_check(good[i]) != 0) {
+			fprintf(stderr, "core: good doc %d\n", i);
+			err = -1;
+		}
+	}
+
+	for (i = 0; i < (int)(sizeof(bad) / sizeof(bad[0])); i++) {
+		if (core_check(bad[i]) != 1) {
+			fprintf(stderr, "core: bad doc %d\n", i);
+			err = -1;
+		}
+	}
+
+	doc = new wchar_t[TEST_CORE_LEN];
+	seed = 1;
+	for (i = 0; i < TEST_CORE_DOC && err == 0; i++) {
+		len = 0;
+		if (core_rand(&seed) % 2)
+			len = swprintf(doc, TEST_CORE_LEN, L"<?xml version=\"1.0\"?>");
+		len += core_gen(doc + len, TEST_CORE_LEN - len, &seed, 0);
+		if (core_check(doc) != 0) {
+			fprintf(stderr, "core: generated doc %d\n", i);
+			err = -1;
+		}
+	}
+
+	delete[] doc;
+	remove(TEST_FILE);
+
+	return err;
+}
+
+//the same tree from the two stage parse on one thread and on several, or NULL from both
+static int index_check(const wchar_t *doc)
+{
+	int t;
+	int err;
+	struct xml_element *a;
+	struct xml_element *b;
+	static const int thread[] = {1, 2, 5, 16};
+
+	if (write_doc(doc))
+		return -1;
+
+	err = 0;
+	a = xml_load_file(TEST_FILE_W);
+	for (t = 0; t < (int)(sizeof(thread) / sizeof(thread[0])); t++) {
+		b = xml_load_file_index(TEST_FILE_W, thread[t]);
+		if ((a == NULL) != (b == NULL) || (a && !xml_equal(a, b))) {
+			fprintf(stderr, "index: %d threads\n", thread[t]);
+			err = -1;
+		}
+		xml_free_all(b);
+	}
+
+	xml_free_all(a);
+
+	return err;
+}
+
+static int test_index(void)
+{
+	int i;
+	int k;
+	int n;
+	int err;
+	size_t len;
+	unsigned int seed;
+	wchar_t *doc;
+	const wchar_t *v;
+	struct xml_element *tree;
+	struct xml_element *child;
+	static const wchar_t *plain[] = {
+		L"<a/>",
+		L"<a> t </a>",
+		L"<?xml version=\"1.0\"?>\r\n<a k=\"1\" j=\"2\"><b/><c>x</c></a>\r\n",
+		L"<!--top--><a><b/><c/></a><d/>",
+		L"<a><b/>",
+		L"<a><b></a></b>",
+		L"<a k='1'/>",
+		L"<a k=\"1/>",
+		L"<a><b/>text</a>",
+	};
+
+	err = 0;
+	for (i = 0; i < (int)(sizeof(plain) / sizeof(plain[0])); i++) {
+		if (index_check(plain[i])) {
+			fprintf(stderr, "index: doc %d\n", i);
+			err = -1;
+		}
+	}
+
+	//the children of the document element are cut apart for the threads
+	doc = new wchar_t[TEST_CORE_LEN * 2];
+	seed = 48;
+	for (i = 0; i < TEST_INDEX_DOC && err == 0; i++) {
+		len = 0;
+		if (core_rand(&seed) % 2)
+			len = swprintf(doc, TEST_CORE_LEN, L"<?xml version=\"1.0\"?>\r\n");
+		len += swprintf(doc + len, TEST_CORE_LEN - len, L"<list n=\"%d\">", i);
+		n = core_rand(&seed) % 64;
+		for (k = 0; k < n && len < TEST_CORE_LEN; k++)
+			len += core_gen(doc + len, TEST_CORE_LEN * 2 - len, &seed, 1);
+		len += swprintf(doc + len, TEST_CORE_LEN * 2 - len, L"</list>%ls", core_rand(&seed) % 2 ? L"<!--end-->" : L"");
+		if (index_check(doc)) {
+			fprintf(stderr, "index: generated doc %d\n", i);
+			err = -1;
+		}
+	}
+
+	//a quoted '>' and the markup in a comment are text, the plain parse stop at them
+	if (write_doc(L"<a k=\"1>2\"><!--x<y>\"z--><b j=\"<\"/></a>")) {
+		delete[] doc;
+		return -1;
+	}
+
+	tree = xml_load_file_index(TEST_FILE_W, 1);
+	child = tree ? xml_walkdown(tree) : NULL;
+	v = tree ? xml_get_attr(tree, L"k") : NULL;
+	if (v == NULL || wcscmp(v, L"1>2") != 0 || child == NULL || xml_get_type(child) != XML_COMMENT ||
+		wcscmp(xml_get_name(child), L"x<y>\"z") != 0) {
+		fprintf(stderr, "index: masked markup\n");
+		err = -1;
+	}
+
+	child = child ? xml_walknext(child) : NULL;
+	v = child ? xml_get_attr(child, L"j") : NULL;
+	if (v == NULL || wcscmp(v, L"<") != 0) {
+		fprintf(stderr, "index: quoted '<'\n");
+		err = -1;
+	}
+
+	xml_free_all(tree);
+	delete[] doc;
+	remove(TEST_FILE);
+
+	return err;
+}
+
+static size_t big_put(FILE *fp, const wchar_t *s)
+{
+	return fwrite(s, sizeof(wchar_t), wcslen(s), fp);
+}
+
+//'cnt' chars of 'buff' against the file, from its BOM on
+static int big_compare(const wchar_t *buff, size_t cnt)
+{
+	int ret;
+	size_t n;
+	size_t off;
+	FILE *fp;
+	wchar_t *chunk;
+
+	fp = fopen(TEST_FILE, "rb");
+	chunk = new wchar_t[TEST_BIG_CHUNK];
+	ret = fp ? 0 : -1;
+	for (off = 0; ret == 0 && off < cnt; off += n) {
+		n = fread(chunk, sizeof(wchar_t), TEST_BIG_CHUNK, fp);
+		if (n == 0 || n > cnt - off || wmemcmp(chunk, buff + off, n) != 0)
+			ret = -1;
+	}
+
+	if (ret == 0 && fread(chunk, sizeof(wchar_t), 1, fp) != 0)
+		ret = -1;
+
+	delete[] chunk;
+	if (fp)
+		fclose(fp);
+
+	return ret;
+}
+
+/* a document of about 'size' bytes, written as xml_save_data write it, is loaded and saved
+ * with and without threads. both saves must give the file back
+ */
+static int test_big(unsigned long long size)
+{
+	int err;
+	size_t i;
+	size_t j;
+	size_t cnt;
+	size_t need;
+	ptrdiff_t len;
+	FILE *fp;
+	wchar_t *line;
+	wchar_t *buff;
+	struct xml_element *tree;
+
+	fp = fopen(TEST_FILE, "wb");
+	if (fp == NULL)
+		return -1;
+
+	line = new wchar_t[TEST_BIG_VALUE + 16];
+	cnt = big_put(fp, L"\xfeff");
+	cnt += big_put(fp, L"<r>\r\n");
+	for (i = 0; cnt * sizeof(wchar_t) < size; i++) {
+		wcscpy(line, L"\t<e>");
+		for (j = 0; j < TEST_BIG_VALUE; j++)
+			line[4 + j] = L'a' + (i * 7 + j) % 26;
+		wcscpy(line + 4 + j, L"</e>\r\n");
+		cnt += 4 + j + 6;
+		fwrite(line, sizeof(wchar_t), 4 + j + 6, fp);
+	}
+	cnt += big_put(fp, L"</r>\r\n");
+	delete[] line;
+	if (fclose(fp))
+		return -1;
+
+	tree = xml_load_file(TEST_FILE_W);
+	if (tree == NULL) {
+		remove(TEST_FILE);
+		return -1;
+	}
+
+	err = 0;
+	need = xml_need_len(tree);
+	buff = (wchar_t *)malloc((need + 1) * sizeof(wchar_t));
+	if (need < cnt || buff == NULL)
+		err = -1;
+
+	if (err == 0) {
+		len = xml_save_data(tree, buff, need + 1);
+		if (len != (ptrdiff_t)cnt || big_compare(buff, cnt))
+			err = -1;
+	}
+
+	if (err == 0) {
+		wmemset(buff, 0, need + 1);
+		len = xml_save_data_mt(tree, buff, need + 1, 2);
+		if (len != (ptrdiff_t)cnt || big_compare(buff, cnt))
+			err = -1;
+	}
+
+	if (err)
+		fprintf(stderr, "big: %llu bytes\n", size);
+
+	free(buff);
+	xml_free_all(tree);
+	remove(TEST_FILE);
+
+	return err;
+}
+
+/* generated documents read through the pipe in blocks of many sizes, a block may end inside a
+ * char. each must give the tree xml_load_file give
+ */
+static int test_pipe(void)
+{
+	int i;
+	int j;
+	int err;
+	size_t len;
+	unsigned int seed;
+	wchar_t *doc;
+	struct xml_element *tree;
+	struct xml_element *full;
+	static const int block[][2] = {{7, 2}, {64, 3}, {4096, 2}, {0, 0}};
+
+	doc = new wchar_t[TEST_CORE_LEN];
+	seed = 7;
+	err = 0;
+	for (i = 0; i < TEST_PIPE_DOC && err == 0; i++) {
+		len = swprintf(doc, TEST_CORE_LEN, L"<?xml version=\"1.0\"?>");
+		core_gen(doc + len, TEST_CORE_LEN - len, &seed, 0);
+		if (write_doc(doc)) {
+			err = -1;
+			break;
+		}
+
+		full = xml_load_file(TEST_FILE_W);
+		for (j = 0; j < (int)(sizeof(block) / sizeof(block[0])); j++) {
+			tree = xml_load_file_pipe(TEST_FILE_W, block[j][0], block[j][1]);
+			if (full == NULL || tree == NULL || !xml_equal(tree, full)) {
+				fprintf(stderr, "pipe: doc %d, blocks of %d\n", i, block[j][0]);
+				err = -1;
+			}
+
+			xml_free_all(tree);
+		}
+
+		xml_free_all(full);
+	}
+
+	delete[] doc;
+	remove(TEST_FILE);
+
+	return err;
+}
+
+#ifdef XML_WITH_ZLIB
+
+//'doc' as written by write_doc, in 'member' gzip members one after another
+static int write_gzip(const wchar_t *doc, int member)
+{
+	int i;
+	size_t len;
+	size_t part;
+	gzFile gz;
+	wchar_t bom;
+
+	len = wcslen(doc);
+	bom = 0xfeff;
+	for (i = 0; i < member; i++) {
+		gz = gzopen(TEST_FILE_GZ, i ? "ab" : "wb");
+		if (gz == NULL)
+			return -1;
+
+		if (i == 0)
+			gzwrite(gz, &bom, sizeof(bom));
+		part = len / member + (i == member - 1 ? len % member : 0);
+		gzwrite(gz, doc + len / member * i, (unsigned)(part * sizeof(wchar_t)));
+		if (gzclose(gz) != Z_OK)
+			return -1;
+	}
+
+	return 0;
+}
+
+/* a gzip file, one member or several, must load as the plain file through every loader. a cut
+ * one give nothing
+ */
+static int test_gzip(void)
+{
+	int i;
+	int err;
+	long size;
+	FILE *fp;
+	unsigned char gz[1024];
+	const wchar_t *path;
+	struct xml_element *tree[3];
+	struct xml_element *full;
+	static const wchar_t *doc = L"<?xml version=\"1.0\"?>\r\n<r k=\"1\">\r\n<e>v1</e>\r\n<e k=\"2\"><f/></e>\r\n</r>\r\n";
+
+	if (write_doc(doc))
+		return -1;
+
+	full = xml_load_file(TEST_FILE_W);
+	remove(TEST_FILE);
+	if (full == NULL)
+		return -1;
+
+	err = 0;
+	path = TEST_FILE_GZ_W;
+	for (i = 1; i <= 3 && err == 0; i += 2) {
+		if (write_gzip(doc, i)) {
+			err = -1;
+			break;
+		}
+
+		tree[0] = xml_load_file(path);
+		tree[1] = xml_load_file_pipe(path, 16, 2);
+		if (xml_load_many(&path, 1, &tree[2], 1) != 0)
+			tree[2] = NULL;
+
+		if (tree[0] == NULL || !xml_equal(tree[0], full) || tree[1] == NULL || !xml_equal(tree[1], full) ||
+			tree[2] == NULL || !xml_equal(tree[2], full)) {
+			fprintf(stderr, "gzip: %d members\n", i);
+			err = -1;
+		}
+
+		xml_free_all(tree[0]);
+		xml_free_all(tree[1]);
+		xml_free_all(tree[2]);
+	}
+
+	//the last 8 bytes hold the crc and the size, they are left out
+	size = 0;
+	fp = fopen(TEST_FILE_GZ, "rb");
+	if (fp) {
+		size = (long)fread(gz, 1, sizeof(gz), fp);
+		fclose(fp);
+	}
+
+	fp = err == 0 && size > 8 ? fopen(TEST_FILE_GZ, "wb") : NULL;
+	if (fp) {
+		fwrite(gz, 1, size - 8, fp);
+		fclose(fp);
+		if (xml_load_file(path) != NULL) {
+			fprintf(stderr, "gzip: a cut file\n");
+			err = -1;
+		}
+	}
+
+	remove(TEST_FILE_GZ);
+	xml_free_all(full);
+
+	return err;
+}
+
+#endif
+
+//'doc' loaded through 'filter' against 'want' loaded in full
+static int filter_check(const wchar_t *doc, const wchar_t **filter, int filter_cnt, const wchar_t *want)
+{
+	int ret;
+	struct xml_element *tree;
+	struct xml_element *full;
+
+	if (write_doc(want))
+		return -1;
+
+	full = xml_load_file(TEST_FILE_W);
+	if (full == NULL || write_doc(doc)) {
+		xml_free_all(full);
+		return -1;
+	}
+
+	tree = xml_load_file_filter(TEST_FILE_W, filter, filter_cnt);
+	ret = tree && xml_equal(tree, full) ? 0 : -1;
+
+	xml_free_all(tree);
+	xml_free_all(full);
+
+	return ret;
+}
+
+static int test_filter(void)
+{
+	int err;
+	static const wchar_t *doc =
+		L"<?xml version=\"1.0\"?>\r\n<catalog>\r\n<!--c-->\r\n"
+		L"<product id=\"1\" x=\"2\"><price>10</price><name>foo</name><junk><a><b k=\"1\">t</b></a><c/></junk></product>\r\n"
+		L"<other><q>1</q></other>\r\n"
+		L"<product id=\"2\"><price cur=\"e\">20</price><e/><name>n</name></product>\r\n</catalog>\r\n";
+	static const wchar_t *f1[] = {L"/catalog/product/price", L"/catalog/product/@id"};
+	static const wchar_t *f2[] = {L"/catalog/*/name", L"/catalog/other"};
+	static const wchar_t *f3[] = {L"/catalog//name"};
+
+	err = 0;
+	if (filter_check(doc, f1, 2, L"<?xml version=\"1.0\"?><catalog><product id=\"1\"><price>10</price></product>"
+		L"<product id=\"2\"><price cur=\"e\">20</price></product></catalog>")) {
+		fprintf(stderr, "filter: price and id\n");
+		err = -1;
+	}
+
+	if (filter_check(doc, f2, 2, L"<?xml version=\"1.0\"?><catalog><product><name>foo</name></product>"
+		L"<other><q>1</q></other><product><name>n</name></product></catalog>")) {
+		fprintf(stderr, "filter: any name and a whole subtree\n");
+		err = -1;
+	}
+
+	//an empty step is refused
+	if (write_doc(doc) == 0 && xml_load_file_filter(TEST_FILE_W, f3, 1) != NULL) {
+		fprintf(stderr, "filter: an empty step\n");
+		err = -1;
+	}
+
+	remove(TEST_FILE);
+
+	return err;
+}
+
+//the order as text, with comments and elements the schema don't know in between
+static size_t gen_put(wchar_t *p, size_t left, const struct order *o)
+{
+	size_t i;
+	size_t n;
+
+	n = swprintf(p, left, L"<?xml version=\"1.0\"?><!--c--><order id=\"%llu\" side=\"%ls\" x=\"y\">"
+		L"<price>%.17g</price><note>%ls</note><unknown a=\"1\"><deep/><x>t</x></unknown>",
+		o->id, o->side ? L"sell" : L"buy", o->price, o->note.c_str());
+	for (i = 0; i < o->tag.size(); i++)
+		n += swprintf(p + n, left - n, L"<tag>%ls</tag>", o->tag[i].c_str());
+	for (i = 0; i < o->qty.size(); i++)
+		n += swprintf(p + n, left - n, L"<qty> %llu </qty><!--q-->", o->qty[i]);
+	for (i = 0; i < o->item.size(); i++)
+		n += swprintf(p + n, left - n, L"<item sku=\"%ls\"><count>%lld</count><ok>%ls</ok></item>",
+			o->item[i].sku.c_str(), o->item[i].count, o->item[i].ok ? L"true" : L"false");
+	n += swprintf(p + n, left - n, L"<best sku=\"%ls\"><count>%lld</count></best></order>", o->best.sku.c_str(), o->best.count);
+
+	return n;
+}
+
+static int gen_same_item(const struct item *a, const struct item *b)
+{
+	return a->sku == b->sku && a->count == b->count && a->ok == b->ok;
+}
+
+static int gen_same(const struct order *a, const struct order *b)
+{
+	size_t i;
+
+	if (a->id != b->id || a->side != b->side || a->price != b->price || a->note != b->note)
+		return 0;
+	if (a->tag != b->tag || a->qty != b->qty || a->item.size() != b->item.size())
+		return 0;
+	for (i = 0; i < a->item.size(); i++) {
+		if (!gen_same_item(&a->item[i], &b->item[i]))
+			return 0;
+	}
+
+	return gen_same_item(&a->best, &b->best);
+}
+
+/* an order written out from known values must come back the same from the generated parser,
+ * and agree with the tree
+ */
+static int test_gen(void)
+{
+	int i;
+	int j;
+	int err;
+	int side;
+	size_t len;
+	unsigned int seed;
+	unsigned long long id;
+	double price;
+	wchar_t *doc;
+	wchar_t name[32];
+	struct item it;
+	struct order bad;
+	struct xml_element *node;
+	struct xml_element *tree;
+	static const wchar_t *side_tbl[] = {L"buy", L"sell"};
+
+	doc = (wchar_t *)malloc(TEST_GEN_LEN * sizeof(wchar_t));
+	if (doc == NULL)
+		return -1;
+
+	err = 0;
+	seed = 33;
+	for (i = 0; i < TEST_GEN_DOC && err == 0; i++) {
+		struct order in;
+		struct order out;
+
+		in.id = (unsigned long long)core_rand(&seed) << 32 | core_rand(&seed);
+		in.side = core_rand(&seed) % 2;
+		in.price = (double)core_rand(&seed) / 7 - 1000;
+		swprintf(name, 32, L"note %d", i);
+		in.note = name;
+		for (j = core_rand(&seed) % 4; j > 0; j--) {
+			swprintf(name, 32, L"t%u", core_rand(&seed));
+			in.tag.push_back(name);
+			in.qty.push_back(core_rand(&seed));
+		}
+		for (j = core_rand(&seed) % 4; j > 0; j--) {
+			swprintf(name, 32, L"s%u", core_rand(&seed));
+			it.sku = name;
+			it.count = (long long)core_rand(&seed) - 100000;
+			it.ok = core_rand(&seed) % 2;
+			in.item.push_back(it);
+		}
+		in.best.sku = L"best";
+		in.best.count = -i;
+
+		len = gen_put(doc, TEST_GEN_LEN, &in);
+		if (xml_load_order(doc, doc + len, &out) || !gen_same(&in, &out)) {
+			fprintf(stderr, "gen: doc %d don't come back\n", i);
+			err = -1;
+		}
+
+		if (write_doc(doc) || (tree = xml_load_file(TEST_FILE_W)) == NULL) {
+			fprintf(stderr, "gen: doc %d isn't loaded\n", i);
+			err = -1;
+			break;
+		}
+		//the prolog is the root, the comment and the order its children
+		node = xml_search_child(tree, L"order");
+		if (node == NULL || xml_get_attr_u64(node, L"id", &id, 0) || id != out.id ||
+			xml_get_attr_enum(node, L"side", side_tbl, 2, &side) || side != out.side ||
+			xml_get_value_double(xml_search_child(node, L"price"), &price) || price != out.price) {
+			fprintf(stderr, "gen: doc %d differ from the tree\n", i);
+			err = -1;
+		}
+		xml_free_all(tree);
+	}
+	remove(TEST_FILE);
+
+	//a mismatched close or a bad number is refused
+	len = swprintf(doc, TEST_GEN_LEN, L"<order><price>1</prise></order>");
+	if (xml_load_order(doc, doc + len, &bad) == 0) {
+		fprintf(stderr, "gen: a mismatched close is taken\n");
+		err = -1;
+	}
+	len = swprintf(doc, TEST_GEN_LEN, L"<order><price>1x</price></order>");
+	if (xml_load_order(doc, doc + len, &bad) == 0) {
+		fprintf(stderr, "gen: a bad number is taken\n");
+		err = -1;
+	}
+
+	free(doc);
+
+	return err;
+}
+
+//each node as name, its attributes in [] and its children in ()
+static void doc_dump(xml::node n, std::wstring &out)
+{
+	for (xml::node c : n.children()) {
+		out.append(c.name());
+		out += L'[';
+		for (xml::attr a : c.attrs()) {
+			out.append(a.name());
+			out += L'=';
+			out.append(a.value());
+			out += L' ';
+		}
+		out += L']';
+		out.append(c.value());
+		out += L'(';
+		doc_dump(c, out);
+		out += L')';
+	}
+}
+
+static void tree_dump(const struct xml_element *parent, std::wstring &out)
+{
+	int i;
+	const struct xml_element *c;
+
+	for (c = xml_walkdown(parent); c; c = xml_walknext(c)) {
+		out += xml_get_name(c);
+		out += L'[';
+		for (i = 0; i < xml_get_attr_cnt(c); i++) {
+			out += xml_get_attr_name(c, i);
+			out += L'=';
+			out += xml_get_attr_value(c, i);
+			out += L' ';
+		}
+		out += L']';
+		if (xml_get_value(c))
+			out += xml_get_value(c);
+		out += L'(';
+		tree_dump(c, out);
+		out += L')';
+	}
+}
+
+/* the C++ view walk the same nodes and attributes, in the same order, as the C calls. an empty
+ * document or node answer with empty values
+ */
+static int test_document(void)
+{
+	int err;
+	std::wstring a;
+	std::wstring b;
+	xml::document doc;
+	xml::document moved;
+
+	if (write_doc(L"<?xml version=\"1.0\"?><r><a x=\"1\" y=\"2\"><b>v1</b><!--c--><b z=\"3\"/></a>"
+		L"<c><d><e>deep</e></d></c><f/></r>"))
+		return -1;
+
+	err = 0;
+	doc = xml::document::load(TEST_FILE_W);
+	remove(TEST_FILE);
+	if (!doc)
+		return -1;
+
+	doc_dump(doc.root(), a);
+	tree_dump(doc.get(), b);
+	if (a != b || a != L"r[](a[x=1 y=2 ](b[]v1()c[]()b[z=3 ]())c[](d[](e[]deep()))f[]())") {
+		fprintf(stderr, "document: the walk is %ls\n", a.c_str());
+		err = -1;
+	}
+
+	if (doc.root().child(L"r").child(L"a").attr(L"y") != L"2" || doc.root().child(L"r").child(L"a").attr(L"w").data() != NULL ||
+		doc.root().child(L"none").child().next().name().size() != 0 || xml::node().attrs().size() != 0) {
+		fprintf(stderr, "document: a lookup\n");
+		err = -1;
+	}
+
+	//the tree follow a move, the one left behind is empty
+	moved = std::move(doc);
+	a.clear();
+	doc_dump(moved.root(), a);
+	if (doc || doc.root() || a != b) {
+		fprintf(stderr, "document: a move\n");
+		err = -1;
+	}
+
+	a.clear();
+	doc_dump(xml::document::load(L"xml_test_none.xml").root(), a);
+	if (!a.empty())
+		err = -1;
+
+	return err;
+}
+
+/* a chain of TEST_DEEP elements, each with a leaf behind its child. the walk must enter down the
+ * chain, then leave it from the bottom up, meeting each leaf between its brother and its parent
+ */
+static int iter_check(const struct xml_element *tree)
+{
+	int d;
+	int phase;
+	struct xml_iter it;
+
+	d = 0;
+	phase = 0;
+	xml_iter_init(&it, tree, 0);
+	while (xml_iter_next(&it)) {
+		if (it.depth != d)
+			return -1;
+
+		switch (phase) {
+		case 0:
+			//down the chain
+			if (it.event != XML_WALK_ENTER || wcscmp(xml_get_name(it.node), L"n"))
+				return -1;
+			if (d == TEST_DEEP - 1)
+				phase = 1;
+			else
+				d++;
+			break;
+		case 1:
+			//leave an n, its leaf come next
+			if (it.event != XML_WALK_LEAVE || wcscmp(xml_get_name(it.node), L"n"))
+				return -1;
+			phase = 2;
+			break;
+		case 2:
+			if (it.event != XML_WALK_ENTER || wcscmp(xml_get_name(it.node), L"l"))
+				return -1;
+			phase = 3;
+			break;
+		case 3:
+			if (it.event != XML_WALK_LEAVE || wcscmp(xml_get_name(it.node), L"l"))
+				return -1;
+			phase = 1;
+			d--;
+			break;
+		}
+	}
+
+	return d == 0 && phase == 2 ? 0 : -1;
+}
+
+static int test_iter(void)
+{
+	int i;
+	int err;
+	size_t len;
+	wchar_t *doc;
+	std::wstring walk;
+	struct xml_iter it;
+	struct xml_element *tree;
+
+	doc = (wchar_t *)malloc((TEST_DEEP * 12 + 1) * sizeof(wchar_t));
+	if (doc == NULL)
+		return -1;
+
+	len = 0;
+	for (i = 0; i < TEST_DEEP - 1; i++)
+		len += swprintf(doc + len, 4, L"<n>");
+	len += swprintf(doc + len, 5, L"<n/>");
+	for (i = 0; i < TEST_DEEP - 1; i++)
+		len += swprintf(doc + len, 9, L"<l/></n>");
+
+	err = 0;
+	tree = NULL;
+	if (write_doc(doc) || (tree = xml_load_file(TEST_FILE_W)) == NULL || iter_check(tree)) {
+		fprintf(stderr, "iter: the deep walk\n");
+		err = -1;
+	}
+	free(doc);
+
+	//every node freed on its way out, its children are gone by then and the walk don't look back
+	if (tree) {
+		xml_iter_init(&it, tree, 0);
+		while (xml_iter_next(&it)) {
+			if (it.event == XML_WALK_LEAVE)
+				xml_free(it.node);
+		}
+	}
+
+	//a skip leave out the children of the node just entered, the brothers are walked on demand
+	if (write_doc(L"<a><b><c/></b><d/></a><e><f/></e>") || (tree = xml_load_file(TEST_FILE_W)) == NULL)
+		return -1;
+
+	for (i = 0; i < 2; i++) {
+		xml_iter_init(&it, tree, i);
+		while (xml_iter_next(&it)) {
+			walk += it.event == XML_WALK_ENTER ? L'+' : L'-';
+			walk += xml_get_name(it.node);
+			if (it.event == XML_WALK_ENTER && wcscmp(xml_get_name(it.node), L"b") == 0)
+				xml_iter_skip(&it);
+		}
+		walk += L' ';
+	}
+	if (walk != L"+a+b-b+d-d-a +a+b-b+d-d-a+e+f-f-e ") {
+		fprintf(stderr, "iter: the walk is %ls\n", walk.c_str());
+		err = -1;
+	}
+	xml_free_all(tree);
+	remove(TEST_FILE);
+
+	return err;
+}
+
+/* the same random document, front to back through a builder and node by node through xml_new */
+static void build_both(struct xml_builder *b, struct xml_element *parent, unsigned int *seed, int depth)
+{
+	int i;
+	int cnt;
+	wchar_t name[32];
+	wchar_t value[32];
+	struct xml_element *elm;
+
+	cnt = 1 + core_rand(seed) % 4;
+	for (i = 0; i < cnt; i++) {
+		swprintf(name, 32, L"e%u", core_rand(seed) % 8);
+		if (core_rand(seed) % 5 == 0) {
+			swprintf(value, 32, L"c%u", core_rand(seed));
+			xml_builder_comment(b, value, -1);
+			xml_append_child(parent, xml_new(value, NULL, XML_COMMENT));
+		} else if (depth == 0 || core_rand(seed) % 3 == 0) {
+			swprintf(value, 32, L"v %u", core_rand(seed));
+			xml_builder_open(b, name, -1, XML_ELEMENT);
+			xml_builder_text(b, value, -1);
+			xml_builder_close(b);
+			xml_append_child(parent, xml_new(name, value, XML_ELEMENT));
+		} else {
+			xml_builder_open(b, name, -1, XML_ELEMENT);
+			elm = xml_append_child(parent, xml_new(name, NULL, XML_ELEMENT));
+			build_both(b, elm, seed, depth - 1);
+			xml_builder_close(b);
+		}
+	}
+}
+
+/* a builder tree equal the one put together by xml_new, is saved the same and can be edited the
+ * same. what a builder refuse leave no tree
+ */
+static int test_builder(void)
+{
+	int i;
+	int err;
+	int bad;
+	unsigned int seed;
+	std::wstring ta;
+	std::wstring tb;
+	struct xml_builder *b;
+	struct xml_element *a;
+	struct xml_element *n;
+
+	err = 0;
+	seed = 39;
+	for (i = 0; i < TEST_BUILD_DOC && err == 0; i++) {
+		b = xml_builder_new();
+		n = xml_new(L"r", NULL, XML_ELEMENT);
+		if (b == NULL || n == NULL)
+			return -1;
+
+		xml_builder_open(b, L"r", 1, XML_ELEMENT);
+		build_both(b, n, &seed, 1 + i % 5);
+		xml_builder_close(b);
+		a = xml_builder_end(b);
+		if (a == NULL || !xml_equal(a, n)) {
+			fprintf(stderr, "builder: doc %d differ\n", i);
+			err = -1;
+		}
+
+		if (a) {
+			ta.resize(xml_need_len(a) + 1);
+			tb.resize(xml_need_len(n) + 1);
+			if (xml_save_data(a, &ta[0], ta.size()) != xml_save_data(n, &tb[0], tb.size()) || ta != tb) {
+				fprintf(stderr, "builder: doc %d is saved otherwise\n", i);
+				err = -1;
+			}
+
+			//a pooled value is replaced as a malloc one
+			if (xml_walkdown(a) && xml_get_value(xml_walkdown(a)) && (xml_set_value(xml_walkdown(a), L"new") == NULL ||
+				xml_set_value(xml_walkdown(n), L"new") == NULL || !xml_equal(a, n))) {
+				fprintf(stderr, "builder: doc %d once edited\n", i);
+				err = -1;
+			}
+			xml_free_all(a);
+		}
+		xml_free_all(n);
+	}
+
+	//the attributes come out as a parse of the same text would give
+	b = xml_builder_new();
+	if (b == NULL)
+		return -1;
+	xml_builder_open(b, L"r", -1, XML_ELEMENT);
+	xml_builder_attr(b, L"x", -1, L"1", -1);
+	xml_builder_attr(b, L"yy", 1, L"22", 1);
+	xml_builder_open(b, L"s", -1, XML_ELEMENT);
+	xml_builder_text(b, L"t", -1);
+	xml_builder_close(b);
+	xml_builder_close(b);
+	a = xml_builder_end(b);
+	if (write_doc(L"<r x=\"1\" y=\"2\"><s>t</s></r>") || (n = xml_load_file(TEST_FILE_W)) == NULL)
+		return -1;
+	remove(TEST_FILE);
+	if (a == NULL || !xml_equal(a, n)) {
+		fprintf(stderr, "builder: the attributes\n");
+		err = -1;
+	}
+	xml_free_all(a);
+	xml_free_all(n);
+
+	//text beside a child, an attribute after it or an element left open
+	bad = 0;
+	b = xml_builder_new();
+	xml_builder_open(b, L"r", -1, XML_ELEMENT);
+	xml_builder_open(b, L"s", -1, XML_ELEMENT);
+	xml_builder_close(b);
+	if (xml_builder_text(b, L"t", -1) == 0)
+		bad = 1;
+	if (xml_builder_end(b) != NULL)
+		bad = 1;
+	b = xml_builder_new();
+	xml_builder_open(b, L"r", -1, XML_ELEMENT);
+	xml_builder_comment(b, L"c", -1);
+	if (xml_builder_attr(b, L"x", -1, L"1", -1) == 0)
+		bad = 1;
+	if (xml_builder_end(b) != NULL)
+		bad = 1;
+	b = xml_builder_new();
+	xml_builder_open(b, L"r", -1, XML_ELEMENT);
+	if (xml_builder_end(b) != NULL)
+		bad = 1;
+	if (bad) {
+		fprintf(stderr, "builder: a refused call\n");
+		err = -1;
+	}
+
+	return err;
+}
+
+/* a compact copy equal the tree it come from and is saved the same, into a block of its own or
+ * in place of the tree. a block too small give nothing
+ */
+static int test_compact(void)
+{
+	int i;
+	int err;
+	size_t size;
+	unsigned int seed;
+	void *buff;
+	wchar_t *doc;
+	std::wstring ta;
+	std::wstring tb;
+	struct xml_element *a;
+	struct xml_element *b;
+	struct xml_element *c;
+
+	doc = new wchar_t[TEST_CORE_LEN];
+	err = 0;
+	seed = 40;
+	for (i = 0; i < TEST_COMPACT_DOC && err == 0; i++) {
+		core_gen(doc, TEST_CORE_LEN, &seed, 0);
+		if (write_doc(doc) || (a = xml_load_file(TEST_FILE_W)) == NULL || (b = xml_load_file(TEST_FILE_W)) == NULL) {
+			fprintf(stderr, "compact: doc %d isn't loaded\n", i);
+			err = -1;
+			break;
+		}
+
+		size = xml_compact_size(b);
+		buff = malloc(size);
+		if (buff == NULL || xml_compact_to(b, buff, size - 8) != NULL) {
+			fprintf(stderr, "compact: doc %d fit a small block\n", i);
+			err = -1;
+		}
+
+		c = buff ? xml_compact_to(b, buff, size) : NULL;
+		if (c == NULL || !xml_equal(c, b)) {
+			fprintf(stderr, "compact: doc %d differ in a block\n", i);
+			err = -1;
+		}
+
+		//'a' is gone, its copy stand for it
+		a = xml_compact(a);
+		if (a == NULL || !xml_equal(a, b)) {
+			fprintf(stderr, "compact: doc %d differ in place\n", i);
+			err = -1;
+		}
+
+		if (a) {
+			ta.resize(xml_need_len(a) + 1);
+			tb.resize(xml_need_len(b) + 1);
+			if (xml_save_data(a, &ta[0], ta.size()) != xml_save_data(b, &tb[0], tb.size()) || ta != tb) {
+				fprintf(stderr, "compact: doc %d is saved otherwise\n", i);
+				err = -1;
+			}
+			xml_free_all(a);
+		}
+
+		free(buff);
+		xml_free_all(b);
+	}
+
+	delete[] doc;
+	remove(TEST_FILE);
+
+	return err;
+}
+
+//the 'n' of the root, read with the cache on, a tree so marked take more room
+static long long cache_mark(const struct xml_element *tree)
+{
+	long long v;
+
+	if (tree == NULL || xml_get_attr_i64(tree, L"n", &v, 1) != XML_CONV_OK)
+		return -1;
+
+	return v;
+}
+
+/* a file asked again is a hit on the same tree, one written since is parsed again while the old
+ * tree stay good for whoever hold it. past the budget the least recently used go first
+ */
+static int test_cache(void)
+{
+	int i;
+	int err;
+	int bad;
+	size_t size;
+	size_t marked;
+	char path[TEST_CACHE_FILE][32];
+	wchar_t wpath[TEST_CACHE_FILE][32];
+	wchar_t doc[64];
+	const struct xml_element *t[TEST_CACHE_FILE];
+	const struct xml_element *held;
+	struct xml_cache *cache;
+
+	for (i = 0; i < TEST_CACHE_FILE; i++) {
+		sprintf(path[i], "xml_test_c%d.xml", i);
+		swprintf(wpath[i], 32, L"xml_test_c%d.xml", i);
+		swprintf(doc, 64, L"<r n=\"%d\"><e>value</e></r>", 10 + i);
+		if (write_file(path[i], doc))
+			return -1;
+	}
+
+	cache = xml_cache_create((size_t)-1);
+	if (cache == NULL)
+		return -1;
+
+	err = 0;
+	t[0] = xml_cache_get(cache, wpath[0]);
+	if (t[0] == NULL)
+		return -1;
+
+	size = xml_mem_size(t[0]);
+	held = xml_cache_get(cache, wpath[0]);
+	cache_mark(held);
+	marked = xml_mem_size(t[0]);
+	if (held != t[0] || cache_mark(held) != 10 || marked <= size) {
+		fprintf(stderr, "cache: a hit\n");
+		err = -1;
+	}
+	if (held)
+		xml_cache_put(cache, held);
+
+	//the same size, only the mtime tell the text changed. a FAT mtime go by 2 seconds
+	std::this_thread::sleep_for(std::chrono::milliseconds(2100));
+	if (write_file(path[0], L"<r n=\"20\"><e>value</e></r>"))
+		err = -1;
+	t[1] = xml_cache_get(cache, wpath[0]);
+	if (t[1] == NULL || t[1] == t[0] || cache_mark(t[1]) != 20 || cache_mark(t[0]) != 10) {
+		fprintf(stderr, "cache: a changed file\n");
+		err = -1;
+	}
+	//the stale tree go with its last holder
+	xml_cache_put(cache, t[0]);
+	if (t[1]) {
+		if (xml_cache_get(cache, wpath[0]) != t[1])
+			err = -1;
+		xml_cache_put(cache, t[1]);
+		xml_cache_put(cache, t[1]);
+	}
+	xml_cache_release(cache);
+
+	//room for two trees, a third push out the one used longest ago
+	cache = xml_cache_create(size * 2 + size / 2);
+	if (cache == NULL)
+		return -1;
+
+	bad = 0;
+	for (i = 0; i < TEST_CACHE_FILE; i++) {
+		t[i] = xml_cache_get(cache, wpath[i]);
+		if (t[i] == NULL)
+			return -1;
+		cache_mark(t[i]);
+		xml_cache_put(cache, t[i]);
+
+		//the first one is used again before the third come in
+		if (i == 1) {
+			held = xml_cache_get(cache, wpath[0]);
+			if (held != t[0] || xml_mem_size(held) != marked)
+				bad = 1;
+			xml_cache_put(cache, held);
+		}
+	}
+
+	held = xml_cache_get(cache, wpath[0]);
+	if (held != t[0] || xml_mem_size(held) != marked)
+		bad = 1;
+	xml_cache_put(cache, held);
+	held = xml_cache_get(cache, wpath[1]);
+	if (held == NULL || xml_mem_size(held) != size)
+		bad = 1;
+	if (held)
+		xml_cache_put(cache, held);
+	if (bad) {
+		fprintf(stderr, "cache: the eviction\n");
+		err = -1;
+	}
+
+	xml_cache_release(cache);
+	for (i = 0; i < TEST_CACHE_FILE; i++)
+		remove(path[i]);
+
+	return err;
+}
+
+//one UTF-16 unit, in the byte order asked
+static void utf16_unit(std::string &out, unsigned int u, int be)
+{
+	out += (char)(be ? u >> 8 : u & 0xff);
+	out += (char)(be ? u & 0xff : u >> 8);
+}
+
+//'doc' as UTF-16, a char past the BMP as a pair of surrogates whatever the width of our wchar_t
+static int write_utf16(const std::wstring &doc, int be, int bom)
+{
+	size_t i;
+	unsigned int c;
+	std::string out;
+	FILE *fp;
+
+	if (bom)
+		utf16_unit(out, 0xfeff, be);
+	for (i = 0; i < doc.size(); i++) {
+		c = (unsigned int)doc[i];
+		if (c >= 0x10000) {
+			utf16_unit(out, 0xd800 + ((c - 0x10000) >> 10), be);
+			c = 0xdc00 + ((c - 0x10000) & 0x3ff);
+		}
+		utf16_unit(out, c, be);
+	}
+
+	fp = fopen(TEST_FILE, "wb");
+	if (fp == NULL)
+		return -1;
+
+	fwrite(out.data(), 1, out.size(), fp);
+	fclose(fp);
+
+	return 0;
+}
+
+/* a document in UTF-16 of either order, told by its BOM or by its first '<', load as the same
+ * document in our wchar_t. the pairs of surrogates are whole whatever the blocks cut, the one
+ * that make no pair is kept as it is
+ */
+static int test_utf16(void)
+{
+	int i;
+	int j;
+	int err;
+	std::wstring doc;
+	std::wstring text;
+	struct xml_element *tree;
+	struct xml_element *want;
+	static const int block[][2] = {{3, 2}, {7, 2}, {64, 3}};
+
+	text = L"a\u00e9\U0001F600b\U0010FFFFcdefghijklm\U0001F600nopqrstuvwxyz\U00010000";
+	if (sizeof(wchar_t) == 4) {
+		text += (wchar_t)0xd800;
+		text += L'x';
+	}
+	doc = L"<?xml version=\"1.0\" encoding=\"UTF-16\"?><r a=\"" + text + L"\"><e>" + text + L"</e><!--" +
+		text + L"--></r>";
+	for (i = 0; i < 8; i++)
+		doc.insert(doc.size() - 4, L"<f>\U0001F601\U0001F602\U0001F603\U0001F604</f>");
+
+	if (write_doc(doc.c_str()) || (want = xml_load_file(TEST_FILE_W)) == NULL)
+		return -1;
+
+	tree = xml_search_child(want, L"r");
+	if (tree == NULL || xml_get_attr(tree, L"a") == NULL || text != xml_get_attr(tree, L"a") ||
+		xml_search_child(tree, L"e") == NULL || text != xml_get_value(xml_search_child(tree, L"e"))) {
+		fprintf(stderr, "utf16: the native doc\n");
+		xml_free_all(want);
+		return -1;
+	}
+
+	err = 0;
+	//LE and BE, with a BOM then without
+	for (i = 0; i < 4; i++) {
+		if (write_utf16(doc, i & 1, i < 2)) {
+			err = -1;
+			break;
+		}
+
+		tree = xml_load_file(TEST_FILE_W);
+		if (tree == NULL || !xml_equal(tree, want)) {
+			fprintf(stderr, "utf16: %s %s\n", i & 1 ? "BE" : "LE", i < 2 ? "with a BOM" : "guessed");
+			err = -1;
+		}
+		xml_free_all(tree);
+
+		for (j = 0; j < (int)(sizeof(block) / sizeof(block[0])); j++) {
+			tree = xml_load_file_pipe(TEST_FILE_W, block[j][0], block[j][1]);
+			if (tree == NULL || !xml_equal(tree, want)) {
+				fprintf(stderr, "utf16: %s %s, blocks of %d\n", i & 1 ? "BE" : "LE", i < 2 ? "with a BOM" : "guessed", block[j][0]);
+				err = -1;
+			}
+			xml_free_all(tree);
+		}
+	}
+
+	xml_free_all(want);
+	remove(TEST_FILE);
+
+	return err;
+}
+
+#ifdef XML_WITH_SHM
+static int shm_moved(const struct xml_element *tree)
+{
+	return (size_t)tree < TEST_SHM_BASE || (size_t)tree >= TEST_SHM_BASE + 2 * TEST_SHM_SLOT;
+}
+
+/* a worker follow the master through three generations, the last one is gone before it is
+ * mapped. with 'block' the slots are taken and each tree must be moved to where it land
+ */
+static int shm_worker(int in, int out, int block, struct xml_element **tree)
+{
+	int err;
+	char c;
+	void *p;
+	struct xml_shm *shm;
+
+	if (block) {
+		p = mmap((void *)TEST_SHM_BASE, 2 * TEST_SHM_SLOT, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		//somewhere else, the range is taken already
+		if (p != MAP_FAILED && p != (void *)TEST_SHM_BASE)
+			munmap(p, 2 * TEST_SHM_SLOT);
+	}
+
+	err = 0;
+	shm = xml_shm_open(TEST_SHM_NAME);
+	if (shm == NULL)
+		return -1;
+
+	if (xml_shm_gen(shm) != 1 || !xml_equal(xml_shm_tree(shm), tree[0]) || shm_moved(xml_shm_tree(shm)) != block) {
+		fprintf(stderr, "shm: the first generation\n");
+		err = -1;
+	}
+
+	if (write(out, "1", 1) != 1 || read(in, &c, 1) != 1)
+		err = -1;
+	if (xml_shm_refresh(shm) != 1 || xml_shm_gen(shm) != 2 || !xml_equal(xml_shm_tree(shm), tree[1]) ||
+		shm_moved(xml_shm_tree(shm)) != block) {
+		fprintf(stderr, "shm: the second generation\n");
+		err = -1;
+	}
+
+	//the third is announced but gone, the second stay
+	if (write(out, "2", 1) != 1 || read(in, &c, 1) != 1)
+		err = -1;
+	if (xml_shm_refresh(shm) != -1 || xml_shm_gen(shm) != 2 || !xml_equal(xml_shm_tree(shm), tree[1])) {
+		fprintf(stderr, "shm: a failed refresh\n");
+		err = -1;
+	}
+
+	xml_shm_close(shm);
+
+	return err;
+}
+
+/* publish, open and refresh across a fork, once at the address the master built at and once
+ * moved elsewhere
+ */
+static int test_shm(void)
+{
+	int i;
+	int err;
+	int block;
+	int status;
+	int down[2];
+	int up[2];
+	char c;
+	pid_t pid;
+	unsigned int seed;
+	wchar_t *doc;
+	struct xml_element *tree[3];
+
+	doc = new wchar_t[TEST_CORE_LEN];
+	seed = 46;
+	err = 0;
+	for (i = 0; i < 3; i++) {
+		core_gen(doc, TEST_CORE_LEN, &seed, 0);
+		tree[i] = NULL;
+		if (write_doc(doc) || (tree[i] = xml_load_file(TEST_FILE_W)) == NULL)
+			err = -1;
+	}
+	delete[] doc;
+	remove(TEST_FILE);
+
+	if (err || xml_shm_set_base(TEST_SHM_BASE, TEST_SHM_SLOT)) {
+		err = -1;
+		goto out;
+	}
+
+	for (block = 0; block < 2 && err == 0; block++) {
+		xml_shm_remove(TEST_SHM_NAME);
+		if (xml_shm_publish(TEST_SHM_NAME, tree[0]) || pipe(down) || pipe(up)) {
+			err = -1;
+			break;
+		}
+
+		fflush(stderr);
+		pid = fork();
+		if (pid == 0) {
+			close(down[1]);
+			close(up[0]);
+			_exit(shm_worker(down[0], up[1], block, tree) ? 1 : 0);
+		}
+
+		close(down[0]);
+		close(up[1]);
+		if (pid == -1 || read(up[0], &c, 1) != 1 || xml_shm_publish(TEST_SHM_NAME, tree[1]) || write(down[1], "1", 1) != 1)
+			err = -1;
+		if (err == 0 && (read(up[0], &c, 1) != 1 || xml_shm_publish(TEST_SHM_NAME, tree[2]) || xml_shm_remove(TEST_SHM_NAME)))
+			err = -1;
+		if (write(down[1], "2", 1) != 1)
+			err = -1;
+		close(down[1]);
+		close(up[0]);
+
+		if (pid == -1 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			fprintf(stderr, "shm: the worker, %s\n", block ? "moved" : "in place");
+			err = -1;
+		}
+	}
+
+	xml_shm_remove(TEST_SHM_NAME);
+out:
+	for (i = 0; i < 3; i++)
+		xml_free_all(tree[i]);
+
+	return err;
+}
+#endif
+
+/* the typed reads at the edges of their range, on bad text and on what is missing. a cached
+ * read keep its answer in the attribute, once
+ */
+static int test_typed(void)
+{
+	int b;
+	int e;
+	int err;
+	size_t size;
+	long long i;
+	unsigned long long u;
+	double d;
+	struct xml_element *tree;
+	static const wchar_t *table[] = {L"red", L"green", L"blue"};
+
+	if (write_doc(L"<r max=\"9223372036854775807\" over=\"9223372036854775808\" min=\"-9223372036854775808\" "
+		L"neg=\"-1\" sp=\" 42 \" bad=\"4x\" d=\"-1.25e-3\" big=\"1e400\" long=\"0.30000000000000001665\" "
+		L"t=\"true\" f=\"0\" c=\"green\">18446744073709551615</r>"))
+		return -1;
+
+	tree = xml_load_file(TEST_FILE_W);
+	remove(TEST_FILE);
+	if (tree == NULL)
+		return -1;
+
+	err = 0;
+	if (xml_get_attr_i64(tree, L"max", &i, 0) != XML_CONV_OK || i != 9223372036854775807LL)
+		err = -1;
+	if (xml_get_attr_i64(tree, L"over", &i, 0) != XML_CONV_RANGE)
+		err = -1;
+	if (xml_get_attr_i64(tree, L"min", &i, 0) != XML_CONV_OK || i != -9223372036854775807LL - 1)
+		err = -1;
+	if (xml_get_attr_u64(tree, L"over", &u, 0) != XML_CONV_OK || u != 9223372036854775808ULL)
+		err = -1;
+	if (xml_get_attr_u64(tree, L"neg", &u, 0) != XML_CONV_RANGE)
+		err = -1;
+	if (xml_get_attr_i64(tree, L"sp", &i, 0) != XML_CONV_OK || i != 42)
+		err = -1;
+	if (xml_get_attr_i64(tree, L"bad", &i, 0) != XML_CONV_FORMAT || xml_get_attr_i64(tree, L"none", &i, 0) != XML_CONV_MISSING)
+		err = -1;
+	if (xml_get_attr_double(tree, L"d", &d, 0) != XML_CONV_OK || d != -1.25e-3)
+		err = -1;
+	if (xml_get_attr_double(tree, L"big", &d, 0) != XML_CONV_RANGE)
+		err = -1;
+	//past the exact path, the fallback must still read the '.'
+	if (xml_get_attr_double(tree, L"long", &d, 0) != XML_CONV_OK || d != 0.30000000000000001665)
+		err = -1;
+	if (xml_get_attr_bool(tree, L"t", &b, 0) != XML_CONV_OK || b != 1 || xml_get_attr_bool(tree, L"f", &b, 0) != XML_CONV_OK || b != 0)
+		err = -1;
+	if (xml_get_attr_enum(tree, L"c", table, 3, &e) != XML_CONV_OK || e != 1 || xml_get_attr_enum(tree, L"t", table, 3, &e) != XML_CONV_FORMAT)
+		err = -1;
+	if (xml_get_value_u64(tree, &u) != XML_CONV_OK || u != 18446744073709551615ULL || xml_get_value_i64(tree, &i) != XML_CONV_RANGE)
+		err = -1;
+	if (err)
+		fprintf(stderr, "typed: a conversion\n");
+
+	//the first cached read of an attribute take room for its answer, an error too
+	size = xml_mem_size(tree);
+	if (xml_get_attr_i64(tree, L"sp", &i, 1) != XML_CONV_OK || i != 42 || xml_mem_size(tree) <= size)
+		err = -1;
+
+	size = xml_mem_size(tree);
+	if (xml_get_attr_i64(tree, L"sp", &i, 1) != XML_CONV_OK || i != 42 || xml_mem_size(tree) != size)
+		err = -1;
+	if (xml_get_attr_i64(tree, L"bad", &i, 1) != XML_CONV_FORMAT || xml_mem_size(tree) <= size)
+		err = -1;
+
+	size = xml_mem_size(tree);
+	if (xml_get_attr_i64(tree, L"bad", &i, 1) != XML_CONV_FORMAT || xml_mem_size(tree) != size)
+		err = -1;
+	//another type is read again, the cache is left as it is
+	if (xml_get_attr_double(tree, L"sp", &d, 1) != XML_CONV_OK || d != 42 || xml_mem_size(tree) != size)
+		err = -1;
+	if (xml_get_attr_i64(tree, L"sp", &i, 1) != XML_CONV_OK || i != 42)
+		err = -1;
+	if (err)
+		fprintf(stderr, "typed: the cache\n");
+
+	xml_free_all(tree);
+
+	return err;
+}
+
+/* a batch where every third path is missing and every fifth file cut short, each slot must hold
+ * the tree of its own path or NULL, whatever the number of threads
+ */
+static int test_many(void)
+{
+	int i;
+	int t;
+	int err;
+	int fail;
+	long long v;
+	char path[TEST_MANY][32];
+	wchar_t wpath[TEST_MANY][32];
+	wchar_t doc[64];
+	const wchar_t *list[TEST_MANY];
+	struct xml_element *tree[TEST_MANY];
+	static const int thread[] = {1, 3, 0, TEST_MANY * 2};
+
+	fail = 0;
+	for (i = 0; i < TEST_MANY; i++) {
+		snprintf(path[i], sizeof(path[i]), "xml_test_%d.xml", i);
+		swprintf(wpath[i], 32, L"xml_test_%d.xml", i);
+		list[i] = wpath[i];
+		if (i % 3 == 2) {
+			fail++;
+			continue;
+		}
+
+		if (i % 5 == 4) {
+			swprintf(doc, 64, L"<r n=\"%d\"><e>", i);
+			fail++;
+		} else {
+			swprintf(doc, 64, L"<r n=\"%d\"><e/></r>", i);
+		}
+
+		if (write_file(path[i], doc))
+			return -1;
+	}
+
+	err = 0;
+	for (t = 0; t < (int)(sizeof(thread) / sizeof(thread[0])) && err == 0; t++) {
+		if (xml_load_many(list, TEST_MANY, tree, thread[t]) != fail)
+			err = -1;
+
+		for (i = 0; i < TEST_MANY; i++) {
+			if ((i % 3 == 2 || i % 5 == 4) != (tree[i] == NULL))
+				err = -1;
+			else if (tree[i] && (xml_get_attr_i64(tree[i], L"n", &v, 0) || v != i))
+				err = -1;
+
+			xml_free_all(tree[i]);
+		}
+
+		if (err)
+			fprintf(stderr, "many: %d threads\n", thread[t]);
+	}
+
+	for (i = 0; i < TEST_MANY; i++)
+		remove(path[i]);
+
+	return err;
+}
+
+struct diff_note {
+	int			cnt;
+	const struct xml_element	*a;
+	const struct xml_element	*b;
+};
+
+static void diff_cb(void *ud, const struct xml_element *a, const struct xml_element *b)
+{
+	struct diff_note *note;
+
+	note = (struct diff_note *)ud;
+	note->cnt++;
+	note->a = a;
+	note->b = b;
+}
+
+/* one value is edited in a second load of the same document, xml_equal must see it and
+ * xml_diff report that node alone
+ */
+static int test_diff(void)
+{
+	int err;
+	struct diff_note note;
+	struct xml_element *a;
+	struct xml_element *b;
+	struct xml_element *elm;
+
+	if (write_doc(L"<r><e k=\"1\">v1</e><e k=\"2\"><f>v2</f><g/></e><h>v3</h></r>"))
+		return -1;
+
+	a = xml_load_file(TEST_FILE_W);
+	b = xml_load_file(TEST_FILE_W);
+	remove(TEST_FILE);
+	if (a == NULL || b == NULL) {
+		xml_free_all(a);
+		xml_free_all(b);
+		return -1;
+	}
+
+	err = 0;
+	memset(&note, 0, sizeof(note));
+	if (!xml_equal(a, b) || xml_diff(a, b, diff_cb, &note) != 0)
+		err = -1;
+
+	elm = xml_search_child(xml_walknext(xml_walkdown(b)), L"f");
+	if (elm == NULL || xml_set_value(elm, L"v9") == NULL)
+		err = -1;
+
+	if (err == 0 && (xml_equal(a, b) || xml_diff(a, b, diff_cb, &note) != 1 || note.cnt != 1 ||
+		note.b != elm || note.a == NULL || wcscmp(xml_get_value(note.a), L"v2") != 0))
+		err = -1;
+
+	//and back, the hashes are the same again
+	if (err == 0 && (xml_set_value(elm, L"v2") == NULL || !xml_equal(a, b)))
+		err = -1;
+
+	if (err)
+		fprintf(stderr, "diff: an edited value\n");
+
+	xml_free_all(a);
+	xml_free_all(b);
+
+	return err;
+}
+
+int main(int argc, char* argv[])
+{
+	int err;
+
+	err = 0;
+	if (argc > 2 && strcmp(argv[1], "big") == 0) {
+		err = test_big(strtoull(argv[2], NULL, 10));
+		printf("%s\n", err ? "fail" : "ok");
+		return err ? 1 : 0;
+	}
+
+	err |= test_reload();
+	err |= test_core();
+	err |= test_index();
+	err |= test_filter();
+	err |= test_pipe();
+#ifdef XML_WITH_ZLIB
+	err |= test_gzip();
+#endif
+	err |= test_typed();
+	err |= test_gen();
+	err |= test_document();
+	err |= test_iter();
+	err |= test_builder();
+	err |= test_compact();
+	err |= test_cache();
+	err |= test_utf16();
+#ifdef XML_WITH_SHM
+	err |= test_shm();
+#endif
+	err |= test_many();
+	err |= test_diff();
+	err |= test_big(TEST_BIG_SIZE);
+
+	printf("%s\n", err ? "fail" : "ok");
+
+	return err ? 1 : 0;
+}